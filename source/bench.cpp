@@ -0,0 +1,242 @@
+#include "bench.hpp"
+#include "fs.hpp"
+#include "ui.hpp"
+
+#include <citrus/core.hpp>
+#include <citrus/gpu.hpp>
+#include <citrus/hid.hpp>
+
+#include <sys/errno.h>
+
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+#include <3ds.h>
+
+using namespace ctr;
+
+#define BENCH_DIR "sdmc:/3ds/CTRXplorer/bench"
+#define BENCH_CSV "sdmc:/3ds/CTRXplorer/benchmark.csv"
+#define BENCH_DIR_FILES 256
+#define BENCH_DIR_PASSES 8
+
+#ifndef VERSION_STRING
+#define VERSION_STRING "unknown"
+#endif
+
+const u32 benchBufferSizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+const u32 benchBufferSizeCount = sizeof(benchBufferSizes) / sizeof(benchBufferSizes[0]);
+const char* benchFileTests[] = { "write", "read", "search", "copy", "resize" };
+const u32 benchFileTestCount = sizeof(benchFileTests) / sizeof(benchFileTests[0]);
+const char* benchDirTests[] = { "mkfile", "list", "delete" };
+const u32 benchDirTestCount = sizeof(benchDirTests) / sizeof(benchDirTests[0]);
+
+std::string benchBackendName(FsBackend backend) {
+    return (backend == FS_BACKEND_STDIO) ? "stdio" : "fsuser";
+}
+
+double benchMBps(const BenchResult &result) {
+    return ((double) result.bytes * 1000.0) / ((double) ((result.millis > 0) ? result.millis : 1) * 1024.0 * 1024.0);
+}
+
+double benchOpsps(const BenchResult &result) {
+    return ((double) result.ops * 1000.0) / (double) ((result.millis > 0) ? result.millis : 1);
+}
+
+bool benchStep(const std::string test, const std::string details, u32 step, u32 nSteps) {
+    std::stringstream stream;
+    stream << test << " (" << (step + 1) << "/" << nSteps << ")" << "\n" << details << "\n" << "Hold B to cancel.";
+    uiDisplayProgress(gpu::SCREEN_TOP, "Benchmark", stream.str(), false, (step * 100) / nSteps);
+    hid::poll();
+    if(hid::held(hid::BUTTON_B)) {
+        errno = ECANCELED;
+        return false;
+    }
+    return true;
+}
+
+bool benchFileTest(u32 test, const std::string path, u64 fileSize, u32 bufferSize, BenchResult &result) {
+    const std::string copyPath = path + ".copy";
+    const std::vector<u8> absent = { 0xDE, 0xAD, 0xBE, 0xEF }; // never found in an incrementing pattern
+    bool ret = false;
+
+    result.bytes = fileSize;
+    result.ops = 1;
+    u64 start = core::time();
+    switch(test) {
+        case 0: // write
+            ret = fsCreateDummyFile(path, fileSize, 0x0100, true, false);
+            break;
+        case 1: // read
+            ret = fsFileStream(path, [&](const u8* data, u64 pos, u32 size) { return true; }, false);
+            break;
+        case 2: // search
+            errno = 0;
+            ret = (fsDataSearch(path, absent, 0, false, false) == (u64) -1) && (errno != ECANCELED);
+            break;
+        case 3: // copy
+            ret = fsPathCopy(path, copyPath, true, false);
+            break;
+        case 4: // resize, inserting one buffer in the middle moves the second half
+            result.bytes = fileSize - (fileSize / 2);
+            ret = fsFileResize(path, fileSize / 2, 0, bufferSize, false);
+            break;
+        default:
+            break;
+    }
+    result.millis = core::time() - start;
+
+    if(test == 3) fsPathDelete(copyPath);
+    return ret;
+}
+
+bool benchDirTest(u32 test, const std::string directory, BenchResult &result) {
+    bool ret = true;
+
+    result.bytes = 0;
+    result.ops = 0;
+    u64 start = core::time();
+    switch(test) {
+        case 0: // mkfile
+            ret = fsCreateDir(directory);
+            for(u32 i = 0; ret && (i < BENCH_DIR_FILES); i++, result.ops++) {
+                std::stringstream name;
+                name << directory << "/" << std::setfill('0') << std::setw(4) << i << ".bin";
+                ret = fsCreateDummyFile(name.str(), 0, 0x00, true, false);
+            }
+            break;
+        case 1: // list
+            for(u32 i = 0; ret && (i < BENCH_DIR_PASSES); i++) {
+                fsDirCacheClear(); // otherwise this would time the cache
+                u32 count = fsGetDirectoryContentsEx(directory).size();
+                ret = (count == BENCH_DIR_FILES);
+                result.ops += count;
+            }
+            break;
+        case 2: // delete
+            result.ops = BENCH_DIR_FILES;
+            ret = fsPathDelete(directory);
+            break;
+        default:
+            break;
+    }
+    result.millis = core::time() - start;
+
+    return ret;
+}
+
+bool benchRun(u64 fileSize, std::vector<BenchResult> &results) {
+    const std::string path = std::string(BENCH_DIR) + "/test.bin";
+    const std::string directory = std::string(BENCH_DIR) + "/dir";
+    const FsBackend backends[] = { FS_BACKEND_FSUSER, FS_BACKEND_STDIO };
+    const u32 nBackends = sizeof(backends) / sizeof(backends[0]);
+    const u32 nSteps = (nBackends * benchBufferSizeCount * benchFileTestCount) + benchDirTestCount;
+
+    FsPipeConfig config = fsGetPipeConfig();
+    FsBackend backend = fsGetBackend();
+    bool ret = true;
+    u32 step = 0;
+
+    results.clear();
+    // test file, its copy and one inserted buffer
+    if(fsGetFreeSpace() < (2 * fileSize) + benchBufferSizes[benchBufferSizeCount - 1]) {
+        errno = ENOSPC;
+        return false;
+    }
+    fsCreateDir("sdmc:/3ds");
+    fsCreateDir("sdmc:/3ds/CTRXplorer");
+    if(!fsIsDirectory(BENCH_DIR) && !fsCreateDir(BENCH_DIR)) return false;
+
+    for(u32 b = 0; ret && (b < nBackends); b++) {
+        fsSetBackend(backends[b]);
+        for(u32 s = 0; ret && (s < benchBufferSizeCount); s++) {
+            fsSetPipeConfig(config.bufferCount, benchBufferSizes[s]);
+            for(u32 t = 0; ret && (t < benchFileTestCount); t++, step++) {
+                BenchResult result = { benchFileTests[t], benchBackendName(backends[b]), benchBufferSizes[s], 0, 0, 0 };
+                ret = benchStep(result.test, result.backend + ", " + uiFormatBytes(result.bufferSize) + " buffers", step, nSteps) &&
+                    benchFileTest(t, path, fileSize, result.bufferSize, result);
+                if(ret) results.push_back(result);
+            }
+        }
+    }
+
+    fsSetBackend(backend);
+    fsSetPipeConfig(config.bufferCount, config.bufferSize);
+    for(u32 t = 0; ret && (t < benchDirTestCount); t++, step++) {
+        std::stringstream details;
+        details << BENCH_DIR_FILES << " empty files";
+        BenchResult result = { benchDirTests[t], benchBackendName(backend), 0, 0, 0, 0 };
+        ret = benchStep(result.test, details.str(), step, nSteps) && benchDirTest(t, directory, result);
+        if(ret) results.push_back(result);
+    }
+
+    int errnoPrev = errno;
+    fsPathDelete(BENCH_DIR);
+    fsDirCacheClear();
+    errno = errnoPrev;
+
+    return ret;
+}
+
+std::string benchSummary(const std::vector<BenchResult> &results) {
+    std::stringstream stream;
+    stream << std::fixed << std::setprecision(1);
+    stream << "Benchmark results (MB/s)" << "\n" << "\n";
+    stream << std::left << std::setw(8) << "backend" << std::setw(9) << "buffer" << std::right;
+    for(u32 t = 0; t < benchFileTestCount; t++) stream << std::setw(7) << benchFileTests[t];
+    stream << "\n";
+
+    u32 column = 0;
+    for(std::vector<BenchResult>::const_iterator it = results.begin(); it != results.end(); it++) {
+        if(it->bufferSize == 0) continue;
+        if(column == 0) stream << std::left << std::setw(8) << it->backend << std::setw(9) << uiFormatBytes(it->bufferSize) << std::right;
+        stream << std::setw(7) << benchMBps(*it);
+        if(++column == benchFileTestCount) {
+            stream << "\n";
+            column = 0;
+        }
+    }
+    if(column != 0) stream << "\n";
+
+    stream << "\n";
+    for(std::vector<BenchResult>::const_iterator it = results.begin(); it != results.end(); it++) {
+        if(it->bufferSize != 0) continue;
+        stream << std::left << std::setw(8) << it->test << std::right << std::setw(9) << benchOpsps(*it) << " ops/s" << "\n";
+    }
+
+    return stream.str();
+}
+
+std::string benchCsvPath() {
+    return BENCH_CSV;
+}
+
+bool benchSaveCsv(const std::vector<BenchResult> &results) {
+    // appends, so runs from different builds, consoles and cards end up in one table
+    bool isNew3DS = false;
+    APT_CheckNew3DS(&isNew3DS);
+    bool writeHeader = !fsExists(BENCH_CSV);
+
+    fsDirCacheInvalidate(BENCH_CSV);
+    fsDirSizeInvalidate(BENCH_CSV);
+    FILE* fp = fopen(BENCH_CSV, "a");
+    if(fp == NULL) return false;
+
+    std::stringstream stream;
+    stream << std::fixed << std::setprecision(3);
+    if(writeHeader) stream << "time,version,model,backend,test,buffer_size,bytes,ops,ms,mb_per_s,ops_per_s" << "\n";
+    u64 now = (u64) time(NULL);
+    for(std::vector<BenchResult>::const_iterator it = results.begin(); it != results.end(); it++) {
+        stream << now << "," << VERSION_STRING << "," << (isNew3DS ? "new3ds" : "old3ds") << ",";
+        stream << it->backend << "," << it->test << "," << it->bufferSize << ",";
+        stream << it->bytes << "," << it->ops << "," << it->millis << ",";
+        stream << benchMBps(*it) << "," << benchOpsps(*it) << "\n";
+    }
+
+    std::string str = stream.str();
+    bool ret = (fwrite(str.data(), 1, str.size(), fp) == str.size());
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef __CTRX_BENCH_HPP__
+#define __CTRX_BENCH_HPP__
+
+#include <citrus/types.hpp>
+
+#include <string>
+#include <vector>
+
+typedef struct {
+    std::string test;
+    std::string backend;
+    u32 bufferSize; // 0 if the test does not depend on it
+    u64 bytes;
+    u32 ops;
+    u64 millis;
+} BenchResult;
+
+bool benchRun(u64 fileSize, std::vector<BenchResult> &results);
+std::string benchSummary(const std::vector<BenchResult> &results);
+bool benchSaveCsv(const std::vector<BenchResult> &results);
+std::string benchCsvPath();
+
+#endif
@@ -1,5 +1,7 @@
 #include "fs.hpp"
+#include "prof.hpp"
 #include "ui.hpp"
+#include "zip.hpp"
 
 #include <citrus/core.hpp>
 #include <citrus/hid.hpp>
@@ -12,12 +14,347 @@
 #include <cstdio>
 #include <cstdlib>
 #include <algorithm>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
 
 #include <3ds.h>
 
 using namespace ctr;
 
 #define CTRX_BUFSIZ (1 * 1024 * 1024)
+#define CTRX_BUFCNT 4
+#define CTRX_BUFCNT_MAX 16
+#define CTRX_BUFSIZ_MIN (16 * 1024)
+#define CTRX_STACKSIZ (32 * 1024)
+#define CTRX_SYSCORE_LIMIT 30 // percent of the syscore time the application may use
+#define CTRX_PATHMAX 0x200
+#define CTRX_HORSPOOL_MIN 4
+#define CTRX_DIRCACHE_MAX 16
+#define CTRX_DIRSIZE_MAX 1024
+#define CTRX_DIRREAD_CNT 32
+#define CTRX_XFER_AHEAD 8
+#define CTRX_CLUSTER_DEF 0x8000
+#define CTRX_JOURNAL_MAGIC 0x4A525443 // "CTRJ"
+#define CTRX_JOURNAL_EXT ".ctrx-resize"
+#define CTRX_CACHEDIR "sdmc:/3ds/CTRXplorer"
+#define CTRX_LINEIDX_MAGIC 0x4C525443 // "CTRL"
+#define CTRX_LINEIDX_LINES 1024
+#define CTRX_LINEIDX_BYTES (32 * 1024)
+#define CTRX_LINEIDX_SAMPLE (4 * 1024)
+#define CTRX_LINEIDX_PERSIST (4 * 1024 * 1024)
+#define CTRX_LINEIDX_FILES 16 // saved indexes kept, the oldest go first
+#define CTRX_SESSION_MAGIC 0x53525443 // "CTRS"
+#define CTRX_SESSION_FILE CTRX_CACHEDIR "/session.bin"
+#define CTRX_SESSION_DIRS 8 // most recently used listings kept in the snapshot
+#define CTRX_SESSION_MAX (4 * 1024 * 1024)
+#define CTRX_SETTINGS_MAGIC 0x43525443 // "CTRC"
+#define CTRX_SETTINGS_FILE CTRX_CACHEDIR "/settings.bin"
+#define CTRX_SETTING_JOURNAL (1 << 0)
+#define CTRX_SETTING_VERIFY (1 << 1)
+#define CTRX_SETTING_SPEEDUP (1 << 2)
+#define CTRX_PATCH_EXT ".ctrx-patch"
+#define CTRX_PATCH_EXT_OLD ".ctrx-old"
+#define CTRX_RENAME_EXT ".ctrx-rename"
+#define CTRX_PROGRESS_INTERVAL 50 // ms between progress redraws
+#define CTRX_PROGRESS_RATE_MIN 500 // ms before throughput and time left are shown
+#define CTRX_HASH_BLOCK 64
+#define CTRX_DIFF_GAP 8 // differences closer than this end up in one range
+#define CTRX_ARCHIVE_CACHE (2 * 1024 * 1024) // bytes of central directory entries kept in memory, for all archives together
+
+typedef std::function<bool(u8* buffer, u64 pos, u32 size)> FsPipeFunc;
+
+typedef struct {
+    u32 types;
+    u32 crc32;
+    u32 md5[4];
+    u32 sha256[8];
+    u8 block[CTRX_HASH_BLOCK]; // partial block, MD5 and SHA-256 share the block size
+    u32 blockFill;
+    u64 length;
+} FsHashState;
+
+struct FsMember;
+
+typedef struct {
+    FILE* fp;
+    Handle handle;
+    u64 pos;
+    bool writing; // stdio needs a seek between reads and writes
+    FsMember* member; // set for files inside an archive, which are read only
+} FsFile;
+
+struct FsMember {
+    FsFile archive;
+    ZipReader* reader;
+};
+
+typedef struct {
+    u64 size;
+    time_t mtime;
+    bool valid; // false for files that only look like archives, they are not opened again until they change
+    std::vector<ZipEntry> entries; // sorted by name
+    u64 bytes; // memory the entries take, counted against CTRX_ARCHIVE_CACHE
+    u32 stamp;
+} FsArchive;
+
+typedef struct {
+    u8* data;
+    u32 size;
+    bool linear;
+} FsPipeSlot;
+
+typedef struct {
+    std::vector<u8> pattern;
+    u32 skip[256];
+    u32 skipRev[256];
+} FsSearcher;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 offset;
+    u64 oldsize;
+    u64 newsize;
+    u64 total; // file size before resizing
+    u64 done; // tail bytes moved so far, in the order they get moved
+    u64 chunkPos; // position of the chunk saved after the header
+    u32 chunkSize; // 0 if there is none
+    u32 reserved;
+} FsResizeJournal;
+
+typedef struct {
+    FsPipeSlot* slots;
+    u32 nSlots;
+    u32 slotSize;
+} FsPipePool;
+
+typedef struct {
+    u64 total;
+    FsPipeFunc* onRead;
+    FsPipeFunc* onWrite;
+    FsPipeSlot* slots;
+    u32 nSlots;
+    u32 slotSize;
+    Handle semFree;
+    Handle semFull;
+    volatile u64 posDone;
+    volatile bool abort;
+    volatile bool done;
+    int error;
+} FsPipe;
+
+typedef struct {
+    u64 source; // offset in the original file or in the added data
+    u64 length;
+    bool added;
+} FsPatchPiece;
+
+typedef struct {
+    u64 offset;
+    u64 length;
+    u64 addedPos;
+    u32 addedLength;
+    u32 first; // undo puts removed back in place of the count pieces from first on
+    u32 count;
+    std::vector<FsPatchPiece> removed;
+    u64 size;
+} FsPatchEdit;
+
+struct FsPatch {
+    std::string path;
+    FsFile file;
+    u64 size;
+    std::vector<FsPatchPiece> pieces;
+    std::vector<u8> added; // append only while editing
+    std::vector<FsPatchEdit> edits;
+    u32 revision;
+    Handle mutex; // pieces and added may be read by the prefetch worker
+};
+
+typedef struct {
+    FsFile* file;
+    FsPatch* patch;
+    u64 fileSize;
+    u8* windows[2];
+    bool linear[2];
+    u64 windowOffset[2]; // (u64) -1 if the window holds nothing
+    u32 windowLength[2];
+    u32 windowSize;
+    u32 front; // the window the caller reads from, the worker only touches the other one
+    u64 request;
+    bool busy;
+    bool fresh; // the back window got loaded and was not used yet
+    Thread thread;
+    Handle semRequest;
+    Handle semDone;
+    volatile bool abort;
+} FsPrefetch;
+
+typedef struct {
+    std::vector<FileInfoEx> entries;
+    u32 stamp;
+    bool restored; // from the session snapshot, shown right away but listed once more to check it
+} FsDirCacheEntry;
+
+typedef struct {
+    FsDirSize size;
+    u32 stamp;
+} FsDirSizeEntry;
+
+typedef struct {
+    u32 depth; // nested jobs report into the outermost one
+    u64 base; // bytes of the job done before the current part
+    u64 total; // bytes of the whole job
+    std::string operation;
+    u64 lastPos;
+    u64 lastTotal;
+    u64 start; // of the job, or of the current operation outside of a job
+    u64 lastDraw; // 0 forces a redraw
+} FsProgress;
+
+typedef struct {
+    Thread thread;
+    Handle mutex;
+    bool running; // the worker keeps going until nothing is asked for, guarded by mutex like the rest
+    bool freeWanted;
+    std::vector<std::string> statWanted;
+    bool freeReady;
+    u64 freeSpace;
+    std::vector<std::pair<std::string, FsStat> > stats; // answered, not polled yet
+} FsInfo;
+
+typedef struct {
+    std::string path;
+    std::string dest;
+    u64 size;
+    u32 item;
+    bool isDirectory;
+    s64 replaced; // size of the file this one overwrites, -1 if the target is new
+} FsTransferEntry;
+
+typedef struct {
+    FsFile src;
+    FsFile dst;
+    bool srcOpened;
+    bool dstOpened;
+    bool created; // the folder or target file did not exist before
+    bool deferred; // left to the copy loop, the old target has to go first
+    int error;
+} FsTransferState;
+
+typedef struct {
+    std::vector<FsTransferEntry>* entries;
+    std::vector<FsTransferState>* states;
+    volatile u8* itemFailed; // set by the copy loop, nothing more gets created for that item
+    const u8* itemReplace; // the target has another type and is deleted once the item comes up
+    Handle semAhead;
+    Handle semReady;
+    volatile u32 nPrepared;
+    volatile bool abort;
+} FsTransfer;
+
+struct FsDirStream {
+    std::string dirWithSlash;
+    std::string key;
+    u16 path16[CTRX_PATHMAX];
+    bool useSdmc;
+    std::vector<FileInfoEx> pending; // everything read so far, guarded by mutex
+    u32 delivered;
+    Thread thread;
+    Handle mutex;
+    volatile bool abort;
+    volatile bool done;
+    bool complete;
+    u32 generation;
+};
+
+struct FsDirSizer {
+    std::string directory;
+    std::map<std::string, FsDirSize> known; // subfolder sizes that were cached already
+    std::vector<std::pair<std::string, FsDirSize> > pending; // keys and sizes measured so far, guarded by mutex
+    u32 delivered;
+    Thread thread;
+    Handle mutex;
+    volatile bool abort;
+    u32 generation;
+};
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 fileSize;
+    u64 sample; // hash of the first and last few KiB
+    u64 mtime;
+    u64 lineCount;
+    u64 firstNul;
+    u32 nMarks;
+    u32 reserved;
+} FsLineIndexHeader;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 hexOffset;
+    u64 hexStoredOffset;
+    u32 size; // of everything after the header
+    u32 nFolders;
+} FsSessionHeader;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 flags; // CTRX_SETTING_*
+} FsSettingsHeader;
+
+struct FsLineIndexer {
+    std::string path;
+    std::string cachePath;
+    u64 fileSize;
+    u64 sample;
+    u64 mtime;
+    bool persist; // large files outside archives, sampling the end of a member would inflate all of it
+    std::vector<FsLineMark> pending; // everything found so far, guarded by mutex
+    u64 scanned;
+    u64 lineCount;
+    u64 firstNul;
+    u32 delivered;
+    Thread thread;
+    Handle mutex;
+    volatile bool abort;
+    volatile bool done;
+    bool complete;
+};
+
+u32 fsPipeBufferCount = CTRX_BUFCNT;
+u32 fsPipeBufferSize = CTRX_BUFSIZ;
+
+FsBackend fsBackend = FS_BACKEND_FSUSER;
+bool fsResizeJournal = false;
+bool fsCopyVerify = false;
+u32 fsClusterSize = 0;
+bool fsSpeedupAlways = false;
+u32 fsSpeedupUsers = 0; // long operations running right now, on any thread
+LightLock fsSpeedupLock; // the user count and the clock setting change together
+s32 fsWorkerCore = -3; // not probed yet
+FS_Archive fsSdmcArchive = 0;
+bool fsSdmcArchiveOpen = false;
+
+FsProgress fsProgress = {0, 0, 0, "", 0, 0, 0, 0};
+
+std::map<std::string, FsDirCacheEntry> fsDirCache;
+u32 fsDirCacheStamp = 0;
+u32 fsDirCacheGeneration = 0; // bumped on every invalidation
+std::map<std::string, FsDirSizeEntry> fsDirSizes; // folder sizes, kept up to date by our own operations
+u32 fsDirSizeGeneration = 0; // bumped on every change, results measured before that are dropped
+std::set<std::string> fsLineIndexFiles; // the saved indexes in CTRX_CACHEDIR, by file name
+bool fsLineIndexListed = false;
+std::map<std::string, FsArchive> fsArchives; // by archive path, used from the workers too
+u32 fsArchiveStamp = 0;
+u64 fsArchiveBytes = 0; // of all cached archives
+Handle fsArchiveMutex = 0;
+FsInfo fsInfo = {NULL, 0, false, false, {}, false, 0, {}}; // free space and stats fetched in the background
 
 struct fsAlphabetizeFoldersFiles {
     inline bool operator()(FileInfoEx a, FileInfoEx b) {
@@ -27,42 +364,752 @@ struct fsAlphabetizeFoldersFiles {
     }
 };
 
-bool fsShowProgress(const std::string operationStr, const std::string pathStr, u64 pos, u64 totalSize) {
-    static u32 prevProgress = -1;
-    u32 progress = (u32) ((pos * 100) / totalSize);
-    if(prevProgress != progress) {
-        prevProgress = progress;
-        uiDisplayProgress(gpu::SCREEN_TOP, operationStr, uiTruncateString(pathStr, 36, 0) + "\nPress B to cancel.", true, progress);
+void fsProgressBegin(u64 total) {
+    // everything reported until fsProgressEnd() counts towards one bar of total bytes
+    if(fsProgress.depth++ > 0) return;
+    fsProgress.base = 0;
+    fsProgress.total = total;
+    fsProgress.start = core::time();
+    fsProgress.lastDraw = 0;
+}
+
+void fsProgressAdvance(u64 bytes) {
+    // a part of the job is done, the next one reports from 0 again
+    if(fsProgress.depth > 0) fsProgress.base += bytes;
+}
+
+void fsProgressEnd() {
+    if(fsProgress.depth > 0) fsProgress.depth--;
+    fsProgress.lastDraw = 0;
+}
+
+bool fsShowProgress(const std::string operationStr, const std::string pathStr, u64 pos, u64 totalSize, bool bytes = true) {
+    // redraws and checks for B at most every CTRX_PROGRESS_INTERVAL ms, pos and totalSize are bytes
+    // unless bytes is false (items or just a heartbeat), those only show up outside of a job
+    u64 now = core::time();
+    bool job = (fsProgress.depth > 0);
+    if(!job && ((pos < fsProgress.lastPos) || (totalSize != fsProgress.lastTotal) || (operationStr != fsProgress.operation))) {
+        fsProgress.start = now; // a new operation
+        fsProgress.lastDraw = 0;
+    }
+    fsProgress.operation = operationStr;
+    fsProgress.lastPos = pos;
+    fsProgress.lastTotal = totalSize;
+    if((fsProgress.lastDraw != 0) && (now - fsProgress.lastDraw < CTRX_PROGRESS_INTERVAL)) return true;
+    fsProgress.lastDraw = now;
+    
+    u64 done = pos;
+    u64 total = totalSize;
+    if(job) {
+        done = fsProgress.base + ((bytes) ? pos : 0);
+        total = fsProgress.total;
+        bytes = true;
+    }
+    if(done > total) done = total;
+    
+    u32 progress = (total == 0) ? 0 : 100;
+    if(done < total) // avoid overflowing done * 100 on huge sizes
+        progress = (u32) ((total <= (((u64) -1) / 100)) ? (done * 100) / total : done / (total / 100));
+    
+    std::stringstream details;
+    details << uiTruncateString(pathStr, 36, 0) << "\n";
+    u64 elapsed = now - fsProgress.start;
+    if(bytes && (done > 0) && (elapsed >= CTRX_PROGRESS_RATE_MIN)) {
+        u64 rate = (done * 1000) / elapsed;
+        details << uiFormatBytes(rate) << "/s";
+        if((rate > 0) && (total > done)) {
+            u64 left = (total - done) / rate;
+            details << ", " << std::setfill('0');
+            if(left >= 3600) details << (left / 3600) << ":" << std::setw(2) << ((left / 60) % 60);
+            else details << (left / 60);
+            details << ":" << std::setw(2) << (left % 60) << " left";
+        }
+        details << "\n";
     }
+    details << "Press B to cancel.";
+    uiDisplayProgress(gpu::SCREEN_TOP, operationStr, details.str(), true, progress);
     
     hid::poll();
     return !hid::pressed(hid::BUTTON_B);
 }
 
+void fsSetBackend(FsBackend backend) {
+    fsBackend = backend;
+}
+
+FsBackend fsGetBackend() {
+    return fsBackend;
+}
+
+void fsSetSpeedup(bool always) {
+    LightLock_Lock(&fsSpeedupLock);
+    fsSpeedupAlways = always;
+    osSetSpeedupEnable(fsSpeedupAlways || (fsSpeedupUsers > 0));
+    LightLock_Unlock(&fsSpeedupLock);
+}
+
+bool fsGetSpeedup() {
+    return fsSpeedupAlways;
+}
+
+bool fsHasSpeedup() {
+    bool isNew3ds = false;
+    APT_CheckNew3DS(&isNew3ds);
+    return isNew3ds;
+}
+
+void fsSpeedupBegin() {
+    // New 3DS clock and L2 cache for the duration of a long operation, this is a no-op on the Old 3DS
+    LightLock_Lock(&fsSpeedupLock);
+    if(fsSpeedupUsers++ == 0) osSetSpeedupEnable(true);
+    LightLock_Unlock(&fsSpeedupLock);
+}
+
+void fsSpeedupEnd() {
+    LightLock_Lock(&fsSpeedupLock);
+    if((--fsSpeedupUsers == 0) && !fsSpeedupAlways) osSetSpeedupEnable(false);
+    LightLock_Unlock(&fsSpeedupLock);
+}
+
+void fsWorkerProbe(void* arg) {
+}
+
+s32 fsGetWorkerCore() {
+    // background workers go to a core the main thread does not run on, if there is one:
+    // the extra New 3DS core (needs an extended SYSTEM_MODE_EXT), else the syscore
+    if(fsWorkerCore == -3) {
+        bool isNew3ds = false;
+        APT_CheckNew3DS(&isNew3ds);
+        const s32 cores[] = { isNew3ds ? 2 : -2, 1 };
+        fsWorkerCore = -2;
+        for(u32 i = 0; (i < 2) && (fsWorkerCore == -2); i++) {
+            if(cores[i] < 0) continue;
+            if((cores[i] == 1) && R_FAILED(APT_SetAppCpuTimeLimit(CTRX_SYSCORE_LIMIT))) continue;
+            Thread probe = threadCreate(fsWorkerProbe, NULL, 0x1000, 0x3F, cores[i], false);
+            if(probe == NULL) continue;
+            threadJoin(probe, U64_MAX);
+            threadFree(probe);
+            fsWorkerCore = cores[i];
+        }
+    }
+    return fsWorkerCore;
+}
+
+Thread fsWorkerCreate(ThreadFunc entry, void* arg, s32 prio) {
+    Thread thread = NULL;
+    if(fsGetWorkerCore() >= 0) thread = threadCreate(entry, arg, CTRX_STACKSIZ, prio, fsWorkerCore, false);
+    if(thread == NULL) thread = threadCreate(entry, arg, CTRX_STACKSIZ, prio, -2, false);
+    return thread;
+}
+
+void fsInit() {
+    // before any worker starts: the archive cache and speedup locks and the CRC32 tables for checking members
+    if(fsArchiveMutex == 0) svcCreateMutex(&fsArchiveMutex, false);
+    LightLock_Init(&fsSpeedupLock);
+    fsCrc32Init();
+}
+
+void fsCleanup() {
+    fsDirCacheClear();
+    if(fsInfo.thread != NULL) {
+        threadJoin(fsInfo.thread, U64_MAX);
+        threadFree(fsInfo.thread);
+        fsInfo.thread = NULL;
+    }
+    if(fsInfo.mutex != 0) {
+        svcCloseHandle(fsInfo.mutex);
+        fsInfo.mutex = 0;
+    }
+    if(fsArchiveMutex != 0) {
+        svcCloseHandle(fsArchiveMutex);
+        fsArchiveMutex = 0;
+    }
+    osSetSpeedupEnable(false);
+    if(fsSdmcArchiveOpen) {
+        FSUSER_CloseArchive(fsSdmcArchive);
+        fsSdmcArchiveOpen = false;
+    }
+}
+
+int fsResultErrno(Result res) {
+    // FS result descriptions and the common ones to errno values, EIO for anything not listed
+    switch(R_DESCRIPTION(res)) {
+        case 100 ... 179: // not found: 112 file, 113 path, 120 any entry
+            return ENOENT;
+        case 180 ... 199: // already exists: 180 file, 185 folder
+            return EEXIST;
+        case 200 ... 219: // not enough space
+            return ENOSPC;
+        case 230: // invalid open flags
+        case 700: // invalid read flag
+        case 702: // invalid path
+        case 705: // write beyond the end
+            return EINVAL;
+        case 240: // folder not empty
+            return ENOTEMPTY;
+        case 340: // not formatted
+            return ENODEV;
+        case 390 ... 399: // verification failed
+            return EILSEQ;
+        case 630: // command not allowed
+            return EPERM;
+        case 703: // path too long
+            return ENAMETOOLONG;
+        case 760: // unsupported open flags
+            return ENOTSUP;
+        case 770: // a folder where a file was expected, most calls here are file calls
+            return EISDIR;
+        case RD_NOT_FOUND:
+            return ENOENT;
+        case RD_ALREADY_EXISTS:
+            return EEXIST;
+        case RD_OUT_OF_MEMORY:
+            return ENOMEM;
+        case RD_NOT_AUTHORIZED:
+            return EACCES;
+        case RD_BUSY:
+            return EBUSY;
+        case RD_TIMEOUT:
+            return ETIMEDOUT;
+        case RD_CANCEL_REQUESTED:
+            return ECANCELED;
+        case RD_NOT_IMPLEMENTED:
+            return ENOSYS;
+        case RD_TOO_LARGE:
+            return EFBIG;
+        case RD_INVALID_HANDLE:
+            return EBADF;
+        case RD_OUT_OF_RANGE:
+        case RD_INVALID_POINTER:
+        case RD_INVALID_ADDRESS:
+        case RD_INVALID_SIZE:
+        case RD_MISALIGNED_SIZE:
+        case RD_MISALIGNED_ADDRESS:
+        case RD_INVALID_COMBINATION:
+        case RD_INVALID_ENUM_VALUE:
+        case RD_INVALID_SELECTION:
+            return EINVAL;
+    }
+    return EIO;
+}
+
+std::string fsSdmcPath(const std::string path) {
+    // "sdmc:/dir//file" -> "/dir/file", empty if the path is not on the SD card
+    std::string result;
+    if(path.compare(0, 5, "sdmc:") != 0) return result;
+    for(std::string::const_iterator it = path.begin() + 5; it != path.end(); it++)
+        if((*it != '/') || result.empty() || (result[result.size() - 1] != '/')) result.push_back(*it);
+    if(result.empty() || (result[0] != '/')) result.insert(0, 1, '/');
+    return result;
+}
+
+bool fsSdmcOpenArchive() {
+    // call from the main thread before handing paths to workers
+    if(fsBackend != FS_BACKEND_FSUSER) return false;
+    if(!fsSdmcArchiveOpen)
+        fsSdmcArchiveOpen = R_SUCCEEDED(FSUSER_OpenArchive(&fsSdmcArchive, ARCHIVE_SDMC, fsMakePath(PATH_EMPTY, "")));
+    return fsSdmcArchiveOpen;
+}
+
+bool fsSdmcMakePath(const std::string path, u16* path16) {
+    // path16 must hold CTRX_PATHMAX u16
+    if((fsBackend != FS_BACKEND_FSUSER) || (path.compare(0, 5, "sdmc:") != 0)) return false;
+    if(!fsSdmcOpenArchive()) return false;
+    const std::string sdPath = fsSdmcPath(path);
+    if(sdPath.size() >= CTRX_PATHMAX) return false;
+    ssize_t len = utf8_to_utf16(path16, (const u8*) sdPath.c_str(), CTRX_PATHMAX - 1);
+    if((len <= 0) || (len >= CTRX_PATHMAX)) return false;
+    path16[len] = 0;
+    return true;
+}
+
+bool fsFileOpenPlain(FsFile* file, const std::string path, const char* mode) {
+    // mode is one of "rb", "rb+", "wb"
+    u16 path16[CTRX_PATHMAX];
+    file->fp = NULL;
+    file->handle = 0;
+    file->pos = 0;
+    file->writing = false;
+    file->member = NULL;
+    if(fsSdmcMakePath(path, path16)) {
+        u32 flags = (mode[0] == 'w') ? (FS_OPEN_WRITE | FS_OPEN_CREATE) : FS_OPEN_READ;
+        if(strchr(mode, '+') != NULL) flags |= FS_OPEN_WRITE;
+        Result res = FSUSER_OpenFile(&(file->handle), fsSdmcArchive, fsMakePath(PATH_UTF16, path16), flags, 0);
+        if(R_SUCCEEDED(res) && (mode[0] == 'w')) {
+            res = FSFILE_SetSize(file->handle, 0);
+            if(R_FAILED(res)) FSFILE_Close(file->handle);
+        }
+        if(R_FAILED(res)) {
+            file->handle = 0;
+            errno = fsResultErrno(res);
+            return false;
+        }
+        return true;
+    }
+    file->fp = fopen(path.c_str(), mode);
+    return (file->fp != NULL);
+}
+
+u32 fsFileRead(FsFile* file, u64 offset, void* buffer, u32 size) {
+    if(file->member != NULL) return zipRead(file->member->reader, offset, buffer, size);
+    else if(file->handle != 0) {
+        u32 bytesRead = 0;
+        Result res = FSFILE_Read(file->handle, &bytesRead, offset, buffer, size);
+        if(R_FAILED(res)) {
+            errno = fsResultErrno(res);
+            return 0;
+        }
+        PROF_BYTES(bytesRead);
+        return bytesRead;
+    } else if(file->fp != NULL) {
+        if(((file->pos != offset) || file->writing) && (fseeko(file->fp, (off_t) offset, SEEK_SET) != 0)) return 0;
+        file->writing = false;
+        size_t bytesRead = fread(buffer, 1, size, file->fp);
+        file->pos = offset + bytesRead;
+        PROF_BYTES(bytesRead);
+        return bytesRead;
+    }
+    return 0;
+}
+
+u32 fsFileWrite(FsFile* file, u64 offset, const void* buffer, u32 size) {
+    if(file->handle != 0) {
+        u32 bytesWritten = 0;
+        Result res = FSFILE_Write(file->handle, &bytesWritten, offset, buffer, size, 0);
+        if(R_FAILED(res)) {
+            errno = fsResultErrno(res);
+            return 0;
+        }
+        PROF_BYTES(bytesWritten);
+        return bytesWritten;
+    } else if(file->fp != NULL) {
+        if(((file->pos != offset) || !file->writing) && (fseeko(file->fp, (off_t) offset, SEEK_SET) != 0)) return 0;
+        file->writing = true;
+        size_t bytesWritten = fwrite(buffer, 1, size, file->fp);
+        file->pos = offset + bytesWritten;
+        PROF_BYTES(bytesWritten);
+        return bytesWritten;
+    }
+    return 0;
+}
+
+bool fsFileSetSize(FsFile* file, u64 size) {
+    if(file->handle != 0) {
+        Result res = FSFILE_SetSize(file->handle, size);
+        if(R_FAILED(res)) errno = fsResultErrno(res);
+        return R_SUCCEEDED(res);
+    } else if(file->fp != NULL) {
+        fflush(file->fp);
+        return (ftruncate(fileno(file->fp), size) == 0);
+    }
+    return false;
+}
+
+bool fsFileFlush(FsFile* file) {
+    if(file->handle != 0) return R_SUCCEEDED(FSFILE_Flush(file->handle));
+    else if(file->fp != NULL) return (fflush(file->fp) == 0);
+    return false;
+}
+
+void fsFileClose(FsFile* file) {
+    if(file->member != NULL) {
+        zipClose(file->member->reader);
+        fsFileClose(&file->member->archive);
+        delete file->member;
+        file->member = NULL;
+    }
+    if(file->handle != 0) FSFILE_Close(file->handle);
+    if(file->fp != NULL) fclose(file->fp);
+    file->handle = 0;
+    file->fp = NULL;
+}
+
+void fsArchiveLock() {
+    // the archive cache is shared with the workers, the mutex comes from fsInit
+    svcWaitSynchronization(fsArchiveMutex, U64_MAX);
+}
+
+void fsArchiveUnlock() {
+    svcReleaseMutex(fsArchiveMutex);
+}
+
+std::string::size_type fsArchiveSlash(const std::string path, std::string::size_type from) {
+    // end of the first path component starting at from or later that is named like an archive, npos if there is none
+    for(std::string::size_type pos = from; pos <= path.size();) {
+        std::string::size_type end = path.find('/', pos);
+        if(end == std::string::npos) end = path.size();
+        if((end - pos > 4) && (strncasecmp(path.c_str() + end - 4, ".zip", 4) == 0)) return end;
+        pos = end + 1;
+    }
+    return std::string::npos;
+}
+
+FsArchive* fsArchiveGet(const std::string path, std::string &archivePath, std::string &member) {
+    // the archive that path is in or the archive itself, member is the rest of the path without slashes;
+    // NULL for paths outside of archives, call with the archive lock held
+    for(std::string::size_type end = fsArchiveSlash(path, 0); end != std::string::npos; end = fsArchiveSlash(path, end + 1)) {
+        const std::string candidate = path.substr(0, end);
+        struct stat st;
+        if(stat(candidate.c_str(), &st) != 0) return NULL; // nothing deeper can exist either
+        if(S_ISDIR(st.st_mode)) continue; // a folder that happens to be called .zip
+
+        std::map<std::string, FsArchive>::iterator it = fsArchives.find(candidate);
+        if((it != fsArchives.end()) && ((it->second.size != (u64) st.st_size) || (it->second.mtime != st.st_mtime))) {
+            fsArchiveBytes -= it->second.bytes;
+            fsArchives.erase(it);
+            it = fsArchives.end();
+        }
+        if(it == fsArchives.end()) {
+            FsArchive archive;
+            archive.size = st.st_size;
+            archive.mtime = st.st_mtime;
+            archive.valid = false;
+            archive.bytes = 0;
+            FsFile file;
+            if(fsFileOpenPlain(&file, candidate, "rb")) {
+                archive.valid = zipReadDirectory(archive.size, [&](u64 offset, void* buffer, u32 size) { return fsFileRead(&file, offset, buffer, size); }, archive.entries);
+                fsFileClose(&file);
+            }
+            for(std::vector<ZipEntry>::const_iterator e = archive.entries.begin(); e != archive.entries.end(); e++)
+                archive.bytes += sizeof(ZipEntry) + e->name.capacity();
+            // least recently used first, the new one stays even if it is over the budget on its own
+            while(!fsArchives.empty() && (fsArchiveBytes + archive.bytes > CTRX_ARCHIVE_CACHE)) {
+                std::map<std::string, FsArchive>::iterator oldest = fsArchives.begin();
+                for(std::map<std::string, FsArchive>::iterator a = fsArchives.begin(); a != fsArchives.end(); a++)
+                    if(a->second.stamp < oldest->second.stamp) oldest = a;
+                fsArchiveBytes -= oldest->second.bytes;
+                fsArchives.erase(oldest);
+            }
+            fsArchiveBytes += archive.bytes;
+            it = fsArchives.insert(std::make_pair(candidate, archive)).first;
+        }
+        it->second.stamp = ++fsArchiveStamp;
+        if(!it->second.valid) return NULL;
+
+        archivePath = candidate;
+        member.clear();
+        for(std::string::const_iterator c = path.begin() + end; c != path.end(); c++)
+            if((*c != '/') || (!member.empty() && (member[member.size() - 1] != '/'))) member.push_back(*c);
+        if(!member.empty() && (member[member.size() - 1] == '/')) member.erase(member.size() - 1);
+        return &it->second;
+    }
+    return NULL;
+}
+
+const ZipEntry* fsArchiveEntry(const FsArchive* archive, const std::string member) {
+    std::vector<ZipEntry>::const_iterator it = std::lower_bound(archive->entries.begin(), archive->entries.end(), member,
+        [](const ZipEntry &entry, const std::string &name) { return entry.name < name; });
+    return ((it != archive->entries.end()) && (it->name == member)) ? &(*it) : NULL;
+}
+
+bool fsArchiveReadOnly(const std::string path) {
+    // true with errno set for paths inside archives, nothing in there can be changed, the archive itself can
+    if(fsArchiveSlash(path, 0) == std::string::npos) return false;
+    std::string archivePath;
+    std::string member;
+    fsArchiveLock();
+    bool ret = (fsArchiveGet(path, archivePath, member) != NULL) && !member.empty();
+    fsArchiveUnlock();
+    if(ret) errno = EROFS;
+    return ret;
+}
+
+bool fsIsArchive(const std::string path) {
+    // an archive file with a readable directory, the browser enters these like folders
+    std::string::size_type end = fsArchiveSlash(path, 0);
+    if((end == std::string::npos) || (end != path.size())) return false;
+    std::string archivePath;
+    std::string member;
+    fsArchiveLock();
+    bool ret = (fsArchiveGet(path, archivePath, member) != NULL) && member.empty();
+    fsArchiveUnlock();
+    return ret;
+}
+
+bool fsFileOpen(FsFile* file, const std::string path, const char* mode) {
+    // files inside archives can be opened with "rb" only
+    if(fsArchiveSlash(path, 0) == std::string::npos) return fsFileOpenPlain(file, path, mode);
+    std::string archivePath;
+    std::string member;
+    fsArchiveLock();
+    FsArchive* archive = fsArchiveGet(path, archivePath, member);
+    if((archive == NULL) || member.empty()) { // the archive itself is a plain file
+        fsArchiveUnlock();
+        return fsFileOpenPlain(file, path, mode);
+    }
+    const ZipEntry* found = fsArchiveEntry(archive, member);
+    ZipEntry entry;
+    if(found != NULL) entry = *found;
+    fsArchiveUnlock();
+
+    file->fp = NULL;
+    file->handle = 0;
+    file->pos = 0;
+    file->writing = false;
+    file->member = NULL;
+    if(found == NULL) {
+        errno = ENOENT;
+        return false;
+    } else if(strcmp(mode, "rb") != 0) {
+        errno = EROFS;
+        return false;
+    }
+    FsMember* fileMember = new FsMember;
+    if(!fsFileOpenPlain(&fileMember->archive, archivePath, "rb")) {
+        delete fileMember;
+        return false;
+    }
+    FsFile* archiveFile = &fileMember->archive;
+    fileMember->reader = zipOpen(entry, [archiveFile](u64 offset, void* buffer, u32 size) { return fsFileRead(archiveFile, offset, buffer, size); });
+    if(fileMember->reader == NULL) {
+        int errnoPrev = errno;
+        fsFileClose(archiveFile);
+        delete fileMember;
+        errno = errnoPrev;
+        return false;
+    }
+    file->member = fileMember;
+    return true;
+}
+
+void fsFileSeekable(FsFile* file) {
+    // archive members keep restart points from the first read on, plain files seek anyway
+    if(file->member != NULL) zipSetSeekable(file->member->reader);
+}
+
+u8* fsBufferAlloc(u32 size, bool* linear) {
+    // FSUSER transfers go straight from / to linear memory if there is some left
+    u8* buffer = NULL;
+    *linear = false;
+    PROF_ALLOC();
+    if(fsBackend == FS_BACKEND_FSUSER) {
+        buffer = (u8*) linearAlloc(size);
+        *linear = (buffer != NULL);
+    }
+    if(buffer == NULL) buffer = (u8*) malloc(size);
+    return buffer;
+}
+
+void fsBufferFree(u8* buffer, bool linear) {
+    if(buffer == NULL) return;
+    if(linear) linearFree(buffer);
+    else free(buffer);
+}
+
+void fsPipeFail(FsPipe* pipe, int error) {
+    s32 count;
+    if(!pipe->abort) {
+        pipe->error = (error != 0) ? error : EIO;
+        pipe->abort = true;
+    }
+    // wake up whoever is waiting on the other end
+    svcReleaseSemaphore(&count, pipe->semFree, 1);
+    svcReleaseSemaphore(&count, pipe->semFull, 1);
+}
+
+void fsPipeReader(void* arg) {
+    FsPipe* pipe = (FsPipe*) arg;
+    s32 count;
+    u32 index = 0;
+    for(u64 pos = 0; pos < pipe->total; pos += pipe->slotSize, index++) {
+        svcWaitSynchronization(pipe->semFree, U64_MAX);
+        if(pipe->abort) break;
+        FsPipeSlot* slot = &(pipe->slots[index % pipe->nSlots]);
+        slot->size = (pipe->total - pos < pipe->slotSize) ? pipe->total - pos : pipe->slotSize;
+        if(!(*(pipe->onRead))(slot->data, pos, slot->size)) {
+            fsPipeFail(pipe, errno);
+            break;
+        }
+        svcReleaseSemaphore(&count, pipe->semFull, 1);
+    }
+}
+
+void fsPipeWriter(void* arg) {
+    FsPipe* pipe = (FsPipe*) arg;
+    s32 count;
+    u32 index = 0;
+    for(u64 pos = 0; pos < pipe->total; index++) {
+        svcWaitSynchronization(pipe->semFull, U64_MAX);
+        if(pipe->abort) break;
+        FsPipeSlot* slot = &(pipe->slots[index % pipe->nSlots]);
+        if(!(*(pipe->onWrite))(slot->data, pos, slot->size)) {
+            fsPipeFail(pipe, errno);
+            break;
+        }
+        pos += slot->size;
+        pipe->posDone = pos;
+        svcReleaseSemaphore(&count, pipe->semFree, 1);
+    }
+    pipe->done = true;
+}
+
+bool fsPipeSerial(u64 total, u8* buffer, u32 bufSize, FsPipeFunc onRead, FsPipeFunc onWrite, std::function<bool(u64 pos)> onProgress) {
+    for(u64 pos = 0; pos < total; ) {
+        u32 size = (total - pos < bufSize) ? total - pos : bufSize;
+        if(!onRead(buffer, pos, size) || !onWrite(buffer, pos, size)) {
+            if(errno == 0) errno = EIO;
+            return false;
+        }
+        pos += size;
+        if(onProgress && !onProgress(pos)) {
+            errno = ECANCELED;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fsPipePoolAlloc(FsPipePool* pool, u64 total) {
+    // buffers for transfers of up to total bytes, may come out smaller than configured
+    pool->slotSize = (total < fsPipeBufferSize) ? total : fsPipeBufferSize;
+    if(pool->slotSize == 0) pool->slotSize = 1;
+    pool->nSlots = (total + pool->slotSize - 1) / pool->slotSize;
+    if(pool->nSlots > fsPipeBufferCount) pool->nSlots = fsPipeBufferCount;
+    if(pool->nSlots == 0) pool->nSlots = 1;
+    
+    pool->slots = (FsPipeSlot*) calloc(pool->nSlots, sizeof(FsPipeSlot));
+    if(pool->slots == NULL) {
+        pool->nSlots = 0;
+        return false;
+    }
+    u32 nAllocated = 0;
+    for(; nAllocated < pool->nSlots; nAllocated++) {
+        pool->slots[nAllocated].data = fsBufferAlloc(pool->slotSize, &(pool->slots[nAllocated].linear));
+        if(pool->slots[nAllocated].data == NULL) break;
+    }
+    pool->nSlots = nAllocated;
+    return (pool->nSlots > 0);
+}
+
+void fsPipePoolFree(FsPipePool* pool) {
+    for(u32 i = 0; i < pool->nSlots; i++) fsBufferFree(pool->slots[i].data, pool->slots[i].linear);
+    if(pool->slots != NULL) free(pool->slots);
+    pool->slots = NULL;
+    pool->nSlots = 0;
+}
+
+bool fsPipeRun(u64 total, FsPipeFunc onRead, FsPipeFunc onWrite, std::function<bool(u64 pos)> onProgress, FsPipePool* pool = NULL) {
+    // onRead runs on the reader thread, onWrite on the writer thread, onProgress on the calling thread
+    // without a pool the buffers are allocated for this run only
+    FsPipe pipe;
+    FsPipePool ownPool;
+    bool ret = false;
+
+    if(total == 0) return true;
+    
+    fsSpeedupBegin();
+    if(pool == NULL) {
+        pool = &ownPool;
+        if(!fsPipePoolAlloc(pool, total)) {
+            fsPipePoolFree(pool);
+            fsSpeedupEnd();
+            return false;
+        }
+    }
+
+    pipe.total = total;
+    pipe.onRead = &onRead;
+    pipe.onWrite = &onWrite;
+    pipe.slots = pool->slots;
+    pipe.slotSize = pool->slotSize;
+    pipe.nSlots = (total + pipe.slotSize - 1) / pipe.slotSize;
+    if(pipe.nSlots > pool->nSlots) pipe.nSlots = pool->nSlots;
+    pipe.posDone = 0;
+    pipe.abort = false;
+    pipe.done = false;
+    pipe.error = 0;
+    pipe.semFree = 0;
+    pipe.semFull = 0;
+
+    if(pipe.nSlots < 2) { // nothing to overlap, do it the old fashioned way
+        ret = (pipe.nSlots == 1) && fsPipeSerial(total, pipe.slots[0].data, pipe.slotSize, onRead, onWrite, onProgress);
+    } else if((svcCreateSemaphore(&pipe.semFree, pipe.nSlots, 2 * pipe.nSlots) == 0) &&
+        (svcCreateSemaphore(&pipe.semFull, 0, 2 * pipe.nSlots) == 0)) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        Thread reader = threadCreate(fsPipeReader, &pipe, CTRX_STACKSIZ, prio - 1, -2, false);
+        Thread writer = (reader != NULL) ? threadCreate(fsPipeWriter, &pipe, CTRX_STACKSIZ, prio - 1, -2, false) : NULL;
+        if(writer != NULL) {
+            while(!pipe.done) {
+                svcSleepThread(16 * 1000 * 1000);
+                if(onProgress && !pipe.abort && !onProgress(pipe.posDone)) fsPipeFail(&pipe, ECANCELED);
+            }
+            threadJoin(writer, U64_MAX);
+            threadJoin(reader, U64_MAX);
+            threadFree(writer);
+            threadFree(reader);
+            if(pipe.abort) errno = pipe.error;
+            else if(onProgress) onProgress(total);
+            ret = !pipe.abort;
+        } else if(reader != NULL) { // could not start the writer, stop the reader
+            fsPipeFail(&pipe, 0);
+            threadJoin(reader, U64_MAX);
+            threadFree(reader);
+            ret = fsPipeSerial(total, pipe.slots[0].data, pipe.slotSize, onRead, onWrite, onProgress);
+        } else ret = fsPipeSerial(total, pipe.slots[0].data, pipe.slotSize, onRead, onWrite, onProgress);
+    } else ret = fsPipeSerial(total, pipe.slots[0].data, pipe.slotSize, onRead, onWrite, onProgress);
+
+    if(pipe.semFree != 0) svcCloseHandle(pipe.semFree);
+    if(pipe.semFull != 0) svcCloseHandle(pipe.semFull);
+
+    if(pool == &ownPool) fsPipePoolFree(pool);
+    fsSpeedupEnd();
+
+    return ret;
+}
+
+void fsSetPipeConfig(u32 bufferCount, u32 bufferSize) {
+    fsPipeBufferCount = (bufferCount < 1) ? 1 : (bufferCount > CTRX_BUFCNT_MAX) ? CTRX_BUFCNT_MAX : bufferCount;
+    fsPipeBufferSize = (bufferSize < CTRX_BUFSIZ_MIN) ? CTRX_BUFSIZ_MIN : bufferSize;
+}
+
+FsPipeConfig fsGetPipeConfig() {
+    return { fsPipeBufferCount, fsPipeBufferSize };
+}
+
 u64 fsGetFreeSpace() {
     FS_ArchiveResource resource;
     Result res = FSUSER_GetSdmcArchiveResource(&resource);
     return (res != 0) ? 0 : (u64) resource.clusterSize * (u64) resource.freeClusters;
 }
 
-bool fsExists(const std::string path) {
-    FILE* fd = fopen(path.c_str(), "r");
-    if(fd) {
-        fclose(fd);
-        return true;
+FsStat fsArchiveStat(const std::string path, bool &inside) {
+    // paths below an archive come from its directory, an archive itself is still a file
+    inside = false;
+    std::string::size_type end = fsArchiveSlash(path, 0);
+    // nothing after the first archive name: the archive itself or a folder, a plain stat answers without reading the directory
+    if((end == std::string::npos) || (path.find_first_not_of('/', end) == std::string::npos)) return {false, false, 0};
+    std::string archivePath;
+    std::string member;
+    FsStat ret = {false, false, 0};
+    fsArchiveLock();
+    const FsArchive* archive = fsArchiveGet(path, archivePath, member);
+    if((archive != NULL) && !member.empty()) {
+        inside = true;
+        const ZipEntry* entry = fsArchiveEntry(archive, member);
+        if(entry != NULL) ret = {true, entry->isDirectory, entry->size};
     }
+    fsArchiveUnlock();
+    return ret;
+}
 
-    return fsIsDirectory(path);
+FsStat fsStat(const std::string path) {
+    // existence, type and size from one stat, callers that need more than one of them should ask once
+    bool inside = false;
+    FsStat archived = fsArchiveStat(path, inside);
+    if(inside) return archived;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return {false, false, 0};
+    bool isDirectory = S_ISDIR(st.st_mode);
+    return {true, isDirectory, isDirectory ? 0 : (u64) st.st_size};
 }
 
-bool fsIsDirectory(const std::string path) {
-    DIR* dir = opendir(path.c_str());
-    if(dir) {
-        closedir(dir);
-        return true;
-    }
+bool fsExists(const std::string path) {
+    return fsStat(path).exists;
+}
 
-    return false;
+bool fsIsDirectory(const std::string path) {
+    return fsStat(path).isDirectory;
 }
 
 std::string fsGetFileName(const std::string path) {
@@ -108,133 +1155,808 @@ bool fsHasExtensions(const std::string path, const std::vector<std::string> exte
     return false;
 }
 
-u32 fsGetFileSize(const std::string path) {
-    struct stat st;
-    stat(path.c_str(), &st);
-    return (u32) st.st_size;
+u64 fsGetFileSize(const std::string path) {
+    return fsStat(path).size;
 }
 
-bool fsFileResize(const std::string path, u32 offset, u32 oldsize, u32 newsize, bool showProgress) {
-    if(newsize == oldsize) return true;
+u32 fsGetClusterSize() {
+    if(fsClusterSize == 0) {
+        FS_ArchiveResource resource;
+        fsClusterSize = ((FSUSER_GetSdmcArchiveResource(&resource) == 0) && (resource.clusterSize != 0)) ?
+            resource.clusterSize : CTRX_CLUSTER_DEF;
+    }
+    return fsClusterSize;
+}
+
+void fsSetResizeJournal(bool enable) {
+    fsResizeJournal = enable;
+}
+
+bool fsGetResizeJournal() {
+    return fsResizeJournal;
+}
+
+void fsSetCopyVerify(bool enable) {
+    fsCopyVerify = enable;
+}
+
+bool fsGetCopyVerify() {
+    return fsCopyVerify;
+}
+
+bool fsResizeJournalWrite(FsFile* journal, FsResizeJournal* header, const u8* chunk) {
+    // the header goes last, so a torn chunk is never referenced
+    if((chunk != NULL) && (header->chunkSize > 0) &&
+        (fsFileWrite(journal, sizeof(FsResizeJournal), chunk, header->chunkSize) != header->chunkSize)) return false;
+    if(chunk != NULL) fsFileFlush(journal);
+    return (fsFileWrite(journal, 0, header, sizeof(FsResizeJournal)) == sizeof(FsResizeJournal)) && fsFileFlush(journal);
+}
+
+bool fsResizeRun(FsFile* file, const std::string path, FsResizeJournal* header, FsFile* journal, bool showProgress) {
+    // moves the tail behind the edited area, starting from header->done
+    // growing moves it from its end backwards, shrinking from its start forwards, so data
+    // still to be read is never overwritten and reads may run ahead of writes
+    const bool grow = header->newsize > header->oldsize;
+    const u64 srcStart = header->offset + header->oldsize;
+    const u64 dstStart = header->offset + header->newsize;
+    const u64 tailLen = header->total - srcStart;
+    const u64 newTotal = header->total - header->oldsize + header->newsize;
+    const u32 cluster = fsGetClusterSize();
+    const std::string operationStr = grow ? "Inflating" : "Deflating";
     
-    bool ret = true;
-    u64 total = fsGetFileSize(path);
-    size_t l_bufsiz = (total - (offset + oldsize) < CTRX_BUFSIZ) ?
-        total - (offset + oldsize) : CTRX_BUFSIZ;
-    u8* buffer = (u8*) malloc( l_bufsiz );
-    FILE* fp = fopen(path.c_str(), "rb+");;
+    if(grow && !fsFileSetSize(file, newTotal)) return false;
     
-    if(offset + oldsize > total) {
-        errno = ENOTSUP;
-        ret = false;
-    }
+    // q counts tail bytes in the order they are moved
+    auto chunkStart = [&](u64 q, u32 size) {
+        return grow ? tailLen - q - size : q;
+    };
+    auto moveChunk = [&](u8* buffer, u64 q, u32 size, bool haveData) {
+        u64 t = chunkStart(q, size);
+        if(!haveData && (fsFileRead(file, srcStart + t, buffer, size) != size)) return false;
+        if(journal != NULL) { // save the chunk first if writing it clobbers its own source
+            u64 dist = grow ? dstStart - srcStart : srcStart - dstStart;
+            header->chunkPos = q;
+            header->chunkSize = (dist < size) ? size : 0;
+            if((header->chunkSize > 0) && !fsResizeJournalWrite(journal, header, buffer)) return false;
+        }
+        if(fsFileWrite(file, dstStart + t, buffer, size) != size) return false;
+        if(journal != NULL) {
+            fsFileFlush(file);
+            header->done = q + size;
+            header->chunkSize = 0;
+            return fsResizeJournalWrite(journal, header, NULL);
+        }
+        return true;
+    };
     
-    if(ret && (fp != NULL) && (buffer != NULL)) {
-        size_t l_size = l_bufsiz; // don't change this
-        if(newsize > oldsize) { // increase file size
-            ret = (ftruncate(fileno(fp), total + newsize - oldsize) == 0);
-            for (u32 rpos = total; ret && (rpos > offset + oldsize); ) {
-                if(showProgress && !fsShowProgress("Inflating", path, total - rpos, total)) {
-                    errno = ECANCELED;
-                    ret = false;
-                    break;
-                }
-                l_size = ((rpos - (offset + oldsize)) > l_bufsiz) ? l_bufsiz : rpos - (offset + oldsize);
-                rpos -= l_size;
-                u32 wpos = rpos + newsize - oldsize;
-                ret = ret && (fseek(fp, rpos, SEEK_SET) == 0);
-                ret = ret && (fread(buffer, 1, l_size, fp) == l_size);
-                ret = ret && (fseek(fp, wpos, SEEK_SET) == 0);
-                ret = ret && (fwrite(buffer, 1, l_size, fp) == l_size);
-            }
-        } else { // truncate file
-            for (u32 rpos = offset + oldsize; ret && (rpos < total); rpos += l_size) {
-                u32 wpos = rpos + newsize - oldsize;
-                l_size = ((total - rpos) > l_bufsiz) ? l_bufsiz : total - rpos;
-                if(showProgress && !fsShowProgress("Deflating", path, rpos, total)) {
-                    errno = ECANCELED;
-                    ret = false;
-                    break;
-                }
-                ret = ret && (fseek(fp, rpos, SEEK_SET) == 0);
-                ret = ret && (fread(buffer, 1, l_size, fp) == l_size);
-                ret = ret && (fseek(fp, wpos, SEEK_SET) == 0);
-                ret = ret && (fwrite(buffer, 1, l_size, fp) == l_size);
+    if(tailLen > header->done) {
+        FsPipePool pool;
+        if(!fsPipePoolAlloc(&pool, tailLen - header->done)) {
+            fsPipePoolFree(&pool);
+            errno = ENOMEM;
+            return false;
+        }
+        if(pool.slotSize > cluster) pool.slotSize -= pool.slotSize % cluster;
+        
+        // move up to the next cluster boundary of the destination on its own, so all the
+        // pipelined writes after that are cluster aligned
+        u64 q0 = header->done;
+        u64 dstEdge = grow ? dstStart + tailLen - q0 : dstStart + q0;
+        u64 headLen = grow ? dstEdge % cluster : (cluster - (dstEdge % cluster)) % cluster;
+        if(headLen > tailLen - q0) headLen = tailLen - q0;
+        if(headLen > pool.slotSize) headLen = pool.slotSize;
+        bool ret = (headLen == 0) || moveChunk(pool.slots[0].data, q0, (u32) headLen, false);
+        q0 += headLen;
+        
+        if(ret && (q0 < tailLen)) {
+            std::function<bool(u64 pos)> onProgress = [&](u64 pos) {
+                return !showProgress || fsShowProgress(operationStr, path, q0 + pos, tailLen);
+            };
+            if(file->handle != 0) { // explicit offsets, one handle can serve both threads
+                ret = fsPipeRun(tailLen - q0,
+                    [&](u8* buffer, u64 pos, u32 size) { // reader thread
+                        return fsFileRead(file, srcStart + chunkStart(q0 + pos, size), buffer, size) == size;
+                    },
+                    [&](u8* buffer, u64 pos, u32 size) { // writer thread
+                        return moveChunk(buffer, q0 + pos, size, true);
+                    },
+                    onProgress, &pool);
+            } else {
+                ret = fsPipeSerial(tailLen - q0, pool.slots[0].data, pool.slotSize,
+                    [&](u8* buffer, u64 pos, u32 size) {
+                        return fsFileRead(file, srcStart + chunkStart(q0 + pos, size), buffer, size) == size;
+                    },
+                    [&](u8* buffer, u64 pos, u32 size) {
+                        return moveChunk(buffer, q0 + pos, size, true);
+                    },
+                    onProgress);
             }
-            ret = (ftruncate(fileno(fp), total + newsize - oldsize) == 0);
         }
-    } else ret = false;
-    
-    if(buffer != NULL) free(buffer);
-    if(fp != NULL) fclose(fp);
+        fsPipePoolFree(&pool);
+        if(!ret) return false;
+    }
     
-    return ret;
+    return grow || fsFileSetSize(file, newTotal);
 }
 
-u32 fsDataSearch(const std::string path, const std::vector<u8> searchTerm, u32 offset, bool showProgress) {
+bool fsFileResize(const std::string path, u64 offset, u64 oldsize, u64 newsize, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    if(newsize == oldsize) return true;
+    if(fsArchiveReadOnly(path)) return false;
+    fsDirCacheInvalidate(path);
+    
     u64 total = fsGetFileSize(path);
-    u64 totalPlus = total + searchTerm.size() - 1;
-    u32 offsetFound = (u32) -1;
-    size_t l_bufsiz = (total < CTRX_BUFSIZ) ? total : CTRX_BUFSIZ;
-    u8* buffer = (u8*) malloc( l_bufsiz );
-    FILE* fp = fopen(path.c_str(), "rb");
-    if((!searchTerm.empty()) && (fp != NULL) && (buffer != NULL)) {
-        size_t size = 0;
-        for (u64 i = 0; (i < totalPlus) && (offsetFound == (u32) -1); i += size) {
-            u64 pos = (offset + i) % total;
-            if(total - pos < l_bufsiz) size = total - pos;
-            else if(totalPlus - i < l_bufsiz) size = totalPlus - i;
-            else size = l_bufsiz;
-            if(size < searchTerm.size()) continue;
-            if(showProgress && !fsShowProgress("Searching", path, pos, total)) {
-                errno = ECANCELED;
-                break;
-            }
-            fseek(fp, pos, SEEK_SET);
-            if(fread(buffer, 1, size, fp) != size)
-                break;
-            for (u32 p = 0; p <= size - searchTerm.size(); p++) {
-                if(memcmp(buffer + p, searchTerm.data(), searchTerm.size()) == 0) {
-                    offsetFound = pos + p;
-                    break;
+    if(offset + oldsize > total) {
+        errno = ENOTSUP;
+        return false;
+    }
+    
+    FsFile file;
+    if(!fsFileOpen(&file, path, "rb+")) return false;
+    
+    FsResizeJournal header = {CTRX_JOURNAL_MAGIC, 1, offset, oldsize, newsize, total, 0, 0, 0, 0};
+    FsFile journal;
+    bool journaled = false;
+    bool ret = true;
+    if(fsResizeJournal) {
+        journaled = fsFileOpen(&journal, path + CTRX_JOURNAL_EXT, "wb");
+        ret = journaled && fsResizeJournalWrite(&journal, &header, NULL);
+    }
+    
+    ret = ret && fsResizeRun(&file, path, &header, journaled ? &journal : NULL, showProgress);
+    
+    fsFileClose(&file);
+    if(journaled) {
+        fsFileClose(&journal);
+        if(ret) remove((path + CTRX_JOURNAL_EXT).c_str());
+    }
+    if(ret) fsDirSizeAdjust(path, (s64) newsize - (s64) oldsize, 0, 0);
+    else fsDirSizeInvalidate(path); // a failed resize leaves the file anywhere in between, a journal may stay
+    return ret;
+}
+
+bool fsFileResizePending(const std::string path) {
+    return fsExists(path + CTRX_JOURNAL_EXT);
+}
+
+bool fsFileResizeResume(const std::string path, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    // picks up a journaled resize that got interrupted
+    const std::string journalPath = path + CTRX_JOURNAL_EXT;
+    fsDirCacheInvalidate(path);
+    fsDirSizeInvalidate(path);
+    
+    FsFile journal;
+    if(!fsFileOpen(&journal, journalPath, "rb+")) return false;
+    
+    FsResizeJournal header;
+    u64 size = fsGetFileSize(path);
+    bool ret = (fsFileRead(&journal, 0, &header, sizeof(FsResizeJournal)) == sizeof(FsResizeJournal)) &&
+        (header.magic == CTRX_JOURNAL_MAGIC) && (header.version == 1) &&
+        (header.offset + header.oldsize <= header.total) && (header.done <= header.total - header.offset - header.oldsize) &&
+        ((size == header.total) || (size == header.total - header.oldsize + header.newsize));
+    if(!ret) {
+        fsFileClose(&journal);
+        errno = EINVAL;
+        return false;
+    }
+    
+    FsFile file;
+    ret = fsFileOpen(&file, path, "rb+");
+    if(ret && (header.chunkSize > 0)) { // the saved chunk may be half written, write it again
+        const bool grow = header.newsize > header.oldsize;
+        u64 tailLen = header.total - header.offset - header.oldsize;
+        u64 t = grow ? tailLen - header.chunkPos - header.chunkSize : header.chunkPos;
+        bool linear;
+        u8* buffer = fsBufferAlloc(header.chunkSize, &linear);
+        ret = (buffer != NULL) && (header.chunkPos + header.chunkSize <= tailLen) &&
+            (fsFileRead(&journal, sizeof(FsResizeJournal), buffer, header.chunkSize) == header.chunkSize) &&
+            (!grow || fsFileSetSize(&file, header.total - header.oldsize + header.newsize)) &&
+            (fsFileWrite(&file, header.offset + header.newsize + t, buffer, header.chunkSize) == header.chunkSize);
+        fsBufferFree(buffer, linear);
+        if(ret) {
+            fsFileFlush(&file);
+            header.done = header.chunkPos + header.chunkSize;
+            header.chunkSize = 0;
+            ret = fsResizeJournalWrite(&journal, &header, NULL);
+        }
+    }
+    ret = ret && fsResizeRun(&file, path, &header, &journal, showProgress);
+    
+    fsFileClose(&file);
+    fsFileClose(&journal);
+    if(ret) remove(journalPath.c_str());
+    
+    return ret;
+}
+
+void fsSearcherInit(FsSearcher* searcher, const std::vector<u8> &pattern) {
+    u32 length = pattern.size();
+    searcher->pattern = pattern;
+    for(u32 c = 0; c < 256; c++) searcher->skip[c] = searcher->skipRev[c] = length;
+    for(u32 i = 0; i + 1 < length; i++) searcher->skip[pattern[i]] = length - 1 - i;
+    for(u32 i = length - 1; i > 0; i--) searcher->skipRev[pattern[i]] = i;
+}
+
+u32 fsSearcherFind(const FsSearcher* searcher, const u8* data, u32 size) {
+    // returns the index of the first match in data, (u32) -1 if there is none
+    const u8* pattern = searcher->pattern.data();
+    const u32 length = searcher->pattern.size();
+    if((length == 0) || (size < length)) return (u32) -1;
+    
+    if(length < CTRX_HORSPOOL_MIN) { // short pattern: let memchr find the first byte
+        const u8* end = data + size - length + 1;
+        for(const u8* p = data; p < end; p++) {
+            p = (const u8*) memchr(p, pattern[0], end - p);
+            if(p == NULL) break;
+            if(memcmp(p + 1, pattern + 1, length - 1) == 0) return p - data;
+        }
+        return (u32) -1;
+    }
+    
+    // Boyer-Moore-Horspool
+    const u8 last = pattern[length - 1];
+    for(u32 i = 0; i <= size - length; i += searcher->skip[data[i + length - 1]]) {
+        if((data[i + length - 1] == last) && (memcmp(data + i, pattern, length - 1) == 0))
+            return i;
+    }
+    return (u32) -1;
+}
+
+u32 fsSearcherFindLast(const FsSearcher* searcher, const u8* data, u32 size) {
+    // returns the index of the last match in data, (u32) -1 if there is none
+    const u8* pattern = searcher->pattern.data();
+    const u32 length = searcher->pattern.size();
+    if((length == 0) || (size < length)) return (u32) -1;
+    
+    // Horspool, mirrored: the window moves left and shifts on its first byte
+    const u8 first = pattern[0];
+    for(s64 i = size - length; i >= 0; i -= searcher->skipRev[data[i]]) {
+        if((data[i] == first) && (memcmp(data + i + 1, pattern + 1, length - 1) == 0))
+            return i;
+    }
+    return (u32) -1;
+}
+
+u32 fsPatchRead(FsPatch* patch, u64 offset, void* buffer, u32 size) {
+    // reads the edited file, safe to call from a worker thread
+    u8* out = (u8*) buffer;
+    u32 done = 0;
+    u64 start = 0;
+    svcWaitSynchronization(patch->mutex, U64_MAX);
+    for(u32 i = 0; (i < patch->pieces.size()) && (done < size); start += patch->pieces[i].length, i++) {
+        const FsPatchPiece &piece = patch->pieces[i];
+        u64 pos = offset + done;
+        if(pos >= start + piece.length) continue;
+        u64 skip = pos - start;
+        u32 count = (piece.length - skip < size - done) ? piece.length - skip : size - done;
+        if(piece.added) memcpy(out + done, patch->added.data() + piece.source + skip, count);
+        else if(fsFileRead(&patch->file, piece.source + skip, out + done, count) != count) break;
+        done += count;
+    }
+    svcReleaseMutex(patch->mutex);
+    return done;
+}
+
+u32 fsDataRead(FsFile* file, FsPatch* patch, u64 offset, void* buffer, u32 size) {
+    return (patch != NULL) ? fsPatchRead(patch, offset, buffer, size) : fsFileRead(file, offset, buffer, size);
+}
+
+bool fsDataSearchRange(FsFile* file, FsPatch* patch, const FsSearcher* searcher, u64 start, u64 end, bool reverse, std::function<bool(u64 offset)> onMatch, std::function<bool(u64 pos)> onProgress) {
+    // reports every match that lies completely inside [start, end) to onMatch, in scan order,
+    // until onMatch returns false. returns false on error or if cancelled.
+    const u32 length = searcher->pattern.size();
+    std::vector<u8> seam;
+    u32 seamLen = 0; // bytes kept from the previously scanned chunk
+    bool stopped = false;
+    int errnoPrev = errno;
+    
+    if((length == 0) || (end < start + length)) return true;
+    seam.resize(2 * length);
+    
+    bool ret = fsPipeRun(end - start,
+        [&](u8* buffer, u64 pos, u32 size) { // reader thread
+            u64 chunkStart = (reverse) ? end - pos - size : start + pos;
+            return fsDataRead(file, patch, chunkStart, buffer, size) == size;
+        },
+        [&](u8* buffer, u64 pos, u32 size) { // scanner thread
+            u32 keepLen = (size < length - 1) ? size : length - 1;
+            if(!reverse) {
+                u64 chunkStart = start + pos;
+                // matches crossing the border from the previous chunk
+                if(seamLen > 0) {
+                    memcpy(seam.data() + seamLen, buffer, keepLen);
+                    for(u32 idx = 0, found; (found = fsSearcherFind(searcher, seam.data() + idx, seamLen + keepLen - idx)) != (u32) -1; idx += found + 1) {
+                        if(idx + found >= seamLen) break;
+                        if(!onMatch(chunkStart - seamLen + idx + found)) return !(stopped = true);
+                    }
+                }
+                for(u32 idx = 0, found; (found = fsSearcherFind(searcher, buffer + idx, size - idx)) != (u32) -1; idx += found + 1) {
+                    if(!onMatch(chunkStart + idx + found)) return !(stopped = true);
+                }
+                memcpy(seam.data(), buffer + size - keepLen, keepLen);
+            } else {
+                u64 chunkStart = end - pos - size;
+                // matches crossing the border into the previously scanned (later) chunk
+                if(seamLen > 0) {
+                    memmove(seam.data() + keepLen, seam.data(), seamLen);
+                    memcpy(seam.data(), buffer + size - keepLen, keepLen);
+                    for(u32 limit = keepLen + seamLen, found; (found = fsSearcherFindLast(searcher, seam.data(), limit)) != (u32) -1; limit = found + length - 1) {
+                        if(found >= keepLen) continue;
+                        if(!onMatch(chunkStart + size - keepLen + found)) return !(stopped = true);
+                    }
+                }
+                for(u32 limit = size, found; (found = fsSearcherFindLast(searcher, buffer, limit)) != (u32) -1; limit = found + length - 1) {
+                    if(!onMatch(chunkStart + found)) return !(stopped = true);
                 }
+                memcpy(seam.data(), buffer, keepLen);
             }
-        }
+            seamLen = keepLen;
+            return true;
+        },
+        onProgress);
+    
+    // the scanner stops the pipe early when onMatch is done, that's no error
+    if(stopped) {
+        errno = errnoPrev;
+        return true;
     }
-    if(buffer != NULL) free(buffer);
-    if(fp != NULL) fclose(fp);
+    return ret;
+}
+
+u64 fsDataSearch(const std::string path, const std::vector<u8> searchTerm, u64 offset, bool showProgress, bool reverse, FsPatch* patch) {
+    PROF_SCOPE(PROF_IO);
+    u64 total = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
+    u64 offsetFound = (u64) -1;
+    FsSearcher searcher;
+    FsFile file;
+    
+    if(searchTerm.empty() || (total < searchTerm.size())) return (u64) -1;
+    if(!fsFileOpen(&file, path, "rb")) return (u64) -1;
+    fsSearcherInit(&searcher, searchTerm);
+    
+    // forward: search from offset to the end, then wrap around to the start
+    // reverse: search from offset back to the start, then wrap around to the end
+    offset %= total;
+    u64 split = offset + searchTerm.size() - ((reverse) ? 0 : 1);
+    if(split > total) split = total;
+    u64 firstStart = (reverse) ? 0 : offset;
+    u64 firstEnd = (reverse) ? split : total;
+    u64 wrapStart = (reverse) ? offset + 1 : 0;
+    u64 wrapEnd = (reverse) ? total : split;
+    u64 scanTotal = (firstEnd - firstStart) + ((wrapEnd > wrapStart) ? wrapEnd - wrapStart : 0);
+    auto onMatch = [&](u64 found) {
+        offsetFound = found;
+        return false;
+    };
+    
+    bool ret = fsDataSearchRange(&file, patch, &searcher, firstStart, firstEnd, reverse, onMatch, [&](u64 pos) {
+        return !showProgress || fsShowProgress("Searching", path, pos, scanTotal);
+    });
+    if(ret && (offsetFound == (u64) -1) && (wrapEnd > wrapStart)) {
+        fsDataSearchRange(&file, patch, &searcher, wrapStart, wrapEnd, reverse, onMatch, [&](u64 pos) {
+            return !showProgress || fsShowProgress("Searching", path, (firstEnd - firstStart) + pos, scanTotal);
+        });
+    }
+    fsFileClose(&file);
     
     return offsetFound;
 }
 
-std::vector<u8> fsDataGet(const std::string path, u32 offset, u32 size) { 
+std::vector<u64> fsDataSearchAll(const std::string path, const std::vector<u8> searchTerm, u32 maxResults, bool showProgress, FsPatch* patch) {
+    PROF_SCOPE(PROF_IO);
+    u64 total = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
+    std::vector<u64> results;
+    FsSearcher searcher;
+    FsFile file;
+    
+    if(searchTerm.empty() || (total < searchTerm.size()) || (maxResults == 0)) return results;
+    if(!fsFileOpen(&file, path, "rb")) return results;
+    fsSearcherInit(&searcher, searchTerm);
+    
+    // one pass over the whole file, results come in ascending order
+    fsDataSearchRange(&file, patch, &searcher, 0, total, false,
+        [&](u64 found) {
+            results.push_back(found);
+            return results.size() < maxResults;
+        },
+        [&](u64 pos) {
+            return !showProgress || fsShowProgress("Searching", path, pos, total);
+        });
+    fsFileClose(&file);
+    
+    return results;
+}
+
+u32 fsDiffFirst(const u8* a, const u8* b, u32 size) {
+    // index of the first differing byte, size if there is none
+    u32 i = 0;
+    for(; i + 8 <= size; i += 8) { // two words per step, equal data goes by at memory speed
+        u32 a0, a1, b0, b1;
+        memcpy(&a0, a + i, 4);
+        memcpy(&a1, a + i + 4, 4);
+        memcpy(&b0, b + i, 4);
+        memcpy(&b1, b + i + 4, 4);
+        if((a0 ^ b0) != 0) return i + (__builtin_ctz(a0 ^ b0) >> 3); // little endian: lowest set bit comes first
+        if((a1 ^ b1) != 0) return i + 4 + (__builtin_ctz(a1 ^ b1) >> 3);
+    }
+    for(; (i < size) && (a[i] == b[i]); i++);
+    return i;
+}
+
+u32 fsDiffSame(const u8* a, const u8* b, u32 size) {
+    // index of the first equal byte, size if there is none
+    u32 i = 0;
+    for(; i + 4 <= size; i += 4) {
+        u32 a0, b0;
+        memcpy(&a0, a + i, 4);
+        memcpy(&b0, b + i, 4);
+        u32 x = a0 ^ b0;
+        u32 zero = (x - 0x01010101) & ~x & 0x80808080; // exact for the lowest zero byte
+        if(zero != 0) return i + (__builtin_ctz(zero) >> 3);
+    }
+    for(; (i < size) && (a[i] != b[i]); i++);
+    return i;
+}
+
+bool fsDataCompare(const std::string path, const std::string pathOther, std::vector<FsDiffRange> &ranges, u32 maxRanges, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    // both files go through one pipe, every buffer holds the same range of both in its halves
+    u64 size = fsGetFileSize(path);
+    u64 sizeOther = fsGetFileSize(pathOther);
+    u64 common = (size < sizeOther) ? size : sizeOther;
+    FsFile file;
+    FsFile fileOther;
+    bool open = false; // a range is still growing
+    u64 runStart = 0;
+    u64 runEnd = 0;
+    bool stopped = false;
+    int errnoPrev = errno;
+    
+    ranges.clear();
+    if(maxRanges == 0) return true;
+    if(!fsFileOpen(&file, path, "rb")) return false;
+    if(!fsFileOpen(&fileOther, pathOther, "rb")) {
+        fsFileClose(&file);
+        return false;
+    }
+    
+    bool ret = fsPipeRun(2 * common,
+        [&](u8* buffer, u64 pos, u32 size) { // reader thread
+            u32 half = size / 2;
+            return (fsFileRead(&file, pos / 2, buffer, half) == half) &&
+                (fsFileRead(&fileOther, pos / 2, buffer + half, half) == half);
+        },
+        [&](u8* buffer, u64 pos, u32 size) { // comparing thread
+            u32 half = size / 2;
+            const u8* a = buffer;
+            const u8* b = buffer + half;
+            u64 chunkStart = pos / 2;
+            for(u32 i = 0; i < half; ) {
+                i += fsDiffFirst(a + i, b + i, half - i);
+                if(i >= half) break;
+                if(open && (chunkStart + i - runEnd >= CTRX_DIFF_GAP)) {
+                    ranges.push_back({runStart, runEnd - runStart});
+                    open = false;
+                    if(ranges.size() >= maxRanges) return !(stopped = true);
+                }
+                if(!open) {
+                    open = true;
+                    runStart = chunkStart + i;
+                }
+                i += fsDiffSame(a + i, b + i, half - i);
+                runEnd = chunkStart + i;
+            }
+            return true;
+        },
+        [&](u64 pos) {
+            return !showProgress || fsShowProgress("Comparing", path, pos / 2, common);
+        });
+    fsFileClose(&file);
+    fsFileClose(&fileOther);
+    
+    // the comparer stops the pipe early once the list is full, that's no error
+    if(stopped) {
+        errno = errnoPrev;
+        return true;
+    }
+    if(!ret) return false;
+    if(size != sizeOther) { // the longer file's tail has nothing to compare against
+        u64 end = (size > sizeOther) ? size : sizeOther;
+        if(open && (common - runEnd < CTRX_DIFF_GAP)) runEnd = end;
+        else {
+            if(open) ranges.push_back({runStart, runEnd - runStart});
+            open = (ranges.size() < maxRanges);
+            runStart = common;
+            runEnd = end;
+        }
+    }
+    if(open) ranges.push_back({runStart, runEnd - runStart});
+    return true;
+}
+
+std::vector<u8> fsDataGet(const std::string path, u64 offset, u32 size) { 
     // this is not intended to be used for large chunks of data
-    FILE* fp;
+    PROF_SCOPE(PROF_IO);
+    FsFile file;
     std::vector<u8> data;
     u64 total = fsGetFileSize(path);
     if(offset + size > total) {
         errno = ENOTSUP;
         return data;
     }
-    fp = fopen(path.c_str(), "rb");
-    if(fp == NULL) return data;
-    fseek(fp, offset, SEEK_SET);
-    if((unsigned) ftell(fp) != offset) {
-        fclose(fp);
-        return data;
-    }
+    if(!fsFileOpen(&file, path, "rb")) return data;
     data.resize(size);
-    if(fread(data.data(), 1, size, fp) != size) {
-        data.clear();
-        fclose(fp);
-        return data;
-    }
-    fclose(fp);
+    if(fsFileRead(&file, offset, data.data(), size) != size) data.clear();
+    fsFileClose(&file);
     return data;
 }
 
-bool fsDataReplace(const std::string path, const std::vector<u8> data, u32 offset, u32 size) {
-    FILE* fp;
+bool fsFileStream(const std::string path, std::function<bool(const u8* data, u64 pos, u32 size)> onData, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    // feeds the whole file to onData in order, onData runs on the pipe's writer thread
+    FsFile file;
+    u64 total = fsGetFileSize(path);
+    if(!fsFileOpen(&file, path, "rb")) return false;
+    bool ret = fsPipeRun(total,
+        [&](u8* buffer, u64 pos, u32 size) { // reader thread
+            return fsFileRead(&file, pos, buffer, size) == size;
+        },
+        [&](u8* buffer, u64 pos, u32 size) { // consumer thread
+            return onData(buffer, pos, size);
+        },
+        [&](u64 pos) {
+            return !showProgress || fsShowProgress("Reading", path, pos, total);
+        });
+    fsFileClose(&file);
+    return ret;
+}
+
+u32 fsCrc32Table[8][256];
+bool fsCrc32Ready = false;
+
+const u32 fsMd5K[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+const u8 fsMd5Shift[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+const u32 fsSha256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+inline u32 fsRotl(u32 x, u32 n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+inline u32 fsRotr(u32 x, u32 n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void fsCrc32Init() {
+    // tables for slice-by-8, filled on the calling thread before any worker hashes
+    if(fsCrc32Ready) return;
+    for(u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for(u32 k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        fsCrc32Table[0][i] = crc;
+    }
+    for(u32 i = 0; i < 256; i++) {
+        for(u32 t = 1; t < 8; t++)
+            fsCrc32Table[t][i] = (fsCrc32Table[t - 1][i] >> 8) ^ fsCrc32Table[0][fsCrc32Table[t - 1][i] & 0xFF];
+    }
+    fsCrc32Ready = true;
+}
+
+u32 fsCrc32Update(u32 crc, const u8* data, u32 size) {
+    crc = ~crc;
+    for(; (size > 0) && (((uintptr_t) data & 3) != 0); size--)
+        crc = fsCrc32Table[0][(crc ^ *(data++)) & 0xFF] ^ (crc >> 8);
+    for(; size >= 8; size -= 8, data += 8) { // the ARM11 is little endian
+        u32 lo;
+        u32 hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = fsCrc32Table[7][lo & 0xFF] ^ fsCrc32Table[6][(lo >> 8) & 0xFF] ^
+            fsCrc32Table[5][(lo >> 16) & 0xFF] ^ fsCrc32Table[4][lo >> 24] ^
+            fsCrc32Table[3][hi & 0xFF] ^ fsCrc32Table[2][(hi >> 8) & 0xFF] ^
+            fsCrc32Table[1][(hi >> 16) & 0xFF] ^ fsCrc32Table[0][hi >> 24];
+    }
+    for(; size > 0; size--)
+        crc = fsCrc32Table[0][(crc ^ *(data++)) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void fsMd5Block(u32* h, const u8* block) {
+    u32 w[16];
+    for(u32 i = 0; i < 16; i++)
+        w[i] = block[4*i] | (block[4*i + 1] << 8) | (block[4*i + 2] << 16) | ((u32) block[4*i + 3] << 24);
+    u32 a = h[0];
+    u32 b = h[1];
+    u32 c = h[2];
+    u32 d = h[3];
+    for(u32 i = 0; i < 64; i++) {
+        u32 f;
+        u32 g;
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5*i + 1) & 15;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3*i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7*i) & 15;
+        }
+        u32 rotated = b + fsRotl(a + f + fsMd5K[i] + w[g], fsMd5Shift[((i >> 4) << 2) | (i & 3)]);
+        a = d;
+        d = c;
+        c = b;
+        b = rotated;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+void fsSha256Block(u32* h, const u8* block) {
+    u32 w[64];
+    for(u32 i = 0; i < 16; i++)
+        w[i] = ((u32) block[4*i] << 24) | (block[4*i + 1] << 16) | (block[4*i + 2] << 8) | block[4*i + 3];
+    for(u32 i = 16; i < 64; i++) {
+        u32 s0 = fsRotr(w[i - 15], 7) ^ fsRotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u32 s1 = fsRotr(w[i - 2], 17) ^ fsRotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    u32 v[8];
+    for(u32 i = 0; i < 8; i++) v[i] = h[i];
+    for(u32 i = 0; i < 64; i++) {
+        u32 s1 = fsRotr(v[4], 6) ^ fsRotr(v[4], 11) ^ fsRotr(v[4], 25);
+        u32 t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + fsSha256K[i] + w[i];
+        u32 s0 = fsRotr(v[0], 2) ^ fsRotr(v[0], 13) ^ fsRotr(v[0], 22);
+        u32 t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + t2;
+    }
+    for(u32 i = 0; i < 8; i++) h[i] += v[i];
+}
+
+void fsHashStart(FsHashState* state, u32 types) {
+    const u32 md5Init[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    const u32 sha256Init[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+    if(types & FS_HASH_CRC32) fsCrc32Init();
+    state->types = types;
+    state->crc32 = 0;
+    memcpy(state->md5, md5Init, sizeof(md5Init));
+    memcpy(state->sha256, sha256Init, sizeof(sha256Init));
+    state->blockFill = 0;
+    state->length = 0;
+}
+
+void fsHashBlocks(FsHashState* state, const u8* data, u32 count) {
+    for(u32 i = 0; i < count; i++, data += CTRX_HASH_BLOCK) {
+        if(state->types & FS_HASH_MD5) fsMd5Block(state->md5, data);
+        if(state->types & FS_HASH_SHA256) fsSha256Block(state->sha256, data);
+    }
+}
+
+void fsHashUpdate(FsHashState* state, const u8* data, u32 size) {
+    // one pass over the data for every requested hash
+    if(state->types & FS_HASH_CRC32) state->crc32 = fsCrc32Update(state->crc32, data, size);
+    state->length += size;
+    if(!(state->types & (FS_HASH_MD5 | FS_HASH_SHA256))) return;
+    if(state->blockFill > 0) {
+        u32 fill = CTRX_HASH_BLOCK - state->blockFill;
+        if(fill > size) fill = size;
+        memcpy(state->block + state->blockFill, data, fill);
+        state->blockFill += fill;
+        data += fill;
+        size -= fill;
+        if(state->blockFill < CTRX_HASH_BLOCK) return;
+        fsHashBlocks(state, state->block, 1);
+        state->blockFill = 0;
+    }
+    fsHashBlocks(state, data, size / CTRX_HASH_BLOCK); // straight from the buffer
+    state->blockFill = size % CTRX_HASH_BLOCK;
+    memcpy(state->block, data + size - state->blockFill, state->blockFill);
+}
+
+void fsHashFinish(FsHashState* state, FsHash* hash) {
+    // the padding only differs in the byte order of the bit length
+    u8 tail[2 * CTRX_HASH_BLOCK];
+    u32 tailSize = (state->blockFill < CTRX_HASH_BLOCK - 8) ? CTRX_HASH_BLOCK : 2 * CTRX_HASH_BLOCK;
+    u64 bits = state->length * 8;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, state->block, state->blockFill);
+    tail[state->blockFill] = 0x80;
+    
+    hash->types = state->types;
+    hash->crc32 = state->crc32;
+    if(state->types & FS_HASH_MD5) {
+        for(u32 i = 0; i < 8; i++) tail[tailSize - 8 + i] = (u8) (bits >> (8*i));
+        for(u32 i = 0; i < tailSize; i += CTRX_HASH_BLOCK) fsMd5Block(state->md5, tail + i);
+        for(u32 i = 0; i < 16; i++) hash->md5[i] = (u8) (state->md5[i >> 2] >> (8*(i & 3)));
+    }
+    if(state->types & FS_HASH_SHA256) {
+        for(u32 i = 0; i < 8; i++) tail[tailSize - 8 + i] = (u8) (bits >> (56 - (8*i)));
+        for(u32 i = 0; i < tailSize; i += CTRX_HASH_BLOCK) fsSha256Block(state->sha256, tail + i);
+        for(u32 i = 0; i < 32; i++) hash->sha256[i] = (u8) (state->sha256[i >> 2] >> (24 - (8*(i & 3))));
+    }
+}
+
+bool fsHashRun(FsFile* file, u64 total, FsHashState* state, const std::string operationStr, const std::string path, bool showProgress, FsPipePool* pool = NULL) {
+    // the reader thread fills the buffers, the hashes are computed on the writer thread
+    return fsPipeRun(total,
+        [&](u8* buffer, u64 pos, u32 size) { // reader thread
+            return fsFileRead(file, pos, buffer, size) == size;
+        },
+        [&](u8* buffer, u64 pos, u32 size) { // hashing thread
+            fsHashUpdate(state, buffer, size);
+            return true;
+        },
+        [&](u64 pos) {
+            return !showProgress || fsShowProgress(operationStr, path, pos, total);
+        }, pool);
+}
+
+bool fsFileHash(const std::string path, u32 types, FsHash* hash, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    FsFile file;
+    FsHashState state;
+    u64 total = fsGetFileSize(path);
+    if(!fsFileOpen(&file, path, "rb")) return false;
+    fsHashStart(&state, types);
+    bool ret = fsHashRun(&file, total, &state, "Hashing", path, showProgress);
+    fsFileClose(&file);
+    if(ret) fsHashFinish(&state, hash);
+    return ret;
+}
+
+bool fsCopyCheck(const std::string dest, u64 size, u32 crc32, const std::string label, bool showProgress, FsPipePool* pool = NULL) {
+    // reads the finished copy back, the source was hashed on its way through the copy
+    FsFile file;
+    FsHashState state;
+    if(!fsFileOpen(&file, dest, "rb")) return false;
+    fsHashStart(&state, FS_HASH_CRC32);
+    errno = 0;
+    bool ret = fsHashRun(&file, size, &state, "Verifying", label, showProgress, pool);
+    fsFileClose(&file);
+    fsProgressAdvance(size);
+    if(ret && ((state.crc32 != crc32) || (fsGetFileSize(dest) != size))) {
+        errno = EIO;
+        ret = false;
+    }
+    return ret;
+}
+
+bool fsDataReplace(const std::string path, const std::vector<u8> data, u64 offset, u64 size) {
+    PROF_SCOPE(PROF_IO);
+    FsFile file;
     bool ret = false;
     u64 total = fsGetFileSize(path);
     if(offset + size > total) {
@@ -243,19 +1965,339 @@ bool fsDataReplace(const std::string path, const std::vector<u8> data, u32 offse
     }
     if((data.size() != size) && !fsFileResize(path, offset, size, data.size(), true))
         return false;
-    fp = fopen(path.c_str(), "rb+");
-    if(fp == NULL) return false;
-    fseek(fp, offset, SEEK_SET);
-    if((unsigned) ftell(fp) != offset) {
-        fclose(fp);
+    fsLineIndexForget(path);
+    if(!fsFileOpen(&file, path, "rb+")) return false;
+    ret = (fsFileWrite(&file, offset, data.data(), data.size()) == data.size());
+    fsFileClose(&file);
+    return ret;
+}
+
+void fsPatchClose(FsPatch* patch) {
+    if(patch == NULL) return;
+    fsFileClose(&patch->file);
+    if(patch->mutex != 0) svcCloseHandle(patch->mutex);
+    delete patch;
+}
+
+FsPatch* fsPatchOpen(const std::string path) {
+    FsPatch* patch = new FsPatch;
+    patch->path = path;
+    patch->mutex = 0;
+    patch->revision = 0;
+    if(!fsFileOpen(&patch->file, path, "rb") || (svcCreateMutex(&patch->mutex, false) != 0)) {
+        fsPatchClose(patch);
+        return NULL;
+    }
+    patch->size = fsGetFileSize(path);
+    patch->pieces.assign(1, {0, patch->size, false});
+    return patch;
+}
+
+u64 fsPatchSize(FsPatch* patch) {
+    return patch->size;
+}
+
+u32 fsPatchRevision(FsPatch* patch) {
+    return patch->revision;
+}
+
+u32 fsPatchEdits(FsPatch* patch) {
+    return patch->edits.size();
+}
+
+u32 fsPatchLocate(const std::vector<FsPatchPiece> &pieces, u64 offset, u64 &start) {
+    // index of the piece starting at or containing offset, start is where it begins
+    start = 0;
+    for(u32 i = 0; i < pieces.size(); start += pieces[i].length, i++)
+        if((start == offset) || (offset < start + pieces[i].length)) return i;
+    return pieces.size();
+}
+
+u32 fsPatchFind(std::vector<FsPatchPiece> &pieces, u64 offset) {
+    // index of the piece starting at offset, splits the piece containing it if needed
+    u64 start = 0;
+    u32 i = fsPatchLocate(pieces, offset, start);
+    if((i == pieces.size()) || (start == offset)) return i;
+    FsPatchPiece tail = {pieces[i].source + (offset - start), pieces[i].length - (offset - start), pieces[i].added};
+    pieces[i].length = offset - start;
+    pieces.insert(pieces.begin() + i + 1, tail);
+    return i + 1;
+}
+
+bool fsPatchReplace(FsPatch* patch, u64 offset, u64 size, const std::vector<u8> &data) {
+    // nothing is written here, the edit only goes into the piece table
+    if(patch->file.member != NULL) {
+        errno = EROFS;
+        return false;
+    } else if((offset > patch->size) || (size > patch->size - offset)) {
+        errno = ENOTSUP;
         return false;
     }
-    ret = (fwrite(data.data(), 1, data.size(), fp) == data.size());
-    fclose(fp);
+    svcWaitSynchronization(patch->mutex, U64_MAX);
+    // undo keeps only the pieces this edit touches, the ones split at either end included
+    u64 start = 0;
+    u32 lo = fsPatchLocate(patch->pieces, offset, start);
+    u32 hi = fsPatchLocate(patch->pieces, offset + size, start);
+    if((hi < patch->pieces.size()) && (start < offset + size)) hi++;
+    FsPatchEdit edit = {offset, size, patch->added.size(), (u32) data.size(), lo, 0,
+        std::vector<FsPatchPiece>(patch->pieces.begin() + lo, patch->pieces.begin() + hi), patch->size};
+    u32 untouched = patch->pieces.size() - (hi - lo);
+    patch->added.insert(patch->added.end(), data.begin(), data.end());
+    u32 first = fsPatchFind(patch->pieces, offset);
+    u32 last = fsPatchFind(patch->pieces, offset + size);
+    patch->pieces.erase(patch->pieces.begin() + first, patch->pieces.begin() + last);
+    if(!data.empty()) {
+        FsPatchPiece piece = {edit.addedPos, data.size(), true};
+        patch->pieces.insert(patch->pieces.begin() + first, piece);
+    }
+    edit.count = patch->pieces.size() - untouched;
+    patch->edits.push_back(edit);
+    patch->size = patch->size - size + data.size();
+    patch->revision++;
+    svcReleaseMutex(patch->mutex);
+    return true;
+}
+
+bool fsPatchUndo(FsPatch* patch) {
+    if(patch->edits.empty()) return false;
+    svcWaitSynchronization(patch->mutex, U64_MAX);
+    const FsPatchEdit &edit = patch->edits.back();
+    patch->pieces.erase(patch->pieces.begin() + edit.first, patch->pieces.begin() + edit.first + edit.count);
+    patch->pieces.insert(patch->pieces.begin() + edit.first, edit.removed.begin(), edit.removed.end());
+    patch->size = edit.size;
+    patch->added.resize(edit.addedPos);
+    patch->edits.pop_back();
+    patch->revision++;
+    svcReleaseMutex(patch->mutex);
+    return true;
+}
+
+std::vector<u8> fsPatchGet(FsPatch* patch, u64 offset, u32 size) {
+    PROF_SCOPE(PROF_IO);
+    std::vector<u8> data;
+    if((offset > patch->size) || (size > patch->size - offset)) {
+        errno = ENOTSUP;
+        return data;
+    }
+    data.resize(size);
+    if(fsPatchRead(patch, offset, data.data(), size) != size) data.clear();
+    return data;
+}
+
+void fsPatchDetach(FsPatch* patch) {
+    // the prefetch worker may be reading through the patch, a closed file just reads nothing
+    svcWaitSynchronization(patch->mutex, U64_MAX);
+    fsFileClose(&patch->file);
+    svcReleaseMutex(patch->mutex);
+}
+
+bool fsPatchCommit(FsPatch* patch, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    // in place if no original data moves, else one streaming pass into a new file
+    if(patch->edits.empty()) return true;
+    
+    bool inPlace = true;
+    u64 pos = 0;
+    for(std::vector<FsPatchPiece>::iterator it = patch->pieces.begin(); it != patch->pieces.end(); pos += (*it).length, it++)
+        if(!(*it).added && ((*it).source != pos)) inPlace = false;
+    
+    bool ret = false;
+    FsFile file;
+    const std::string tmpPath = patch->path + CTRX_PATCH_EXT;
+    const std::string oldPath = patch->path + CTRX_PATCH_EXT_OLD;
+    fsDirCacheInvalidate(patch->path);
+    u64 sizeBefore = fsGetFileSize(patch->path);
+    bool accounted = false; // fsDataReplace keeps the folder sizes up to date itself
+    errno = 0;
+    if(inPlace) {
+        fsPatchDetach(patch);
+        if(fsFileOpen(&file, patch->path, "rb+")) {
+            ret = true;
+            pos = 0;
+            for(std::vector<FsPatchPiece>::iterator it = patch->pieces.begin(); ret && (it != patch->pieces.end()); pos += (*it).length, it++)
+                if((*it).added) ret = (fsFileWrite(&file, pos, patch->added.data() + (*it).source, (*it).length) == (*it).length);
+            if(ret && (patch->size != fsGetFileSize(patch->path))) ret = fsFileSetSize(&file, patch->size);
+            fsFileClose(&file);
+        }
+    } else if(fsGetFreeSpace() > patch->size + fsGetClusterSize()) {
+        if(fsFileOpen(&file, tmpPath, "wb")) {
+            ret = fsPipeRun(patch->size,
+                [&](u8* buffer, u64 pos, u32 size) { // reader thread
+                    return fsPatchRead(patch, pos, buffer, size) == size;
+                },
+                [&](u8* buffer, u64 pos, u32 size) { // writer thread
+                    return fsFileWrite(&file, pos, buffer, size) == size;
+                },
+                [&](u64 pos) {
+                    return !showProgress || fsShowProgress("Saving", patch->path, pos, patch->size);
+                });
+            fsFileClose(&file);
+        }
+        fsPatchDetach(patch);
+        if(ret) { // keep the old file until the new one is in place
+            ret = (rename(patch->path.c_str(), oldPath.c_str()) == 0);
+            if(ret && (rename(tmpPath.c_str(), patch->path.c_str()) != 0)) {
+                rename(oldPath.c_str(), patch->path.c_str());
+                ret = false;
+            }
+            if(ret) remove(oldPath.c_str());
+        }
+        if(!ret) {
+            int error = (errno != 0) ? errno : EIO;
+            remove(tmpPath.c_str());
+            errno = error;
+        }
+    } else { // no room for a second copy, apply one edit after the other
+        fsPatchDetach(patch);
+        accounted = true;
+        ret = true;
+        for(std::vector<FsPatchEdit>::iterator it = patch->edits.begin(); ret && (it != patch->edits.end()); it++)
+            ret = fsDataReplace(patch->path, std::vector<u8>(patch->added.begin() + (*it).addedPos, patch->added.begin() + (*it).addedPos + (*it).addedLength), (*it).offset, (*it).length);
+    }
+    
+    // start over from whatever is on the card now
+    int error = errno;
+    svcWaitSynchronization(patch->mutex, U64_MAX);
+    fsFileClose(&patch->file);
+    fsFileOpen(&patch->file, patch->path, "rb");
+    patch->size = fsGetFileSize(patch->path);
+    patch->pieces.assign(1, {0, patch->size, false});
+    patch->added.clear();
+    patch->edits.clear();
+    patch->revision++;
+    svcReleaseMutex(patch->mutex);
+    if(!accounted) fsDirSizeAdjust(patch->path, (s64) patch->size - (s64) sizeBefore, 0, 0);
+    errno = error;
     return ret;
 }
 
-bool fsDataProvider(const std::string path, u32 offset, u32 buffSize, std::function<bool(u32 &offset, bool &forceRefresh)> onLoop, std::function<bool(u8* data)> onUpdate) {
+void fsPrefetchLoad(FsPrefetch* prefetch, u32 window, u64 start) {
+    u64 fileSize = prefetch->fileSize;
+    u32 size = (start >= fileSize) ? 0 : ((fileSize - start < prefetch->windowSize) ? fileSize - start : prefetch->windowSize);
+    prefetch->windowOffset[window] = start;
+    prefetch->windowLength[window] = (size > 0) ? fsDataRead(prefetch->file, prefetch->patch, start, prefetch->windows[window], size) : 0;
+}
+
+bool fsPrefetchCovers(FsPrefetch* prefetch, u32 window, u64 offset, u32 size) {
+    if(prefetch->windowOffset[window] == (u64) -1) return false;
+    u64 need = (offset >= prefetch->fileSize) ? 0 : ((prefetch->fileSize - offset < size) ? prefetch->fileSize - offset : size);
+    return (offset >= prefetch->windowOffset[window]) &&
+        (offset + need <= prefetch->windowOffset[window] + prefetch->windowLength[window]);
+}
+
+u64 fsPrefetchStart(FsPrefetch* prefetch, u64 offset, u32 size, int direction) {
+    // an eighth of the window stays behind the view, the request itself always fits in
+    const u32 windowSize = prefetch->windowSize;
+    const u64 end = offset + size;
+    u64 start = (direction < 0) ?
+        ((end + (windowSize / 8) > windowSize) ? end + (windowSize / 8) - windowSize : 0) :
+        ((offset > (windowSize / 8)) ? offset - (windowSize / 8) : 0);
+    if(start > offset) start = offset;
+    if(start + windowSize < end) start = end - windowSize;
+    return start;
+}
+
+void fsPrefetchWorker(void* arg) {
+    // loads the back window while the caller keeps reading from the front one
+    FsPrefetch* prefetch = (FsPrefetch*) arg;
+    s32 count;
+    while(true) {
+        svcWaitSynchronization(prefetch->semRequest, U64_MAX);
+        if(prefetch->abort) break;
+        fsPrefetchLoad(prefetch, 1 - prefetch->front, prefetch->request);
+        svcReleaseSemaphore(&count, prefetch->semDone, 1);
+    }
+}
+
+bool fsPrefetchInit(FsPrefetch* prefetch, FsFile* file, FsPatch* patch, u64 fileSize, u32 windowSize) {
+    memset(prefetch, 0, sizeof(FsPrefetch));
+    prefetch->file = file;
+    prefetch->patch = patch;
+    prefetch->fileSize = fileSize;
+    prefetch->windowSize = windowSize;
+    prefetch->windowOffset[0] = prefetch->windowOffset[1] = (u64) -1;
+    prefetch->windows[0] = fsBufferAlloc(windowSize, &prefetch->linear[0]);
+    prefetch->windows[1] = fsBufferAlloc(windowSize, &prefetch->linear[1]);
+    if((prefetch->windows[0] != NULL) && (prefetch->windows[1] != NULL) &&
+        (svcCreateSemaphore(&prefetch->semRequest, 0, 1) == 0) &&
+        (svcCreateSemaphore(&prefetch->semDone, 0, 1) == 0)) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        prefetch->thread = fsWorkerCreate(fsPrefetchWorker, prefetch, prio + 1);
+    }
+    return (prefetch->thread != NULL);
+}
+
+void fsPrefetchReset(FsPrefetch* prefetch, u64 fileSize) {
+    // waits for the worker, so the file can be reopened safely
+    if(prefetch->busy) svcWaitSynchronization(prefetch->semDone, U64_MAX);
+    prefetch->busy = false;
+    prefetch->fresh = false;
+    prefetch->fileSize = fileSize;
+    prefetch->windowOffset[0] = prefetch->windowOffset[1] = (u64) -1;
+}
+
+void fsPrefetchFree(FsPrefetch* prefetch) {
+    s32 count;
+    if(prefetch->thread != NULL) {
+        prefetch->abort = true;
+        svcReleaseSemaphore(&count, prefetch->semRequest, 1);
+        threadJoin(prefetch->thread, U64_MAX);
+        threadFree(prefetch->thread);
+    }
+    if(prefetch->semRequest != 0) svcCloseHandle(prefetch->semRequest);
+    if(prefetch->semDone != 0) svcCloseHandle(prefetch->semDone);
+    fsBufferFree(prefetch->windows[0], prefetch->linear[0]);
+    fsBufferFree(prefetch->windows[1], prefetch->linear[1]);
+}
+
+void fsPrefetchGet(FsPrefetch* prefetch, u64 offset, u8* buffer, u32 size, int direction) {
+    // only blocks if the request is outside both windows
+    s32 count;
+    const u32 windowSize = prefetch->windowSize;
+    const u64 end = offset + size;
+    u32 back = 1 - prefetch->front;
+    if(prefetch->busy && (svcWaitSynchronization(prefetch->semDone, 0) == 0)) {
+        prefetch->busy = false;
+        prefetch->fresh = true;
+    }
+    if(prefetch->fresh && fsPrefetchCovers(prefetch, back, offset, size)) {
+        prefetch->front = back; // the fresh window reaches further in scroll direction
+        prefetch->fresh = false;
+        back = 1 - back;
+    } else if(!fsPrefetchCovers(prefetch, prefetch->front, offset, size)) {
+        if(prefetch->busy) {
+            svcWaitSynchronization(prefetch->semDone, U64_MAX);
+            prefetch->busy = false;
+        }
+        prefetch->fresh = false;
+        if(fsPrefetchCovers(prefetch, back, offset, size)) {
+            prefetch->front = back;
+            back = 1 - back;
+        } else fsPrefetchLoad(prefetch, prefetch->front, fsPrefetchStart(prefetch, offset, size, direction)); // jumped away
+    }
+    
+    u64 frontOffset = prefetch->windowOffset[prefetch->front];
+    u64 frontEnd = frontOffset + prefetch->windowLength[prefetch->front];
+    u32 avail = (offset >= frontEnd) ? 0 : ((frontEnd - offset < size) ? frontEnd - offset : size);
+    memcpy(buffer, prefetch->windows[prefetch->front] + (offset - frontOffset), avail);
+    memset(buffer + avail, 0x00, size - avail);
+    
+    // anticipate: once half the window is used up, load the next one in scroll direction
+    if(prefetch->busy || (direction == 0)) return;
+    u64 start = (u64) -1;
+    if(((direction > 0) && (frontEnd < prefetch->fileSize) && (frontEnd < end + (windowSize / 2))) ||
+        ((direction < 0) && (frontOffset > 0) && (offset < frontOffset + (windowSize / 2))))
+        start = fsPrefetchStart(prefetch, offset, size, direction);
+    if((start == (u64) -1) || (start == prefetch->windowOffset[back])) return;
+    prefetch->windowOffset[back] = (u64) -1;
+    prefetch->fresh = false;
+    prefetch->request = start;
+    prefetch->busy = true;
+    svcReleaseSemaphore(&count, prefetch->semRequest, 1);
+}
+
+bool fsDataProvider(const std::string path, u64 offset, u32 buffSize, std::function<bool(u64 &offset, bool &forceRefresh)> onLoop, std::function<bool(u8* data)> onUpdate, u32 prefetchSize, FsPatch* patch) {
     if((onLoop == NULL) || (onUpdate == NULL)) {
         errno = ENOTSUP;
         return false;
@@ -265,51 +2307,69 @@ bool fsDataProvider(const std::string path, u32 offset, u32 buffSize, std::funct
         return false;
     }
     
-    FILE* fp = fopen(path.c_str(), "rb");
+    FsFile file;
+    bool opened = fsFileOpen(&file, path, "rb");
     u8* buffer = (u8*) calloc(buffSize, 1);
     u8* bufferEnd = buffer + buffSize;
     
-    u32 fileSize  = fsGetFileSize(path);
-    u32 offsetPrev = (u32) -1;
+    u64 fileSize  = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
+    u64 offsetPrev = (u64) -1;
     
     bool forceRefresh = false;
     
     bool result = false;
     
-    if((fp == NULL) || (buffer == NULL)) {
-        if(fp != NULL) fclose(fp);
+    if(!opened || (buffer == NULL)) {
+        if(opened) fsFileClose(&file);
         if(buffer != NULL) free(buffer);
         return false;
     }
+    fsFileSeekable(&file);
+    
+    // with a prefetch window bigger than the buffer, reads come from memory most of the time
+    FsPrefetch prefetch;
+    bool prefetching = (prefetchSize > buffSize);
+    if(prefetching && !fsPrefetchInit(&prefetch, &file, patch, fileSize, prefetchSize)) {
+        fsPrefetchFree(&prefetch);
+        prefetching = false;
+    }
     
     while(core::running()) {
         if(((offset != offsetPrev) || forceRefresh) && (offset <= fileSize)) {
+            PROF_BEGIN(PROF_IO);
             if (forceRefresh) {
-                fclose(fp);
-                fileSize = fsGetFileSize(path);
-                fp = fopen(path.c_str(), "rb");
-                if(fp == NULL) break;
+                if(prefetching) fsPrefetchReset(&prefetch, 0);
+                fsFileClose(&file);
+                fileSize = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
+                opened = fsFileOpen(&file, path, "rb");
+                if(!opened) {
+                    PROF_END(PROF_IO);
+                    break;
+                }
                 if(offset > fileSize) offset = fileSize;
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, 1, buffSize, fp);
+                if(prefetching) {
+                    fsPrefetchReset(&prefetch, fileSize);
+                    fsPrefetchGet(&prefetch, offset, buffer, buffSize, 0);
+                } else fsDataRead(&file, patch, offset, buffer, buffSize);
                 forceRefresh = false;
+            } else if(prefetching) {
+                fsPrefetchGet(&prefetch, offset, buffer, buffSize, (offsetPrev == (u64) -1) ? 0 : ((offset < offsetPrev) ? -1 : 1));
             } else if(offset < offsetPrev) {
-                u32 dataEnd = offset + buffSize;
+                u64 dataEnd = offset + buffSize;
                 u32 overlap = (dataEnd > offsetPrev) ? dataEnd - offsetPrev : 0;
                 memmove(bufferEnd - overlap, buffer, overlap);
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, 1, buffSize - overlap, fp);
+                fsDataRead(&file, patch, offset, buffer, buffSize - overlap);
             } else {
-                u32 dataEnd = offset + buffSize;
-                u32 dataEndPrev = offsetPrev + buffSize;
+                u64 dataEnd = offset + buffSize;
+                u64 dataEndPrev = offsetPrev + buffSize;
                 u32 overlap = (dataEndPrev > offset) ? dataEndPrev - offset : 0;
                 memmove(buffer, bufferEnd - overlap, overlap);
                 if(dataEnd > fileSize) {
                     memset(buffer + overlap, 0x00, buffSize - overlap);
                 }
-                fseek(fp, offset + overlap, SEEK_SET);
-                fread(buffer + overlap, 1, buffSize - overlap, fp);
+                fsDataRead(&file, patch, offset + overlap, buffer + overlap, buffSize - overlap);
             }
+            PROF_END(PROF_IO);
             offsetPrev = offset;
             if(onUpdate(buffer)) {
                 result = true;
@@ -323,207 +2383,1684 @@ bool fsDataProvider(const std::string path, u32 offset, u32 buffSize, std::funct
         if(result) break;
     }
     
-    if(fp != NULL) fclose(fp);
+    if(prefetching) fsPrefetchFree(&prefetch);
+    if(opened) fsFileClose(&file);
     if(buffer != NULL) free(buffer);
     
     return result;
 }
 
-bool fsPathDelete(const std::string path) {
-    if(fsIsDirectory(path)) {
-        std::vector<FileInfo> contents = fsGetDirectoryContents(path);
-        for (std::vector<FileInfo>::iterator it = contents.begin(); it != contents.end(); it++)
-            if (!fsPathDelete((*it).path)) return false;
-        return (rmdir(path.c_str()) == 0);
-    } else return (remove(path.c_str()) == 0);
-}
+std::vector<FileInfo> fsGetDirectoryContents(const std::string directory) {
+    std::vector<FileInfo> result;
+    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
+    const std::string dirWithSlash = hasSlash ? directory : directory + "/";
 
-bool fsPathCopy(const std::string path, const std::string dest, bool overwrite, bool showProgress) {
-    if(fsExists(dest)) {
-       if(!overwrite) {
-            errno = EEXIST;
-            return false;
-        } else if(path.compare(dest) == 0) {
-            errno = EACCES;
-            return false;
-        } else if(fsIsDirectory(path) != fsIsDirectory(dest)) {
-            if (!fsPathDelete(dest)) return false;
+    DIR* dir = opendir(dirWithSlash.c_str());
+    if(dir == NULL) {
+        return result;
+    }
+
+    while(core::running()) {
+        struct dirent* ent = readdir(dir);
+        if(ent == NULL) {
+            break;
         }
+        result.push_back({dirWithSlash + std::string(ent->d_name), std::string(ent->d_name)});
     }
-    if(showProgress && !fsShowProgress("Copying", path, 0, 1)) {
-        errno = ECANCELED;
-        return false;
+
+    closedir(dir);
+    return result;
+}
+
+std::string fsDirCacheKey(const std::string path) {
+    // "sdmc://dir/" -> "sdmc:/dir", keeps the root slash
+    std::string result;
+    for(std::string::const_iterator it = path.begin(); it != path.end(); it++)
+        if((*it != '/') || result.empty() || (result[result.size() - 1] != '/')) result.push_back(*it);
+    while((result.size() > 1) && (result[result.size() - 1] == '/') && (result[result.size() - 2] != ':'))
+        result.erase(result.size() - 1);
+    return result;
+}
+
+std::string fsDirCacheParent(const std::string key) {
+    // "sdmc:/dir/file" -> "sdmc:/dir", "sdmc:/dir" -> "sdmc:/", empty for the root
+    size_t slash = key.find_last_of('/');
+    if(slash == std::string::npos) return "";
+    std::string parent = key.substr(0, slash);
+    if((parent.size() == 0) || (parent[parent.size() - 1] == ':')) parent.push_back('/');
+    return (parent.compare(key) != 0) ? parent : "";
+}
+
+void fsArchiveForget(const std::string key) {
+    // archives at or below key, the next access reads their directory again
+    const std::string prefix = (key[key.size() - 1] == '/') ? key : key + "/";
+    fsArchiveLock();
+    for(std::map<std::string, FsArchive>::iterator it = fsArchives.begin(); it != fsArchives.end();) {
+        const std::string archiveKey = fsDirCacheKey(it->first);
+        if((archiveKey.compare(key) == 0) || (archiveKey.compare(0, prefix.size(), prefix) == 0)) {
+            fsArchiveBytes -= it->second.bytes;
+            fsArchives.erase(it++);
+        } else it++;
     }
-    if(fsIsDirectory(path)) {
-        if(dest.find(path + "/") != std::string::npos) {
-            errno = ENOTSUP;
-            return false;
-        }
-        if(overwrite && fsIsDirectory(dest));
-        else if(mkdir(dest.c_str(), 0777) != 0) return false;
-        if(showProgress && !fsShowProgress("Copying", path, 1, 2)) {
-            errno = ECANCELED;
-            return false;
+    fsArchiveUnlock();
+}
+
+void fsDirCacheInvalidate(const std::string path) {
+    // drops the listing of the parent folder, the path itself and everything below it
+    const std::string key = fsDirCacheKey(path);
+    if(key.empty()) return;
+    fsLineIndexForget(key); // every write goes through here, a saved index would be stale
+    fsDirCacheGeneration++;
+    fsArchiveForget(key);
+    const std::string parent = fsDirCacheParent(key);
+    if(!parent.empty()) fsDirCache.erase(parent);
+    fsDirCache.erase(key);
+    const std::string prefix = (key[key.size() - 1] == '/') ? key : key + "/";
+    for(std::map<std::string, FsDirCacheEntry>::iterator it = fsDirCache.lower_bound(prefix); it != fsDirCache.end();) {
+        if(it->first.compare(0, prefix.size(), prefix) != 0) break;
+        fsDirCache.erase(it++);
+    }
+}
+
+bool fsDirCacheUnverified(const std::string directory) {
+    // true once for a listing that came from the session snapshot, which is dropped here,
+    // so the next listing of directory reads the card again
+    std::map<std::string, FsDirCacheEntry>::iterator cached = fsDirCache.find(fsDirCacheKey(directory));
+    if((cached == fsDirCache.end()) || !cached->second.restored) return false;
+    fsDirCache.erase(cached);
+    return true;
+}
+
+void fsDirCacheClear() {
+    fsDirCacheGeneration++;
+    fsDirCache.clear();
+}
+
+void fsDirCacheStore(const std::string key, const std::vector<FileInfoEx> &entries) {
+    // least recently used listing goes first once the cache is full
+    if(fsDirCache.size() >= CTRX_DIRCACHE_MAX) {
+        std::map<std::string, FsDirCacheEntry>::iterator oldest = fsDirCache.begin();
+        for(std::map<std::string, FsDirCacheEntry>::iterator it = fsDirCache.begin(); it != fsDirCache.end(); it++)
+            if(it->second.stamp < oldest->second.stamp) oldest = it;
+        fsDirCache.erase(oldest);
+    }
+    fsDirCache[key] = {entries, ++fsDirCacheStamp, false};
+}
+
+void fsDirSizeStore(const std::string key, const FsDirSize &size) {
+    if((fsDirSizes.size() >= CTRX_DIRSIZE_MAX) && (fsDirSizes.find(key) == fsDirSizes.end())) {
+        std::map<std::string, FsDirSizeEntry>::iterator oldest = fsDirSizes.begin();
+        for(std::map<std::string, FsDirSizeEntry>::iterator it = fsDirSizes.begin(); it != fsDirSizes.end(); it++)
+            if(it->second.stamp < oldest->second.stamp) oldest = it;
+        fsDirSizes.erase(oldest);
+    }
+    fsDirSizes[key] = {size, ++fsDirCacheStamp};
+}
+
+bool fsDirSizeGet(const std::string path, FsDirSize &size) {
+    std::map<std::string, FsDirSizeEntry>::iterator found = fsDirSizes.find(fsDirCacheKey(path));
+    if(found == fsDirSizes.end()) return false;
+    found->second.stamp = ++fsDirCacheStamp;
+    size = found->second.size;
+    return true;
+}
+
+bool fsDirSizeTracked(const std::string path) {
+    // true if a folder above path has a cached size
+    if(fsDirSizes.empty()) return false;
+    for(std::string parent = fsDirCacheParent(fsDirCacheKey(path)); !parent.empty(); parent = fsDirCacheParent(parent))
+        if(fsDirSizes.find(parent) != fsDirSizes.end()) return true;
+    return false;
+}
+
+void fsDirSizeAdjust(const std::string path, s64 bytes, s32 files, s32 folders) {
+    // path was added (positive) or removed (negative), every cached folder above it changes by that
+    if(fsDirSizes.empty()) return;
+    fsDirSizeGeneration++;
+    for(std::string parent = fsDirCacheParent(fsDirCacheKey(path)); !parent.empty(); parent = fsDirCacheParent(parent)) {
+        std::map<std::string, FsDirSizeEntry>::iterator found = fsDirSizes.find(parent);
+        if(found == fsDirSizes.end()) continue;
+        FsDirSize &size = found->second.size;
+        if(((s64) size.size + bytes < 0) || ((s64) size.files + files < 0) || ((s64) size.folders + folders < 0)) {
+            fsDirSizes.erase(found); // out of sync, measure it again
+            continue;
         }
-        std::vector<FileInfo> contents = fsGetDirectoryContents(path);
-        for (std::vector<FileInfo>::iterator it = contents.begin(); it != contents.end(); it++)
-            if (!fsPathCopy((*it).path, dest + "/" + (*it).name, overwrite, showProgress)) return false;
+        size.size += bytes;
+        size.files += files;
+        size.folders += folders;
+    }
+}
+
+void fsDirSizeForget(const std::string path) {
+    // the path itself and everything below it
+    const std::string key = fsDirCacheKey(path);
+    if(key.empty() || fsDirSizes.empty()) return;
+    fsDirSizeGeneration++;
+    fsDirSizes.erase(key);
+    const std::string prefix = (key[key.size() - 1] == '/') ? key : key + "/";
+    for(std::map<std::string, FsDirSizeEntry>::iterator it = fsDirSizes.lower_bound(prefix); it != fsDirSizes.end();) {
+        if(it->first.compare(0, prefix.size(), prefix) != 0) break;
+        fsDirSizes.erase(it++);
+    }
+}
+
+void fsDirSizeInvalidate(const std::string path) {
+    // for changes of unknown size, drops everything that may contain path
+    fsDirSizeForget(path);
+    for(std::string parent = fsDirCacheParent(fsDirCacheKey(path)); !parent.empty(); parent = fsDirCacheParent(parent))
+        fsDirSizes.erase(parent);
+    fsDirSizeGeneration++;
+}
+
+bool fsDirSizeMeasure(const std::string path, FsDirSize &size) {
+    // what path adds to the folders above it, false if that is not known without a walk
+    FsStat stat = fsStat(path);
+    if(!stat.exists) return false;
+    if(!stat.isDirectory) {
+        size = {stat.size, 1, 0};
         return true;
-    } else {
+    }
+    if(!fsDirSizeGet(path, size)) return false;
+    size.folders++;
+    return true;
+}
+
+void fsDirSizeApply(const std::string path, bool known, const FsDirSize &size, int direction) {
+    // direction is -1 once path is gone, +1 once it is in place
+    if(!known) {
+        fsDirSizeInvalidate(path);
+        return;
+    }
+    if(direction < 0) fsDirSizeForget(path);
+    fsDirSizeAdjust(path, direction * (s64) size.size, direction * (s32) size.files, direction * (s32) size.folders);
+}
+
+bool fsArchiveList(const std::string dirWithSlash, std::function<bool(const FileInfoEx &entry)> onEntry, bool &inside) {
+    // the entries directly below a folder inside an archive, or below the archive itself
+    inside = false;
+    if(fsArchiveSlash(dirWithSlash, 0) == std::string::npos) return false;
+    std::string archivePath;
+    std::string member;
+    std::vector<FileInfoEx> children;
+    bool ret = false;
+    fsArchiveLock();
+    const FsArchive* archive = fsArchiveGet(dirWithSlash, archivePath, member);
+    if(archive != NULL) {
+        inside = true;
+        const ZipEntry* folder = member.empty() ? NULL : fsArchiveEntry(archive, member);
+        ret = member.empty() || ((folder != NULL) && folder->isDirectory);
+        const std::string prefix = member.empty() ? member : member + "/";
+        std::vector<ZipEntry>::const_iterator it = std::lower_bound(archive->entries.begin(), archive->entries.end(), prefix,
+            [](const ZipEntry &entry, const std::string &name) { return entry.name < name; });
+        for(; ret && (it != archive->entries.end()) && (it->name.compare(0, prefix.size(), prefix) == 0); it++) {
+            if(it->name.find('/', prefix.size()) != std::string::npos) continue;
+            const std::string name = it->name.substr(prefix.size());
+            children.push_back({dirWithSlash + name, name, it->isDirectory, it->size});
+        }
+    }
+    fsArchiveUnlock();
+    if(inside && !ret) errno = ENOTDIR;
+    for(std::vector<FileInfoEx>::const_iterator it = children.begin(); it != children.end(); it++)
+        if(!onEntry(*it)) break;
+    return ret;
+}
+
+bool fsReadDirectory(const std::string dirWithSlash, const u16* path16, std::function<bool(const FileInfoEx &entry)> onEntry, bool withSizes = true) {
+    // with an SD card path16 one FSDIR_Read pass delivers names, attributes and sizes,
+    // otherwise the type comes from the dirent and sizes cost a stat each, skip them if unused;
+    // archives are listed from their cached directory
+    bool inside = false;
+    bool listed = fsArchiveList(dirWithSlash, onEntry, inside);
+    if(inside) return listed;
+    if(path16 != NULL) {
+        Handle dirHandle;
+        if(R_FAILED(FSUSER_OpenDirectory(&dirHandle, fsSdmcArchive, fsMakePath(PATH_UTF16, path16)))) return false;
+        
+        std::vector<FS_DirectoryEntry> entries(CTRX_DIRREAD_CNT);
+        u8 name8[CTRX_PATHMAX];
         bool ret = true;
-        u64 total = fsGetFileSize(path);
-        size_t l_bufsiz = (total < CTRX_BUFSIZ) ? total : CTRX_BUFSIZ;
-        u8* buffer = (u8*) malloc( l_bufsiz );
-        FILE* fp = fopen(path.c_str(), "rb");
-        FILE* fd = fopen(dest.c_str(), "wb");
-        if((fp != NULL) && (fd != NULL) && (buffer != NULL)) {
-            u64 pos = 0;
-            size_t size;
-            while ((size = fread(buffer, 1, l_bufsiz, fp)) > 0) {
-                pos += fwrite(buffer, 1, size, fd);
-                if(showProgress && !fsShowProgress("Copying", path, pos, total)) {
-                    errno = ECANCELED;
-                    ret = false;
-                    break;
-                }
+        bool running = true;
+        while(running) {
+            u32 nRead = 0;
+            if(R_FAILED(FSDIR_Read(dirHandle, &nRead, CTRX_DIRREAD_CNT, entries.data()))) {
+                ret = false;
+                break;
             }
-            ret = ret && (pos == total);
-        } else ret = false;
-        if(buffer != NULL) free(buffer);
-        if(fp != NULL) fclose(fp);
-        if(fd != NULL) fclose(fd);
+            if(nRead == 0) break;
+            for(u32 i = 0; (i < nRead) && running; i++) {
+                ssize_t len = utf16_to_utf8(name8, entries[i].name, CTRX_PATHMAX - 1);
+                if(len <= 0) continue;
+                const std::string name((const char*) name8, len);
+                bool isDirectory = (entries[i].attributes & FS_ATTRIBUTE_DIRECTORY) != 0;
+                running = onEntry({dirWithSlash + name, name, isDirectory, isDirectory ? 0 : entries[i].fileSize});
+            }
+        }
+        
+        FSDIR_Close(dirHandle);
         return ret;
     }
+    
+    DIR* dir = opendir(dirWithSlash.c_str());
+    if(dir == NULL) {
+        return false;
+    }
+
+    while(true) {
+        struct dirent* ent = readdir(dir);
+        if(ent == NULL) {
+            break;
+        }
+        const std::string name = std::string(ent->d_name);
+        if((name.compare(".") != 0) && (name.compare("..") != 0)) {
+            const std::string path = dirWithSlash + std::string(ent->d_name);
+            bool isDirectory = (ent->d_type == DT_DIR);
+            if(!onEntry({path, std::string(ent->d_name), isDirectory, (isDirectory || !withSizes) ? 0 : fsGetFileSize(path)})) break;
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+std::vector<FileInfoEx> fsGetDirectoryContentsEx(const std::string directory) {
+    PROF_SCOPE(PROF_IO);
+    std::vector<FileInfoEx> result;
+    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
+    const std::string dirWithSlash = hasSlash ? directory : directory + "/";
+    const std::string key = fsDirCacheKey(directory);
+    
+    std::map<std::string, FsDirCacheEntry>::iterator cached = fsDirCache.find(key);
+    if(cached != fsDirCache.end()) {
+        cached->second.stamp = ++fsDirCacheStamp;
+        return cached->second.entries;
+    }
+    
+    u16 path16[CTRX_PATHMAX];
+    auto onEntry = [&](const FileInfoEx &entry) {
+        result.push_back(entry);
+        return core::running();
+    };
+    fsSpeedupBegin();
+    bool ret = fsSdmcMakePath(dirWithSlash, path16) && fsReadDirectory(dirWithSlash, path16, onEntry);
+    if(!ret) {
+        result.clear();
+        ret = fsReadDirectory(dirWithSlash, NULL, onEntry);
+    }
+    
+    std::sort(result.begin(), result.end(), fsAlphabetizeFoldersFiles());
+    fsSpeedupEnd();
+    if(ret && core::running()) fsDirCacheStore(key, result);
+    return result;
+}
+
+bool fsListDirectory(const std::string directory, std::vector<FileInfoEx> &contents, bool withSizes = true, volatile bool* abort = NULL) {
+    // one uncached, unsorted listing, through FSUSER if possible, workers pass their abort flag
+    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
+    const std::string dirWithSlash = hasSlash ? directory : directory + "/";
+    u16 path16[CTRX_PATHMAX];
+    auto onEntry = [&](const FileInfoEx &entry) {
+        contents.push_back(entry);
+        return (abort != NULL) ? !*abort : core::running();
+    };
+    contents.clear();
+    if(fsSdmcMakePath(dirWithSlash, path16) && fsReadDirectory(dirWithSlash, path16, onEntry)) return true;
+    contents.clear();
+    return fsReadDirectory(dirWithSlash, NULL, onEntry, withSizes);
+}
+
+u64 fsPathSize(const std::string path) {
+    // size of a file, or of everything in a folder tree, listings bypass the directory cache
+    FsStat stat = fsStat(path);
+    if(!stat.isDirectory) return stat.size;
+    u64 size = 0;
+    std::vector<std::string> folders(1, path);
+    std::vector<FileInfoEx> contents;
+    while(!folders.empty() && core::running()) {
+        const std::string directory = folders.back();
+        folders.pop_back();
+        fsListDirectory(directory, contents);
+        for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+            if((*it).isDirectory) folders.push_back((*it).path);
+            else size += (*it).size;
+        }
+    }
+    return size;
+}
+
+bool fsPathDeleteTree(const std::string path) {
+    // one listing per folder, the entry types come with it, folders go once they are empty
+    std::vector<std::pair<std::string, bool> > folders(1, std::make_pair(path, false)); // path, listed
+    std::vector<FileInfoEx> contents;
+    while(!folders.empty()) {
+        if(folders.back().second) {
+            if(rmdir(folders.back().first.c_str()) != 0) return false;
+            folders.pop_back();
+            continue;
+        }
+        folders.back().second = true;
+        if(!fsListDirectory(folders.back().first, contents, false)) return false;
+        for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+            if((*it).isDirectory) folders.push_back(std::make_pair((*it).path, false));
+            else if(remove((*it).path.c_str()) != 0) return false;
+        }
+    }
+    return true;
+}
+
+bool fsPathDelete(const std::string path) {
+    PROF_SCOPE(PROF_IO);
+    if(fsArchiveReadOnly(path)) return false;
+    fsDirCacheInvalidate(path);
+    FsDirSize removed = {0, 0, 0};
+    bool known = !fsDirSizeTracked(path) || fsDirSizeMeasure(path, removed);
+    bool ret = false;
+    u16 path16[CTRX_PATHMAX];
+    if(fsSdmcMakePath(path, path16)) { // a file or a whole tree in one request, the walk below is the fallback
+        FS_Path fsPath = fsMakePath(PATH_UTF16, path16);
+        ret = R_SUCCEEDED(FSUSER_DeleteFile(fsSdmcArchive, fsPath)) ||
+            R_SUCCEEDED(FSUSER_DeleteDirectoryRecursively(fsSdmcArchive, fsPath));
+    }
+    if(!ret) {
+        if(fsIsDirectory(path)) ret = fsPathDeleteTree(path);
+        else ret = (remove(path.c_str()) == 0);
+    }
+    fsDirSizeApply(path, ret && known, removed, -1);
+    return ret;
+}
+
+struct fsCaseLess {
+    inline bool operator()(const std::string &a, const std::string &b) const {
+        return strcasecmp(a.c_str(), b.c_str()) < 0;
+    }
+};
+
+bool fsPathMoveMerge(const std::string path, const std::string dest) {
+    // both are folders: everything not in dest yet is renamed over as a whole,
+    // the rest is merged or replaced, one listing per folder on each side
+    std::vector<FileInfoEx> contents;
+    if(!fsListDirectory(dest, contents, false)) return false;
+    std::map<std::string, bool, fsCaseLess> existing; // FAT names, isDirectory
+    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++)
+        existing[(*it).name] = (*it).isDirectory;
+    
+    if(!fsListDirectory(path, contents, false)) return false;
+    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+        const std::string target = dest + "/" + (*it).name;
+        std::map<std::string, bool, fsCaseLess>::iterator found = existing.find((*it).name);
+        if(found != existing.end()) {
+            if((*it).isDirectory && found->second) {
+                if(!fsPathMoveMerge((*it).path, dest + "/" + found->first)) return false;
+                continue;
+            }
+            if(!fsPathDelete(dest + "/" + found->first)) return false;
+        }
+        if(rename((*it).path.c_str(), target.c_str()) != 0) return false;
+    }
+    return (rmdir(path.c_str()) == 0);
 }
 
 bool fsPathMove(const std::string path, const std::string dest, bool overwrite) {
+    PROF_SCOPE(PROF_IO);
+    if(fsArchiveReadOnly(path) || fsArchiveReadOnly(dest)) return false;
+    fsDirCacheInvalidate(path);
+    fsDirCacheInvalidate(dest);
     if(dest.find(path + "/") != std::string::npos) {
         errno = ENOTSUP;
         return false;
     }
-    if(fsExists(dest)) {
+    FsStat target = fsStat(dest);
+    if(target.exists) {
         if(!overwrite) {
             errno = EEXIST;
             return false;
         } else if(path.compare(dest) == 0) {
             errno = EACCES;
             return false;
-        } else if(fsIsDirectory(path) && fsIsDirectory(dest)) {
-            std::vector<FileInfo> contents = fsGetDirectoryContents(path);
-            for (std::vector<FileInfo>::iterator it = contents.begin(); it != contents.end(); it++)
-                if (!fsPathMove((*it).path, dest + "/" + (*it).name, overwrite)) return false;
-            return (rmdir(path.c_str()) == 0);
+        } else if(target.isDirectory && fsIsDirectory(path)) {
+            bool ret = fsPathMoveMerge(path, dest);
+            fsDirSizeInvalidate(path); // partly renamed, partly merged
+            fsDirSizeInvalidate(dest);
+            return ret;
         } else if (!fsPathDelete(dest)) return false;
     }
-    return (rename(path.c_str(), dest.c_str()) == 0);
+    FsDirSize moved = {0, 0, 0};
+    bool known = (!fsDirSizeTracked(path) && !fsDirSizeTracked(dest)) || fsDirSizeMeasure(path, moved);
+    if(rename(path.c_str(), dest.c_str()) != 0) return false;
+    fsDirSizeApply(path, known, moved, -1);
+    fsDirSizeApply(dest, known, moved, 1);
+    return true;
+}
+
+bool fsPathCopyItem(const std::string path, const std::string dest, const FsStat &source, const FsStat &target, bool overwrite, bool showProgress) {
+    // source and target are what the caller already knows about both paths, so nothing gets probed twice
+    fsDirCacheInvalidate(dest);
+    if(!source.exists) {
+        errno = ENOENT;
+        return false;
+    }
+    if(target.exists) {
+       if(!overwrite) {
+            errno = EEXIST;
+            return false;
+        } else if(path.compare(dest) == 0) {
+            errno = EACCES;
+            return false;
+        } else if(source.isDirectory != target.isDirectory) {
+            if (!fsPathDelete(dest)) return false;
+        }
+    }
+    if(showProgress && !fsShowProgress("Copying", path, 0, 0, false)) {
+        errno = ECANCELED;
+        return false;
+    }
+    if(source.isDirectory) {
+        if(dest.find(path + "/") != std::string::npos) {
+            errno = ENOTSUP;
+            return false;
+        }
+        bool merge = overwrite && target.isDirectory;
+        if(!merge) {
+            if(mkdir(dest.c_str(), 0777) != 0) return false;
+            fsDirSizeAdjust(dest, 0, 0, 1);
+        }
+        if(showProgress && !fsShowProgress("Copying", path, 0, 0, false)) {
+            errno = ECANCELED;
+            return false;
+        }
+        std::vector<FileInfoEx> contents;
+        if(!fsListDirectory(path, contents)) return false;
+        const FsStat absent = {false, false, 0}; // nothing to check in a folder that was just created
+        for (std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+            const std::string itemDest = dest + "/" + (*it).name;
+            const FsStat itemSource = {true, (*it).isDirectory, (*it).size};
+            if (!fsPathCopyItem((*it).path, itemDest, itemSource, merge ? fsStat(itemDest) : absent, overwrite, showProgress)) return false;
+        }
+        return true;
+    } else {
+        bool ret = false;
+        u64 total = source.size;
+        u32 crc32 = 0;
+        FsFile src;
+        FsFile dst;
+        bool srcOpened = fsFileOpen(&src, path, "rb");
+        bool dstOpened = srcOpened && fsFileOpen(&dst, dest, "wb");
+        if(fsCopyVerify) fsCrc32Init();
+        if(srcOpened && dstOpened) {
+            ret = fsPipeRun(total,
+                [&](u8* buffer, u64 pos, u32 size) { // reader thread
+                    return fsFileRead(&src, pos, buffer, size) == size;
+                },
+                [&](u8* buffer, u64 pos, u32 size) { // writer thread
+                    if(fsCopyVerify) crc32 = fsCrc32Update(crc32, buffer, size);
+                    return fsFileWrite(&dst, pos, buffer, size) == size;
+                },
+                [&](u64 pos) {
+                    return !showProgress || fsShowProgress("Copying", path, pos, total);
+                });
+            fsProgressAdvance(total);
+        }
+        if(srcOpened) fsFileClose(&src);
+        if(dstOpened) fsFileClose(&dst);
+        if(ret && fsCopyVerify) ret = fsCopyCheck(dest, total, crc32, path, showProgress);
+        bool replaced = target.exists && !target.isDirectory; // a folder in the way was deleted above
+        if(ret) fsDirSizeAdjust(dest, (s64) total - (s64) (replaced ? target.size : 0), replaced ? 0 : 1, 0);
+        else if(dstOpened) fsDirSizeInvalidate(dest);
+        return ret;
+    }
+}
+
+bool fsPathCopy(const std::string path, const std::string dest, bool overwrite, bool showProgress) {
+    PROF_SCOPE(PROF_IO);
+    if(fsArchiveReadOnly(dest)) return false;
+    // a folder gets one progress bar for its whole tree
+    FsStat source = fsStat(path);
+    bool job = showProgress && (fsProgress.depth == 0) && source.isDirectory;
+    if(job) fsProgressBegin(fsPathSize(path) * (fsCopyVerify ? 2 : 1));
+    bool ret = fsPathCopyItem(path, dest, source, fsStat(dest), overwrite, showProgress);
+    if(job) fsProgressEnd();
+    return ret;
 }
 
 bool fsPathRename(const std::string path, const std::string dest) {
+    PROF_SCOPE(PROF_IO);
+    if(fsArchiveReadOnly(path) || fsArchiveReadOnly(dest)) return false;
+    fsDirCacheInvalidate(path);
+    fsDirCacheInvalidate(dest);
     if(dest.find(path + "/") != std::string::npos) {
         errno = ENOTSUP;
         return false;
     }
     if (fsExists(dest)) { // handle case sensitive rename
-        std::string tmpname(dest);
+        if (strcasecmp(path.c_str(), dest.c_str()) != 0) { // a different file, FAT names only clash when they match ignoring case
+            errno = EEXIST;
+            return false;
+        }
+    }
+    FsDirSize moved = {0, 0, 0};
+    bool known = (!fsDirSizeTracked(path) && !fsDirSizeTracked(dest)) || fsDirSizeMeasure(path, moved);
+    bool ret;
+    if (fsExists(dest)) {
+        std::string tmpname = dest + CTRX_RENAME_EXT;
         for (; fsExists(tmpname); tmpname.append(1, '_'));
         if (rename(path.c_str(), tmpname.c_str()) == 0) {
             if (fsExists(dest)) {
                 rename(tmpname.c_str(), path.c_str());
                 errno = EEXIST;
                 return false;
-            } else return (rename(tmpname.c_str(), dest.c_str()) == 0);
+            } else ret = (rename(tmpname.c_str(), dest.c_str()) == 0);
         } else return false;
-    } else return (rename(path.c_str(), dest.c_str()) == 0);
+    } else ret = (rename(path.c_str(), dest.c_str()) == 0);
+    if (ret) {
+        fsDirSizeApply(path, known, moved, -1);
+        fsDirSizeApply(dest, known, moved, 1);
+    } else fsDirSizeInvalidate(path); // may be left under the temporary name
+    return ret;
 }
 
 bool fsCreateDir(const std::string path) {
+    if(fsArchiveReadOnly(path)) return false;
+    fsDirCacheInvalidate(path);
     if(fsExists(path)) {
         errno = EEXIST;
         return false;
     }
-    return (mkdir(path.c_str(), 0777) == 0);
+    if(mkdir(path.c_str(), 0777) != 0) return false;
+    fsDirSizeAdjust(path, 0, 0, 1);
+    return true;
 }
 
 bool fsCreateDummyFile(const std::string path, u64 size, u16 content, bool overwrite, bool showProgress) {
-    if(!overwrite && fsExists(path)) {
+    PROF_SCOPE(PROF_IO);
+    // content is the first byte, plus the increment per byte in the upper 8 bit
+    if(fsArchiveReadOnly(path)) return false;
+    fsDirCacheInvalidate(path);
+    FsStat existing = fsStat(path);
+    if(!overwrite && existing.exists) {
         errno = EEXIST;
         return false;
     }
-    if(size < CTRX_BUFSIZ) showProgress = false;
-    if(showProgress) fsShowProgress("Generating", path, 0, 1);
-    bool ret = false;
-    size_t l_bufsiz = (size < CTRX_BUFSIZ) ? size : CTRX_BUFSIZ;
-    u8* buffer = (u8*) malloc( l_bufsiz );
-    FILE* fp = fopen(path.c_str(), "wb");
-    if((fp != NULL) && (buffer != NULL)) {
-        if(content & 0xFF00) {
-            u8 byte = content & 0xFF;
-            u8 inc = (content >> 8) & 0xFF;
-            for(u64 count = 0; count < l_bufsiz; count++, byte += inc)
-                buffer[count] = byte;
-        } else memset(buffer, content, l_bufsiz);
-        u64 pos = 0;
-        for(u64 count = 0; count < size; count += l_bufsiz) {
-            if(size - count < l_bufsiz) l_bufsiz = size - count;
-            pos += fwrite(buffer, 1, l_bufsiz, fp);
-            if(showProgress && !fsShowProgress("Generating", path, pos, size)) {
-                errno = ECANCELED;
-                break;
+    if((size > 0) && (size > fsGetFreeSpace() + existing.size)) {
+        errno = ENOSPC;
+        return false;
+    }
+    FsFile file;
+    if(!fsFileOpen(&file, path, "wb")) return false;
+    
+    bool ret;
+    if(content == 0x0000) { // zero fill, this only needs the clusters allocated
+        ret = fsFileSetSize(&file, size);
+    } else {
+        const u8 first = content & 0xFF;
+        const u8 inc = (content >> 8) & 0xFF;
+        if(size < CTRX_BUFSIZ) showProgress = false;
+        ret = fsPipeRun(size,
+            [&](u8* buffer, u64 pos, u32 size) { // reader thread, makes up the data
+                if(inc == 0) memset(buffer, first, size);
+                else {
+                    u8 byte = first + (u8) (inc * pos);
+                    for(u32 count = 0; count < size; count++, byte += inc)
+                        buffer[count] = byte;
+                }
+                return true;
+            },
+            [&](u8* buffer, u64 pos, u32 size) { // writer thread
+                return fsFileWrite(&file, pos, buffer, size) == size;
+            },
+            [&](u64 pos) {
+                return !showProgress || fsShowProgress("Generating", path, pos, size);
+            });
+    }
+    fsFileClose(&file);
+    if(ret) fsDirSizeAdjust(path, (s64) size - (s64) existing.size, existing.exists ? 0 : 1, 0);
+    else fsDirSizeInvalidate(path);
+    return ret;
+}
+
+void fsDirStreamWorker(void* arg) {
+    FsDirStream* stream = (FsDirStream*) arg;
+    std::vector<FileInfoEx> batch;
+    auto flush = [&]() {
+        svcWaitSynchronization(stream->mutex, U64_MAX);
+        stream->pending.insert(stream->pending.end(), batch.begin(), batch.end());
+        svcReleaseMutex(stream->mutex);
+        batch.clear();
+    };
+    bool stopped = false; // fsReadDirectory still succeeds when it is stopped, that listing is not the whole folder
+    auto onEntry = [&](const FileInfoEx &entry) {
+        batch.push_back(entry);
+        if(batch.size() >= CTRX_DIRREAD_CNT) flush();
+        stopped = stream->abort || !core::running();
+        return !stopped;
+    };
+    
+    fsSpeedupBegin();
+    bool ret = stream->useSdmc && fsReadDirectory(stream->dirWithSlash, stream->path16, onEntry);
+    if(!ret && !stopped && batch.empty() && stream->pending.empty()) // fall back unless something was handed out
+        ret = fsReadDirectory(stream->dirWithSlash, NULL, onEntry);
+    flush();
+    fsSpeedupEnd();
+    
+    stream->complete = ret && !stopped && !stream->abort;
+    stream->done = true;
+}
+
+FsDirStream* fsDirStreamOpen(const std::string directory) {
+    FsDirStream* stream = new FsDirStream;
+    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
+    stream->dirWithSlash = hasSlash ? directory : directory + "/";
+    stream->key = fsDirCacheKey(directory);
+    stream->thread = NULL;
+    stream->mutex = 0;
+    stream->abort = false;
+    stream->done = false;
+    stream->complete = false;
+    stream->delivered = 0;
+    stream->generation = fsDirCacheGeneration;
+    
+    std::map<std::string, FsDirCacheEntry>::iterator cached = fsDirCache.find(stream->key);
+    if(cached != fsDirCache.end()) { // nothing to stream, hand out everything on the first poll
+        cached->second.stamp = ++fsDirCacheStamp;
+        stream->pending = cached->second.entries;
+        stream->done = true;
+        return stream;
+    }
+    
+    stream->useSdmc = fsSdmcMakePath(stream->dirWithSlash, stream->path16);
+    if(svcCreateMutex(&stream->mutex, false) == 0) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        stream->thread = fsWorkerCreate(fsDirStreamWorker, stream, prio + 1);
+    }
+    if(stream->thread == NULL) { // no thread, read it all right away
+        if(stream->mutex == 0) svcCreateMutex(&stream->mutex, false);
+        fsDirStreamWorker(stream);
+    }
+    return stream;
+}
+
+bool fsDirStreamPoll(FsDirStream* stream, std::vector<FileInfoEx> &batch) {
+    bool done = stream->done;
+    batch.clear();
+    if(stream->mutex != 0) svcWaitSynchronization(stream->mutex, U64_MAX);
+    if(stream->pending.size() > stream->delivered)
+        batch.assign(stream->pending.begin() + stream->delivered, stream->pending.end());
+    stream->delivered = stream->pending.size();
+    if(stream->mutex != 0) svcReleaseMutex(stream->mutex);
+    std::sort(batch.begin(), batch.end(), fsAlphabetizeFoldersFiles());
+    
+    if(done && stream->complete && (stream->generation == fsDirCacheGeneration)) { // keep the listing unless something changed meanwhile
+        fsSpeedupBegin();
+        std::sort(stream->pending.begin(), stream->pending.end(), fsAlphabetizeFoldersFiles());
+        fsSpeedupEnd();
+        fsDirCacheStore(stream->key, stream->pending);
+        stream->complete = false;
+    }
+    return done && (stream->delivered == stream->pending.size());
+}
+
+void fsDirStreamClose(FsDirStream* stream) {
+    if(stream == NULL) return;
+    stream->abort = true;
+    if(stream->thread != NULL) {
+        threadJoin(stream->thread, U64_MAX);
+        threadFree(stream->thread);
+    }
+    if(stream->mutex != 0) svcCloseHandle(stream->mutex);
+    delete stream;
+}
+
+void fsCacheDirMake() {
+    // listings only change for the folders that are really created here
+    if(mkdir("sdmc:/3ds", 0777) == 0) fsDirCacheInvalidate("sdmc:/3ds");
+    if(mkdir(CTRX_CACHEDIR, 0777) == 0) fsDirCacheInvalidate(CTRX_CACHEDIR);
+}
+
+bool fsCacheFileWrite(const std::string path, const void* header, u32 headerSize, const std::vector<u8> &data) {
+    // written next to path first, the old file is only replaced by a complete new one
+    const std::string tmpPath = path + ".tmp";
+    const std::string oldPath = path + ".old";
+    FsFile file;
+    fsCacheDirMake();
+    fsDirCacheInvalidate(path); // the temporary files are in the same folder listing
+    fsDirSizeInvalidate(path);
+    if(!fsFileOpen(&file, tmpPath, "wb")) return false;
+    bool ret = (fsFileWrite(&file, 0, header, headerSize) == headerSize) &&
+        (fsFileWrite(&file, headerSize, data.data(), data.size()) == data.size());
+    fsFileClose(&file);
+    if(ret) {
+        bool replacing = (rename(path.c_str(), oldPath.c_str()) == 0);
+        ret = (rename(tmpPath.c_str(), path.c_str()) == 0);
+        if(!ret && replacing) rename(oldPath.c_str(), path.c_str());
+        else if(replacing) remove(oldPath.c_str());
+    }
+    if(!ret) remove(tmpPath.c_str());
+    return ret;
+}
+
+bool fsSettingsSave() {
+    FsSettingsHeader header = {CTRX_SETTINGS_MAGIC, 1, 0};
+    if(fsResizeJournal) header.flags |= CTRX_SETTING_JOURNAL;
+    if(fsCopyVerify) header.flags |= CTRX_SETTING_VERIFY;
+    if(fsSpeedupAlways) header.flags |= CTRX_SETTING_SPEEDUP;
+    return fsCacheFileWrite(CTRX_SETTINGS_FILE, &header, sizeof(header), std::vector<u8>());
+}
+
+bool fsSettingsLoad() {
+    FsFile file;
+    FsSettingsHeader header;
+    if(!fsFileOpen(&file, CTRX_SETTINGS_FILE, "rb")) return false;
+    bool ret = (fsFileRead(&file, 0, &header, sizeof(header)) == sizeof(header)) &&
+        (header.magic == CTRX_SETTINGS_MAGIC) && (header.version == 1);
+    fsFileClose(&file);
+    if(!ret) return false;
+    fsResizeJournal = (header.flags & CTRX_SETTING_JOURNAL) != 0;
+    fsCopyVerify = (header.flags & CTRX_SETTING_VERIFY) != 0;
+    if(fsHasSpeedup()) fsSetSpeedup((header.flags & CTRX_SETTING_SPEEDUP) != 0);
+    return true;
+}
+
+void fsSessionPutString(std::vector<u8> &data, const std::string str) {
+    u16 size = (str.size() < 0xFFFF) ? str.size() : 0xFFFF;
+    data.push_back(size & 0xFF);
+    data.push_back(size >> 8);
+    data.insert(data.end(), str.begin(), str.begin() + size);
+}
+
+bool fsSessionGetString(const std::vector<u8> &data, u32 &pos, std::string &str) {
+    if(pos + 2 > data.size()) return false;
+    u32 size = data[pos] | (data[pos + 1] << 8);
+    if(pos + 2 + size > data.size()) return false;
+    str.assign((const char*) data.data() + pos + 2, size);
+    pos += 2 + size;
+    return true;
+}
+
+bool fsSessionSave(const FsSession &session) {
+    // the view and the listings used last, each listing with the mtime of its folder
+    std::vector<u8> data;
+    fsSessionPutString(data, session.path);
+    fsSessionPutString(data, session.hexPath);
+
+    fsDirCacheInvalidate(CTRX_SESSION_FILE); // the listing of the cache folder is about to change, it is not worth keeping
+    std::vector<std::pair<u32, std::string> > recent;
+    for(std::map<std::string, FsDirCacheEntry>::iterator it = fsDirCache.begin(); it != fsDirCache.end(); it++)
+        recent.push_back(std::make_pair(it->second.stamp, it->first));
+    std::sort(recent.rbegin(), recent.rend());
+    if(recent.size() > CTRX_SESSION_DIRS) recent.resize(CTRX_SESSION_DIRS);
+
+    u32 nFolders = 0;
+    for(std::vector<std::pair<u32, std::string> >::iterator it = recent.begin(); it != recent.end(); it++) {
+        const std::vector<FileInfoEx> &entries = fsDirCache[it->second].entries;
+        struct stat st;
+        if((stat(it->second.c_str(), &st) != 0) || !S_ISDIR(st.st_mode)) continue;
+        if(data.size() + (entries.size() * 16) > CTRX_SESSION_MAX) break;
+        u64 mtime = (u64) st.st_mtime;
+        u32 count = entries.size();
+        fsSessionPutString(data, it->second);
+        data.insert(data.end(), (u8*) &mtime, (u8*) &mtime + sizeof(mtime));
+        data.insert(data.end(), (u8*) &count, (u8*) &count + sizeof(count));
+        for(std::vector<FileInfoEx>::const_iterator entry = entries.begin(); entry != entries.end(); entry++) {
+            u64 size = (*entry).isDirectory ? (u64) -1 : (*entry).size; // no file is that large
+            data.insert(data.end(), (u8*) &size, (u8*) &size + sizeof(size));
+            fsSessionPutString(data, (*entry).name);
+        }
+        nFolders++;
+    }
+
+    FsSessionHeader header = {CTRX_SESSION_MAGIC, 1, session.hexOffset, session.hexStoredOffset, (u32) data.size(), nFolders};
+    return fsCacheFileWrite(CTRX_SESSION_FILE, &header, sizeof(header), data);
+}
+
+bool fsSessionLoad(FsSession &session) {
+    // listings go into the directory cache if their folder still has the same mtime, the browser
+    // checks them in the background once they are shown, see fsDirCacheUnverified()
+    FsFile file;
+    FsSessionHeader header;
+    std::vector<u8> data;
+    if(!fsFileOpen(&file, CTRX_SESSION_FILE, "rb")) return false;
+    bool ret = (fsFileRead(&file, 0, &header, sizeof(header)) == sizeof(header)) &&
+        (header.magic == CTRX_SESSION_MAGIC) && (header.version == 1) && (header.size <= CTRX_SESSION_MAX);
+    if(ret) {
+        data.resize(header.size);
+        ret = (fsFileRead(&file, sizeof(header), data.data(), data.size()) == data.size());
+    }
+    fsFileClose(&file);
+    u32 pos = 0;
+    if(!ret || !fsSessionGetString(data, pos, session.path) || !fsSessionGetString(data, pos, session.hexPath)) return false;
+    session.hexOffset = header.hexOffset;
+    session.hexStoredOffset = header.hexStoredOffset;
+
+    for(u32 f = 0; f < header.nFolders; f++) {
+        std::string key;
+        u64 mtime;
+        u32 count;
+        if(!fsSessionGetString(data, pos, key) || key.empty() || (pos + sizeof(mtime) + sizeof(count) > data.size())) break;
+        memcpy(&mtime, data.data() + pos, sizeof(mtime));
+        memcpy(&count, data.data() + pos + sizeof(mtime), sizeof(count));
+        pos += sizeof(mtime) + sizeof(count);
+        const std::string dirWithSlash = (key[key.size() - 1] == '/') ? key : key + "/";
+        std::vector<FileInfoEx> entries;
+        bool complete = true;
+        for(u32 i = 0; complete && (i < count); i++) {
+            u64 size;
+            std::string name;
+            complete = (pos + sizeof(size) <= data.size());
+            if(!complete) break;
+            memcpy(&size, data.data() + pos, sizeof(size));
+            pos += sizeof(size);
+            complete = fsSessionGetString(data, pos, name);
+            if(complete) entries.push_back({dirWithSlash + name, name, size == (u64) -1, (size == (u64) -1) ? 0 : size});
+        }
+        if(!complete) break;
+        struct stat st;
+        if((stat(key.c_str(), &st) != 0) || !S_ISDIR(st.st_mode) || ((u64) st.st_mtime != mtime)) continue;
+        if(fsDirCache.find(key) != fsDirCache.end()) continue;
+        fsDirCacheStore(key, entries);
+        fsDirCache[key].restored = true;
+    }
+    return true;
+}
+
+void fsDirSizeWorker(void* arg) {
+    // one subfolder after the other, each result is handed out as soon as its walk is done
+    FsDirSizer* sizer = (FsDirSizer*) arg;
+    std::vector<FileInfoEx> contents;
+    std::vector<std::string> subfolders;
+    FsDirSize own = {0, 0, 0}; // the shown folder itself, only kept if every subfolder got measured
+    bool complete = fsListDirectory(sizer->directory, contents, true, &sizer->abort);
+    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+        if((*it).isDirectory) {
+            subfolders.push_back((*it).path);
+            own.folders++;
+        } else {
+            own.size += (*it).size;
+            own.files++;
+        }
+    }
+    
+    fsSpeedupBegin();
+    for(std::vector<std::string>::iterator sub = subfolders.begin(); (sub != subfolders.end()) && !sizer->abort; sub++) {
+        const std::string key = fsDirCacheKey(*sub);
+        FsDirSize size = {0, 0, 0};
+        std::map<std::string, FsDirSize>::iterator known = sizer->known.find(key);
+        if(known != sizer->known.end()) size = known->second;
+        else {
+            bool ret = true;
+            std::vector<std::string> folders(1, *sub);
+            while(!folders.empty() && !sizer->abort) {
+                const std::string directory = folders.back();
+                folders.pop_back();
+                if(!fsListDirectory(directory, contents, true, &sizer->abort)) ret = false;
+                for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+                    if((*it).isDirectory) {
+                        folders.push_back((*it).path);
+                        size.folders++;
+                    } else {
+                        size.size += (*it).size;
+                        size.files++;
+                    }
+                }
+            }
+            if(!ret || sizer->abort) {
+                complete = false;
+                continue;
             }
+            svcWaitSynchronization(sizer->mutex, U64_MAX);
+            sizer->pending.push_back(std::make_pair(key, size));
+            svcReleaseMutex(sizer->mutex);
         }
-        ret = (pos == size);
+        own.size += size.size;
+        own.files += size.files;
+        own.folders += size.folders;
     }
-    if(buffer != NULL) free(buffer);
-    if(fp != NULL) fclose(fp);
+    fsSpeedupEnd();
+    
+    if(complete && !sizer->abort) {
+        svcWaitSynchronization(sizer->mutex, U64_MAX);
+        sizer->pending.push_back(std::make_pair(fsDirCacheKey(sizer->directory), own));
+        svcReleaseMutex(sizer->mutex);
+    }
+}
+
+FsDirSizer* fsDirSizeOpen(const std::string directory) {
+    // measures the subfolders of directory in the background, NULL if there is no thread for it
+    // or if directory is inside an archive, where every size is already known
+    if(fsArchiveSlash(directory, 0) != std::string::npos) return NULL;
+    FsDirSizer* sizer = new FsDirSizer;
+    sizer->directory = directory;
+    sizer->delivered = 0;
+    sizer->thread = NULL;
+    sizer->mutex = 0;
+    sizer->abort = false;
+    sizer->generation = fsDirSizeGeneration;
+    
+    const std::string key = fsDirCacheKey(directory);
+    const std::string prefix = (key[key.size() - 1] == '/') ? key : key + "/";
+    for(std::map<std::string, FsDirSizeEntry>::iterator it = fsDirSizes.lower_bound(prefix); it != fsDirSizes.end(); it++) {
+        if(it->first.compare(0, prefix.size(), prefix) != 0) break;
+        if(it->first.find('/', prefix.size()) == std::string::npos) sizer->known[it->first] = it->second.size;
+    }
+    
+    fsSdmcOpenArchive();
+    if(svcCreateMutex(&sizer->mutex, false) == 0) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        sizer->thread = fsWorkerCreate(fsDirSizeWorker, sizer, prio + 2); // behind the listing
+    }
+    if(sizer->thread == NULL) { // walking whole trees on the main thread would stall the browser
+        fsDirSizeClose(sizer);
+        return NULL;
+    }
+    return sizer;
+}
+
+bool fsDirSizePoll(FsDirSizer* sizer) {
+    // moves new results into the cache, true if there were any
+    if(sizer == NULL) return false;
+    std::vector<std::pair<std::string, FsDirSize> > batch;
+    svcWaitSynchronization(sizer->mutex, U64_MAX);
+    if(sizer->pending.size() > sizer->delivered)
+        batch.assign(sizer->pending.begin() + sizer->delivered, sizer->pending.end());
+    sizer->delivered = sizer->pending.size();
+    svcReleaseMutex(sizer->mutex);
+    
+    if(sizer->generation != fsDirSizeGeneration) return false; // sizes changed meanwhile, these may miss that
+    for(std::vector<std::pair<std::string, FsDirSize> >::iterator it = batch.begin(); it != batch.end(); it++)
+        fsDirSizeStore(it->first, it->second);
+    return !batch.empty();
+}
+
+void fsDirSizeClose(FsDirSizer* sizer) {
+    if(sizer == NULL) return;
+    sizer->abort = true;
+    if(sizer->thread != NULL) {
+        threadJoin(sizer->thread, U64_MAX);
+        threadFree(sizer->thread);
+    }
+    if(sizer->mutex != 0) svcCloseHandle(sizer->mutex);
+    delete sizer;
+}
+
+void fsInfoWorker(void* arg) {
+    // answers one request after the other, exits once there are none left
+    while(true) {
+        svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+        bool free = fsInfo.freeWanted;
+        std::string path;
+        if(!fsInfo.statWanted.empty()) {
+            path = fsInfo.statWanted.front();
+            fsInfo.statWanted.erase(fsInfo.statWanted.begin());
+        }
+        fsInfo.freeWanted = false;
+        if(!free && path.empty()) fsInfo.running = false;
+        svcReleaseMutex(fsInfo.mutex);
+        if(!free && path.empty()) return;
+        
+        if(free) {
+            u64 freeSpace = fsGetFreeSpace();
+            svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+            fsInfo.freeSpace = freeSpace;
+            fsInfo.freeReady = true;
+            svcReleaseMutex(fsInfo.mutex);
+        }
+        if(!path.empty()) {
+            FsStat stat = fsStat(path);
+            svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+            fsInfo.stats.push_back(std::make_pair(path, stat));
+            svcReleaseMutex(fsInfo.mutex);
+        }
+    }
+}
+
+void fsInfoRequest(bool freeSpace, const std::string path) {
+    // the worker is started again if it ran out of requests, without a thread they are answered right away
+    if(fsInfo.mutex == 0) svcCreateMutex(&fsInfo.mutex, false);
+    svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+    if(freeSpace) fsInfo.freeWanted = true;
+    if(!path.empty() && (std::find(fsInfo.statWanted.begin(), fsInfo.statWanted.end(), path) == fsInfo.statWanted.end()))
+        fsInfo.statWanted.push_back(path);
+    bool start = !fsInfo.running;
+    fsInfo.running = true;
+    svcReleaseMutex(fsInfo.mutex);
+    if(!start) return;
+    
+    if(fsInfo.thread != NULL) { // done with its last request, only its exit may be left
+        threadJoin(fsInfo.thread, U64_MAX);
+        threadFree(fsInfo.thread);
+    }
+    fsSdmcOpenArchive();
+    s32 prio = 0x30;
+    svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+    fsInfo.thread = fsWorkerCreate(fsInfoWorker, NULL, prio + 1);
+    if(fsInfo.thread == NULL) fsInfoWorker(NULL);
+}
+
+void fsFreeSpaceRefresh() {
+    fsInfoRequest(true, "");
+}
+
+bool fsFreeSpacePoll(u64 &freeSpace) {
+    // true once a refreshed value came in
+    if(fsInfo.mutex == 0) return false;
+    svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+    bool ret = fsInfo.freeReady;
+    if(ret) freeSpace = fsInfo.freeSpace;
+    fsInfo.freeReady = false;
+    svcReleaseMutex(fsInfo.mutex);
     return ret;
 }
 
-std::vector<FileInfo> fsGetDirectoryContents(const std::string directory) {
-    std::vector<FileInfo> result;
-    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
-    const std::string dirWithSlash = hasSlash ? directory : directory + "/";
+void fsStatRefresh(const std::string path) {
+    fsInfoRequest(false, path);
+}
 
-    DIR* dir = opendir(dirWithSlash.c_str());
-    if(dir == NULL) {
-        return result;
+bool fsStatPoll(std::string &path, FsStat &stat) {
+    // one answer per call, in the order they were asked for
+    if(fsInfo.mutex == 0) return false;
+    svcWaitSynchronization(fsInfo.mutex, U64_MAX);
+    bool ret = !fsInfo.stats.empty();
+    if(ret) {
+        path = fsInfo.stats.front().first;
+        stat = fsInfo.stats.front().second;
+        fsInfo.stats.erase(fsInfo.stats.begin());
     }
+    svcReleaseMutex(fsInfo.mutex);
+    return ret;
+}
 
-    while(core::running()) {
-        struct dirent* ent = readdir(dir);
-        if(ent == NULL) {
-            break;
+u64 fsHashFnv(u64 hash, const void* data, u32 size) {
+    const u8* bytes = (const u8*) data;
+    for(u32 i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+u64 fsLineIndexSample(FsFile* file, u64 size) {
+    // cheap change detection: the size plus the first and the last few KiB
+    u8 buffer[CTRX_LINEIDX_SAMPLE];
+    u64 hash = fsHashFnv(0xCBF29CE484222325ULL, &size, sizeof(size));
+    u32 head = (size < CTRX_LINEIDX_SAMPLE) ? size : CTRX_LINEIDX_SAMPLE;
+    if(fsFileRead(file, 0, buffer, head) == head) hash = fsHashFnv(hash, buffer, head);
+    if((size > CTRX_LINEIDX_SAMPLE) && (fsFileRead(file, size - CTRX_LINEIDX_SAMPLE, buffer, CTRX_LINEIDX_SAMPLE) == CTRX_LINEIDX_SAMPLE))
+        hash = fsHashFnv(hash, buffer, CTRX_LINEIDX_SAMPLE);
+    return hash;
+}
+
+bool fsLineIndexLoad(FsLineIndexer* indexer, FsLineIndex &index) {
+    FsFile file;
+    FsLineIndexHeader header;
+    if(!fsFileOpen(&file, indexer->cachePath, "rb")) return false;
+    u64 marksMax = (indexer->fileSize / CTRX_LINEIDX_LINES) + (indexer->fileSize / CTRX_LINEIDX_BYTES) + 1;
+    bool ret = (fsFileRead(&file, 0, &header, sizeof(header)) == sizeof(header)) &&
+        (header.magic == CTRX_LINEIDX_MAGIC) && (header.version == 3) &&
+        (header.fileSize == indexer->fileSize) && (header.sample == indexer->sample) && (header.mtime == indexer->mtime) &&
+        (header.nMarks > 0) && (header.nMarks <= marksMax);
+    if(ret) {
+        u32 size = header.nMarks * sizeof(FsLineMark);
+        index.marks.resize(header.nMarks);
+        ret = (fsFileRead(&file, sizeof(header), index.marks.data(), size) == size) && (index.marks[0].offset == 0);
+    }
+    fsFileClose(&file);
+    
+    if(!ret) {
+        index.marks.clear();
+        return false;
+    }
+    index.scanned = header.fileSize;
+    index.lineCount = header.lineCount;
+    index.firstNul = header.firstNul;
+    index.complete = true;
+    return true;
+}
+
+void fsLineIndexList() {
+    // once per run, afterwards saving and forgetting keep the set up to date
+    if(fsLineIndexListed) return;
+    fsLineIndexListed = true;
+    std::vector<FileInfoEx> contents;
+    if(!fsListDirectory(CTRX_CACHEDIR, contents, false)) return;
+    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++)
+        if(!(*it).isDirectory && fsHasExtension((*it).name, "lidx")) fsLineIndexFiles.insert((*it).name);
+}
+
+std::string fsLineIndexName(const std::string path) {
+    const std::string key = fsDirCacheKey(path);
+    std::stringstream name;
+    name << std::hex << std::setfill('0') << std::setw(16) << fsHashFnv(0xCBF29CE484222325ULL, key.data(), key.size()) << ".lidx";
+    return name.str();
+}
+
+void fsLineIndexForget(const std::string path) {
+    // no card access unless there really is a saved index for path
+    fsLineIndexList();
+    std::set<std::string>::iterator it = fsLineIndexFiles.find(fsLineIndexName(path));
+    if(it == fsLineIndexFiles.end()) return;
+    const std::string cachePath = CTRX_CACHEDIR "/" + *it;
+    fsLineIndexFiles.erase(it);
+    remove(cachePath.c_str());
+    fsDirCacheInvalidate(cachePath);
+    fsDirSizeInvalidate(cachePath);
+}
+
+void fsLineIndexTrim(const std::string keep) {
+    // least recently written go first, keep is the one just saved
+    while(fsLineIndexFiles.size() > CTRX_LINEIDX_FILES) {
+        std::string oldest;
+        u64 oldestTime = (u64) -1;
+        for(std::set<std::string>::iterator it = fsLineIndexFiles.begin(); it != fsLineIndexFiles.end(); it++) {
+            struct stat st;
+            u64 mtime = (stat((CTRX_CACHEDIR "/" + *it).c_str(), &st) == 0) ? (u64) st.st_mtime : 0;
+            if((it->compare(keep) != 0) && (mtime < oldestTime)) {
+                oldest = *it;
+                oldestTime = mtime;
+            }
         }
-        result.push_back({dirWithSlash + std::string(ent->d_name), std::string(ent->d_name)});
+        if(oldest.empty()) break;
+        const std::string cachePath = CTRX_CACHEDIR "/" + oldest;
+        fsLineIndexFiles.erase(oldest);
+        remove(cachePath.c_str());
+        fsDirSizeInvalidate(cachePath);
     }
+}
 
-    closedir(dir);
+void fsLineIndexSave(FsLineIndexer* indexer) {
+    FsFile file;
+    FsLineIndexHeader header = {CTRX_LINEIDX_MAGIC, 3, indexer->fileSize, indexer->sample, indexer->mtime, indexer->lineCount, indexer->firstNul, (u32) indexer->pending.size(), 0};
+    u32 size = header.nMarks * sizeof(FsLineMark);
+    const std::string name = fsLineIndexName(indexer->path);
+    fsLineIndexList();
+    fsCacheDirMake();
+    fsDirCacheInvalidate(CTRX_CACHEDIR "/" + name);
+    fsDirSizeInvalidate(indexer->cachePath);
+    if(!fsFileOpen(&file, indexer->cachePath, "wb")) return;
+    bool ret = (fsFileWrite(&file, 0, &header, sizeof(header)) == sizeof(header)) &&
+        (fsFileWrite(&file, sizeof(header), indexer->pending.data(), size) == size);
+    fsFileClose(&file);
+    if(!ret) { // a partial index would never validate anyway
+        remove(indexer->cachePath.c_str());
+        return;
+    }
+    fsLineIndexFiles.insert(name);
+    fsLineIndexTrim(name);
+}
+
+void fsLineIndexWorker(void* arg) {
+    // a checkpoint every CTRX_LINEIDX_LINES lines, or at the first line start after CTRX_LINEIDX_BYTES
+    FsLineIndexer* indexer = (FsLineIndexer*) arg;
+    FsFile file;
+    bool linear;
+    u8* buffer = fsBufferAlloc(CTRX_BUFSIZ, &linear);
+    bool opened = (buffer != NULL) && fsFileOpen(&file, indexer->path, "rb");
+    
+    std::vector<FsLineMark> batch;
+    u64 pos = 0;
+    u64 line = 0;
+    u64 lastMark = 0;
+    u64 firstNul = (u64) -1;
+    fsSpeedupBegin();
+    while(opened && (pos < indexer->fileSize) && !indexer->abort) {
+        u32 size = (indexer->fileSize - pos < CTRX_BUFSIZ) ? indexer->fileSize - pos : CTRX_BUFSIZ;
+        size = fsFileRead(&file, pos, buffer, size);
+        if(size == 0) break;
+        
+        u8* end = buffer + size;
+        u8* nul = (firstNul == (u64) -1) ? (u8*) memchr(buffer, '\0', size) : NULL;
+        if(nul != NULL) firstNul = pos + (nul - buffer);
+        for(u8* lf = (u8*) memchr(buffer, '\n', size); lf != NULL; lf = (u8*) memchr(lf + 1, '\n', end - (lf + 1))) {
+            u64 start = pos + (lf - buffer) + 1;
+            line++;
+            if(((line % CTRX_LINEIDX_LINES) == 0) || (start - lastMark >= CTRX_LINEIDX_BYTES)) {
+                batch.push_back({start, line});
+                lastMark = start;
+            }
+        }
+        pos += size;
+        
+        svcWaitSynchronization(indexer->mutex, U64_MAX);
+        indexer->pending.insert(indexer->pending.end(), batch.begin(), batch.end());
+        indexer->scanned = pos;
+        indexer->lineCount = line + 1;
+        indexer->firstNul = firstNul;
+        svcReleaseMutex(indexer->mutex);
+        batch.clear();
+    }
+    
+    fsSpeedupEnd();
+    if(opened) fsFileClose(&file);
+    fsBufferFree(buffer, linear);
+    indexer->complete = opened && (pos >= indexer->fileSize) && !indexer->abort;
+    indexer->done = true;
+}
+
+FsLineIndexer* fsLineIndexOpen(const std::string path, FsLineIndex &index) {
+    FsLineIndexer* indexer = new FsLineIndexer;
+    FsFile file;
+    indexer->path = path;
+    indexer->fileSize = fsGetFileSize(path);
+    indexer->sample = 0;
+    indexer->mtime = 0;
+    indexer->persist = false;
+    indexer->pending.push_back({0, 0});
+    indexer->scanned = 0;
+    indexer->lineCount = (indexer->fileSize > 0) ? 1 : 0;
+    indexer->firstNul = (u64) -1;
+    indexer->delivered = 0;
+    indexer->thread = NULL;
+    indexer->mutex = 0;
+    indexer->abort = false;
+    indexer->done = false;
+    indexer->complete = false;
+    index.marks.clear();
+    index.scanned = 0;
+    index.lineCount = 0;
+    index.firstNul = (u64) -1;
+    index.complete = false;
+    
+    indexer->cachePath = CTRX_CACHEDIR "/" + fsLineIndexName(path);
+    if(fsFileOpen(&file, path, "rb")) {
+        struct stat st;
+        indexer->persist = (file.member == NULL) && (indexer->fileSize >= CTRX_LINEIDX_PERSIST);
+        if(indexer->persist) indexer->sample = fsLineIndexSample(&file, indexer->fileSize);
+        if(indexer->persist && (stat(path.c_str(), &st) == 0)) indexer->mtime = (u64) st.st_mtime;
+        fsFileClose(&file);
+    }
+    if(indexer->persist && fsLineIndexLoad(indexer, index)) {
+        indexer->done = true; // nothing left to do, polls return right away
+        return indexer;
+    }
+    
+    fsSdmcOpenArchive();
+    if(svcCreateMutex(&indexer->mutex, false) == 0) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        indexer->thread = fsWorkerCreate(fsLineIndexWorker, indexer, prio + 1);
+    }
+    if(indexer->thread == NULL) { // no thread, index it all right away
+        if(indexer->mutex == 0) svcCreateMutex(&indexer->mutex, false);
+        fsLineIndexWorker(indexer);
+    }
+    return indexer;
+}
+
+bool fsLineIndexPoll(FsLineIndexer* indexer, FsLineIndex &index) {
+    if(index.complete) return true;
+    bool done = indexer->done;
+    if(indexer->mutex != 0) svcWaitSynchronization(indexer->mutex, U64_MAX);
+    if(indexer->pending.size() > indexer->delivered)
+        index.marks.insert(index.marks.end(), indexer->pending.begin() + indexer->delivered, indexer->pending.end());
+    indexer->delivered = indexer->pending.size();
+    index.scanned = indexer->scanned;
+    index.lineCount = indexer->lineCount;
+    index.firstNul = indexer->firstNul;
+    if(indexer->mutex != 0) svcReleaseMutex(indexer->mutex);
+    
+    if(done && indexer->complete) {
+        index.scanned = indexer->fileSize; // also covers empty files
+        index.complete = true;
+        if(indexer->persist) fsLineIndexSave(indexer);
+    }
+    return index.complete;
+}
+
+void fsLineIndexClose(FsLineIndexer* indexer) {
+    if(indexer == NULL) return;
+    indexer->abort = true;
+    if(indexer->thread != NULL) {
+        threadJoin(indexer->thread, U64_MAX);
+        threadFree(indexer->thread);
+    }
+    if(indexer->mutex != 0) svcCloseHandle(indexer->mutex);
+    delete indexer;
+}
+
+FsLineMark fsLineIndexFindLine(const FsLineIndex &index, u64 line) {
+    // last checkpoint at or before line, binary search
+    if(index.marks.empty()) return {0, 0};
+    std::vector<FsLineMark>::const_iterator it = std::upper_bound(index.marks.begin(), index.marks.end(), line,
+        [](u64 value, const FsLineMark &mark) { return value < mark.line; });
+    return *(it - 1);
+}
+
+FsLineMark fsLineIndexFindOffset(const FsLineIndex &index, u64 offset) {
+    // last checkpoint at or before offset, binary search
+    if(index.marks.empty()) return {0, 0};
+    std::vector<FsLineMark>::const_iterator it = std::upper_bound(index.marks.begin(), index.marks.end(), offset,
+        [](u64 value, const FsLineMark &mark) { return value < mark.offset; });
+    return *(it - 1);
+}
+
+FsLineMark fsLineIndexAdvance(const std::string path, FsLineMark mark, u64 offset) {
+    PROF_SCOPE(PROF_IO);
+    // mark has to be the last checkpoint at or before offset: all line starts in between then lie within
+    // CTRX_LINEIDX_BYTES of it, else the indexer would have put another checkpoint there
+    FsFile file;
+    u8 buffer[CTRX_LINEIDX_SAMPLE];
+    u64 end = (offset - mark.offset > CTRX_LINEIDX_BYTES) ? mark.offset + CTRX_LINEIDX_BYTES : offset;
+    u64 lines = 0;
+    u64 pos = mark.offset;
+    if(!fsFileOpen(&file, path, "rb")) return mark;
+    while(pos < end) {
+        u32 size = (end - pos < sizeof(buffer)) ? end - pos : sizeof(buffer);
+        size = fsFileRead(&file, pos, buffer, size);
+        if(size == 0) break;
+        lines += std::count(buffer, buffer + size, '\n');
+        pos += size;
+    }
+    fsFileClose(&file);
+    if(pos < end) return mark; // unchanged, the caller can tell
+    return {offset, mark.line + lines};
+}
+
+u64 fsLineIndexSeek(const std::string path, const FsLineIndex &index, u64 line) {
+    PROF_SCOPE(PROF_IO);
+    // the checkpoint lookup, then a short read up to the exact line start
+    if((line >= index.lineCount) || (index.marks.empty())) {
+        errno = ENOTSUP;
+        return (u64) -1;
+    }
+    FsLineMark mark = fsLineIndexFindLine(index, line);
+    if(mark.line == line) return mark.offset;
+    
+    FsFile file;
+    u8 buffer[CTRX_LINEIDX_SAMPLE];
+    u64 result = (u64) -1;
+    if(!fsFileOpen(&file, path, "rb")) return result;
+    for(u64 pos = mark.offset; (result == (u64) -1) && (pos < index.scanned);) {
+        u32 size = (index.scanned - pos < sizeof(buffer)) ? index.scanned - pos : sizeof(buffer);
+        size = fsFileRead(&file, pos, buffer, size);
+        if(size == 0) break;
+        for(u8* lf = (u8*) memchr(buffer, '\n', size); lf != NULL; lf = (u8*) memchr(lf + 1, '\n', size - (lf + 1 - buffer))) {
+            if(++mark.line == line) {
+                result = pos + (lf - buffer) + 1;
+                break;
+            }
+        }
+        pos += size;
+    }
+    fsFileClose(&file);
     return result;
 }
 
-std::vector<FileInfoEx> fsGetDirectoryContentsEx(const std::string directory) {
-    std::vector<FileInfoEx> result;
-    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
-    const std::string dirWithSlash = hasSlash ? directory : directory + "/";
+bool fsTransferScan(const std::string path, const std::string dest, u32 item, std::vector<FsTransferEntry> &entries) {
+    // folders come before their contents, so the prepare step can create them in order
+    entries.push_back({path, dest, 0, item, true, -1});
+    
+    std::vector<FileInfoEx> contents;
+    if(!fsListDirectory(path, contents)) return false;
+    
+    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
+        if((*it).isDirectory) {
+            if(!fsTransferScan((*it).path, dest + "/" + (*it).name, item, entries)) return false;
+        } else entries.push_back({(*it).path, dest + "/" + (*it).name, (*it).size, item, false, -1});
+    }
+    return true;
+}
 
-    DIR* dir = opendir(dirWithSlash.c_str());
-    if(dir == NULL) {
-        return result;
+void fsTransferPrepare(const FsTransferEntry* entry, FsTransferState* state) {
+    // the metadata part of a copy: create the folder or open both files,
+    // a file that gets overwritten keeps its data until the copy reaches it
+    state->srcOpened = false;
+    state->dstOpened = false;
+    state->created = false;
+    state->deferred = false;
+    state->error = 0;
+    errno = 0;
+    if(entry->isDirectory) {
+        state->created = (mkdir(entry->dest.c_str(), 0777) == 0);
+        if(!state->created) state->error = (errno != 0) ? errno : EIO;
+    } else {
+        state->srcOpened = fsFileOpen(&state->src, entry->path, "rb");
+        state->dstOpened = state->srcOpened && fsFileOpen(&state->dst, entry->dest, (entry->replaced >= 0) ? "rb+" : "wb");
+        state->created = state->dstOpened && (entry->replaced < 0);
+        if(!state->dstOpened) state->error = (errno != 0) ? errno : EIO;
     }
+}
 
-    while(core::running()) {
-        struct dirent* ent = readdir(dir);
-        if(ent == NULL) {
+void fsTransferSkip(FsTransferState* state) {
+    // the item already failed, leave the card alone
+    state->srcOpened = false;
+    state->dstOpened = false;
+    state->created = false;
+    state->deferred = false;
+    state->error = ECANCELED;
+}
+
+void fsTransferDefer(FsTransferState* state) {
+    // nothing can be prepared before the old target is deleted
+    fsTransferSkip(state);
+    state->deferred = true;
+    state->error = 0;
+}
+
+void fsTransferRelease(FsTransferState* state) {
+    if(state->srcOpened) fsFileClose(&state->src);
+    if(state->dstOpened) fsFileClose(&state->dst);
+    state->srcOpened = false;
+    state->dstOpened = false;
+}
+
+void fsTransferWorker(void* arg) {
+    // runs ahead of the data copy by up to CTRX_XFER_AHEAD entries
+    FsTransfer* xfer = (FsTransfer*) arg;
+    s32 count;
+    for(u32 i = 0; i < xfer->entries->size(); i++) {
+        svcWaitSynchronization(xfer->semAhead, U64_MAX);
+        if(xfer->abort) break;
+        const FsTransferEntry* entry = &(*xfer->entries)[i];
+        if(xfer->itemFailed[entry->item]) fsTransferSkip(&(*xfer->states)[i]);
+        else if(xfer->itemReplace[entry->item]) fsTransferDefer(&(*xfer->states)[i]);
+        else fsTransferPrepare(entry, &(*xfer->states)[i]);
+        xfer->nPrepared = i + 1;
+        svcReleaseSemaphore(&count, xfer->semReady, 1);
+    }
+}
+
+u32 fsTransferRun(const std::vector<FsTransferItem> &items, bool move, bool showProgress, std::function<bool(const FsTransferItem &item, bool hasNext)> onError) {
+    PROF_SCOPE(PROF_IO);
+    // returns the number of items that went through
+    const std::string operationStr = move ? "Moving" : "Copying";
+    u32 successCount = 0;
+    
+    for(std::vector<FsTransferItem>::const_iterator it = items.begin(); it != items.end(); it++) {
+        fsDirCacheInvalidate((*it).dest);
+        if(move) fsDirCacheInvalidate((*it).path);
+    }
+    
+    if(move) { // moves are renames, there is no data to queue up
+        for(u32 i = 0; i < items.size(); i++) {
+            errno = 0;
+            bool ret = false;
+            if(showProgress && !fsShowProgress(operationStr, items[i].path, i, items.size(), false)) errno = ECANCELED;
+            else ret = fsPathMove(items[i].path, items[i].dest, items[i].overwrite);
+            if(ret) successCount++;
+            else if((onError != NULL) && !onError(items[i], i + 1 < items.size())) break;
+        }
+        return successCount;
+    }
+    
+    // scan everything first, for the totals and to get the listings out of the way
+    std::vector<FsTransferEntry> entries;
+    std::vector<int> itemError(items.size(), 0);
+    std::vector<bool> itemMerge(items.size(), false); // overwriting into an existing folder, left to fsPathCopy
+    std::vector<u8> itemReplace(items.size(), 0); // target of another type, deleted when the item comes up
+    u64 totalBytes = 0;
+    u64 maxSize = 0;
+    u32 totalFiles = 0;
+    for(u32 i = 0; i < items.size(); i++) {
+        const FsTransferItem &item = items[i];
+        if(showProgress && !fsShowProgress("Scanning", item.path, i, items.size(), false)) {
+            for(; i < items.size(); i++) itemError[i] = ECANCELED;
             break;
         }
-        const std::string name = std::string(ent->d_name);
-        if((name.compare(".") != 0) && (name.compare("..") != 0)) {
-            const std::string path = dirWithSlash + std::string(ent->d_name);
-            bool isDirectory = (ent->d_type == DT_DIR);
-            result.push_back({path, std::string(ent->d_name), isDirectory});
+        errno = 0;
+        FsStat source = fsStat(item.path);
+        FsStat target = fsStat(item.dest);
+        bool isDirectory = source.isDirectory;
+        s64 replaced = -1;
+        if(!source.exists) itemError[i] = ENOENT;
+        else if(fsArchiveReadOnly(item.dest)) itemError[i] = EROFS;
+        else if(isDirectory && (item.dest.find(item.path + "/") != std::string::npos)) itemError[i] = ENOTSUP;
+        else if(target.exists) {
+            if(!item.overwrite) itemError[i] = EEXIST;
+            else if(item.path.compare(item.dest) == 0) itemError[i] = EACCES;
+            else if(isDirectory && target.isDirectory) itemMerge[i] = true;
+            else if(isDirectory != target.isDirectory) itemReplace[i] = 1;
+            else replaced = (s64) target.size; // nothing is touched before its data gets copied
+        }
+        if(itemMerge[i]) totalBytes += fsPathSize(item.path);
+        if((itemError[i] != 0) || itemMerge[i]) continue;
+        
+        u32 first = entries.size();
+        if(isDirectory) {
+            if(!fsTransferScan(item.path, item.dest, i, entries)) {
+                itemError[i] = (errno != 0) ? errno : EIO;
+                entries.resize(first);
+                continue;
+            }
+        } else entries.push_back({item.path, item.dest, source.size, i, false, replaced});
+        for(u32 e = first; e < entries.size(); e++) {
+            if(entries[e].isDirectory) continue;
+            totalBytes += entries[e].size;
+            if(entries[e].size > maxSize) maxSize = entries[e].size;
+            totalFiles++;
         }
     }
-
-    closedir(dir);
-    std::sort(result.begin(), result.end(), fsAlphabetizeFoldersFiles());
-    return result;
+    
+    // one set of buffers for the whole job
+    FsPipePool pool;
+    if(!fsPipePoolAlloc(&pool, maxSize)) {
+        for(std::vector<FsTransferEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+            if(itemError[(*it).item] == 0) itemError[(*it).item] = ENOMEM;
+        entries.clear();
+    }
+    std::vector<FsTransferState> states(entries.size());
+    std::vector<u8> itemFailed(items.size(), 0);
+    std::vector<u32> leftovers; // created ahead but never copied, removed at the end
+    fsSdmcOpenArchive();
+    
+    // on New 3DS the folders and files are created / opened on another core
+    FsTransfer xfer;
+    xfer.entries = &entries;
+    xfer.states = &states;
+    xfer.itemFailed = itemFailed.empty() ? NULL : &itemFailed[0];
+    xfer.itemReplace = itemReplace.empty() ? NULL : &itemReplace[0];
+    xfer.semAhead = 0;
+    xfer.semReady = 0;
+    xfer.nPrepared = 0;
+    xfer.abort = false;
+    Thread worker = NULL;
+    if((fsGetWorkerCore() >= 0) && (entries.size() > 1) &&
+        (svcCreateSemaphore(&xfer.semAhead, CTRX_XFER_AHEAD, CTRX_XFER_AHEAD + 1) == 0) &&
+        (svcCreateSemaphore(&xfer.semReady, 0, entries.size()) == 0)) {
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        worker = fsWorkerCreate(fsTransferWorker, &xfer, prio - 1);
+    }
+    
+    u32 doneFiles = 0;
+    u32 e = 0;
+    bool aborted = false;
+    if(showProgress) fsProgressBegin(totalBytes * (fsCopyVerify ? 2 : 1)); // verifying reads everything again
+    if(fsCopyVerify) fsCrc32Init();
+    for(u32 i = 0; (i < items.size()) && !aborted; i++) {
+        const FsTransferItem &item = items[i];
+        int error = itemError[i];
+        if((error == 0) && itemMerge[i]) {
+            errno = 0;
+            if(!fsPathCopy(item.path, item.dest, true, showProgress)) error = (errno != 0) ? errno : EIO;
+        } else if((error == 0) && itemReplace[i]) {
+            errno = 0;
+            if(!fsPathDelete(item.dest)) error = (errno != 0) ? errno : EIO;
+        }
+        for(; (e < entries.size()) && (entries[e].item == i); e++) {
+            FsTransferEntry* entry = &entries[e];
+            FsTransferState* state = &states[e];
+            s32 count;
+            if(worker != NULL) svcWaitSynchronization(xfer.semReady, U64_MAX);
+            if((worker == NULL) || state->deferred) {
+                if(error != 0) fsTransferSkip(state);
+                else fsTransferPrepare(entry, state);
+            }
+            
+            if((error == 0) && (state->error != 0)) error = state->error;
+            bool skipped = (error != 0);
+            if(!skipped && !entry->isDirectory) {
+                std::stringstream labelStream;
+                labelStream << "(" << (doneFiles + 1) << "/" << totalFiles << ") " << entry->path;
+                const std::string label = labelStream.str();
+                std::function<bool(u64 pos)> onProgress = [&](u64 pos) {
+                    return !showProgress || fsShowProgress(operationStr, label, pos, entry->size);
+                };
+                errno = 0;
+                bool ret = true;
+                u32 crc32 = 0;
+                if(entry->replaced >= 0) { // the old data goes only now
+                    fsDirSizeAdjust(entry->dest, -entry->replaced, -1, 0);
+                    ret = fsFileSetSize(&state->dst, entry->size);
+                }
+                if(ret && (entry->size <= pool.slotSize)) { // small file, no threads needed
+                    u8* buffer = pool.slots[0].data;
+                    u32 size = (u32) entry->size;
+                    ret = (fsFileRead(&state->src, 0, buffer, size) == size) &&
+                        (fsFileWrite(&state->dst, 0, buffer, size) == size);
+                    if(ret && fsCopyVerify) crc32 = fsCrc32Update(crc32, buffer, size);
+                    if(ret && !onProgress(entry->size)) {
+                        errno = ECANCELED;
+                        ret = false;
+                    }
+                } else if(ret) ret = fsPipeRun(entry->size,
+                    [&](u8* buffer, u64 pos, u32 size) { // reader thread
+                        return fsFileRead(&state->src, pos, buffer, size) == size;
+                    },
+                    [&](u8* buffer, u64 pos, u32 size) { // writer thread
+                        if(fsCopyVerify) crc32 = fsCrc32Update(crc32, buffer, size);
+                        return fsFileWrite(&state->dst, pos, buffer, size) == size;
+                    },
+                    onProgress, &pool);
+                fsProgressAdvance(entry->size);
+                if(ret && fsCopyVerify) {
+                    fsTransferRelease(state); // the copy has to be complete on the card
+                    ret = fsCopyCheck(entry->dest, entry->size, crc32, label, showProgress, &pool);
+                }
+                if(!ret) error = (errno != 0) ? errno : EIO;
+                doneFiles++;
+            }
+            
+            fsTransferRelease(state);
+            if(skipped && state->created) leftovers.push_back(e);
+            if(error != 0) itemFailed[i] = 1;
+            if(worker != NULL) svcReleaseSemaphore(&count, xfer.semAhead, 1);
+            if(error == 0) fsDirSizeAdjust(entry->dest, entry->isDirectory ? 0 : (s64) entry->size, entry->isDirectory ? 0 : 1, entry->isDirectory ? 1 : 0);
+            else fsDirSizeInvalidate(entry->dest);
+        }
+        
+        if(error == 0) successCount++;
+        else {
+            errno = error;
+            if((onError == NULL) || !onError(item, i + 1 < items.size())) aborted = true;
+        }
+    }
+    
+    if(worker != NULL) {
+        s32 count;
+        xfer.abort = true;
+        svcReleaseSemaphore(&count, xfer.semAhead, 1);
+        threadJoin(worker, U64_MAX);
+        threadFree(worker);
+        for(; e < xfer.nPrepared; e++) {
+            fsTransferRelease(&states[e]);
+            if(states[e].created) leftovers.push_back(e);
+        }
+    }
+    for(std::vector<u32>::reverse_iterator it = leftovers.rbegin(); it != leftovers.rend(); it++) { // contents before their folders
+        const FsTransferEntry &entry = entries[*it];
+        if(entry.isDirectory) rmdir(entry.dest.c_str());
+        else remove(entry.dest.c_str());
+        fsDirSizeInvalidate(entry.dest);
+    }
+    if(xfer.semAhead != 0) svcCloseHandle(xfer.semAhead);
+    if(xfer.semReady != 0) svcCloseHandle(xfer.semReady);
+    fsPipePoolFree(&pool);
+    if(showProgress) fsProgressEnd();
+    
+    return successCount;
 }
@@ -16,28 +16,165 @@ typedef struct {
     std::string path;
     std::string name;
     bool isDirectory;
+    u64 size;
 } FileInfoEx;
 
+struct FsDirStream;
+struct FsDirSizer;
+struct FsLineIndexer;
+struct FsPatch;
+
+typedef struct {
+    u64 offset;
+    u64 line;
+} FsLineMark;
+
+typedef struct {
+    std::vector<FsLineMark> marks; // sorted, the first one is always {0, 0}
+    u64 scanned; // bytes covered by marks
+    u64 lineCount; // lines starting within scanned
+    u64 firstNul; // offset of the first '\0' within scanned, (u64) -1 if none
+    bool complete;
+} FsLineIndex;
+
+typedef struct {
+    bool exists;
+    bool isDirectory;
+    u64 size; // 0 for folders
+} FsStat;
+
+typedef struct {
+    u64 size; // everything below a folder
+    u32 files;
+    u32 folders;
+} FsDirSize;
+
+typedef struct {
+    std::string path;
+    std::string dest;
+    bool overwrite;
+} FsTransferItem;
+
+typedef struct {
+    u64 offset;
+    u64 length;
+} FsDiffRange;
+
+typedef struct {
+    std::string path; // selected in the browser
+    std::string hexPath; // last file in the hex viewer
+    u64 hexOffset;
+    u64 hexStoredOffset;
+} FsSession;
+
+typedef struct {
+    u32 bufferCount;
+    u32 bufferSize;
+} FsPipeConfig;
+
+typedef enum {
+    FS_BACKEND_STDIO,
+    FS_BACKEND_FSUSER
+} FsBackend;
+
+typedef enum {
+    FS_HASH_CRC32 = (1 << 0),
+    FS_HASH_MD5 = (1 << 1),
+    FS_HASH_SHA256 = (1 << 2)
+} FsHashType;
+
+typedef struct {
+    u32 types; // FsHashType bits that were computed
+    u32 crc32;
+    u8 md5[16];
+    u8 sha256[32];
+} FsHash;
+
+void fsSetPipeConfig(u32 bufferCount, u32 bufferSize);
+FsPipeConfig fsGetPipeConfig();
+void fsSetBackend(FsBackend backend);
+FsBackend fsGetBackend();
+void fsSetResizeJournal(bool enable);
+bool fsGetResizeJournal();
+void fsSetCopyVerify(bool enable);
+bool fsGetCopyVerify();
+void fsSetSpeedup(bool always);
+bool fsGetSpeedup();
+bool fsHasSpeedup();
+void fsSpeedupBegin();
+void fsSpeedupEnd();
+void fsInit();
+void fsCleanup();
+
 u64 fsGetFreeSpace();
+void fsFreeSpaceRefresh();
+bool fsFreeSpacePoll(u64 &freeSpace);
+FsStat fsStat(const std::string path);
+void fsStatRefresh(const std::string path);
+bool fsStatPoll(std::string &path, FsStat &stat);
 bool fsExists(const std::string path);
 bool fsIsDirectory(const std::string path);
+bool fsIsArchive(const std::string path);
 std::string fsGetFileName(const std::string path);
 std::string fsGetExtension(const std::string path);
 bool fsHasExtension(const std::string path, const std::string extension);
 bool fsHasExtensions(const std::string path, const std::vector<std::string> extensions);
-u32 fsGetFileSize(const std::string path);
-bool fsFileResize(const std::string path, u32 offset, u32 oldsize, u32 newsize, bool showProgress = false);
-u32 fsDataSearch(const std::string path, const std::vector<u8> searchTerm, u32 offset = 0, bool showProgress = false);
-std::vector<u8> fsDataGet(const std::string path, u32 offset, u32 size);
-bool fsDataReplace(const std::string path, const std::vector<u8> data, u32 offset, u32 size);
-bool fsDataProvider(const std::string path, u32 offset, u32 buffSize, std::function<bool(u32 &offset, bool &forceRefresh)> onLoop, std::function<bool(u8* data)> onUpdate);
+u64 fsGetFileSize(const std::string path);
+u64 fsPathSize(const std::string path);
+bool fsFileResize(const std::string path, u64 offset, u64 oldsize, u64 newsize, bool showProgress = false);
+bool fsFileResizePending(const std::string path);
+bool fsFileResizeResume(const std::string path, bool showProgress = false);
+u64 fsDataSearch(const std::string path, const std::vector<u8> searchTerm, u64 offset = 0, bool showProgress = false, bool reverse = false, FsPatch* patch = NULL);
+std::vector<u64> fsDataSearchAll(const std::string path, const std::vector<u8> searchTerm, u32 maxResults = 0x40000, bool showProgress = false, FsPatch* patch = NULL);
+bool fsDataCompare(const std::string path, const std::string pathOther, std::vector<FsDiffRange> &ranges, u32 maxRanges = 0x10000, bool showProgress = false);
+FsLineIndexer* fsLineIndexOpen(const std::string path, FsLineIndex &index);
+bool fsLineIndexPoll(FsLineIndexer* indexer, FsLineIndex &index);
+void fsLineIndexClose(FsLineIndexer* indexer);
+FsLineMark fsLineIndexFindLine(const FsLineIndex &index, u64 line);
+FsLineMark fsLineIndexFindOffset(const FsLineIndex &index, u64 offset);
+FsLineMark fsLineIndexAdvance(const std::string path, FsLineMark mark, u64 offset);
+u64 fsLineIndexSeek(const std::string path, const FsLineIndex &index, u64 line);
+void fsLineIndexForget(const std::string path);
+std::vector<u8> fsDataGet(const std::string path, u64 offset, u32 size);
+bool fsFileStream(const std::string path, std::function<bool(const u8* data, u64 pos, u32 size)> onData, bool showProgress = false);
+bool fsFileHash(const std::string path, u32 types, FsHash* hash, bool showProgress = false);
+void fsCrc32Init();
+u32 fsCrc32Update(u32 crc, const u8* data, u32 size);
+bool fsDataReplace(const std::string path, const std::vector<u8> data, u64 offset, u64 size);
+bool fsDataProvider(const std::string path, u64 offset, u32 buffSize, std::function<bool(u64 &offset, bool &forceRefresh)> onLoop, std::function<bool(u8* data)> onUpdate, u32 prefetchSize = 0, FsPatch* patch = NULL);
+FsPatch* fsPatchOpen(const std::string path);
+void fsPatchClose(FsPatch* patch);
+u64 fsPatchSize(FsPatch* patch);
+u32 fsPatchRevision(FsPatch* patch);
+u32 fsPatchEdits(FsPatch* patch);
+bool fsPatchReplace(FsPatch* patch, u64 offset, u64 size, const std::vector<u8> &data);
+bool fsPatchUndo(FsPatch* patch);
+std::vector<u8> fsPatchGet(FsPatch* patch, u64 offset, u32 size);
+bool fsPatchCommit(FsPatch* patch, bool showProgress = false);
 bool fsPathDelete(const std::string path);
 bool fsPathCopy(const std::string path, const std::string dest, bool overwrite = false, bool showProgress = false);
 bool fsPathMove(const std::string path, const std::string dest, bool overwrite = false);
 bool fsPathRename(const std::string path, const std::string dest);
+u32 fsTransferRun(const std::vector<FsTransferItem> &items, bool move, bool showProgress, std::function<bool(const FsTransferItem &item, bool hasNext)> onError);
 bool fsCreateDir(const std::string path);
 bool fsCreateDummyFile(const std::string path, u64 size = 0, u16 content = 0x0000, bool overwrite = false, bool showProgress = false);
 std::vector<FileInfo> fsGetDirectoryContents(const std::string directory);
 std::vector<FileInfoEx> fsGetDirectoryContentsEx(const std::string directory);
+FsDirStream* fsDirStreamOpen(const std::string directory);
+bool fsDirStreamPoll(FsDirStream* stream, std::vector<FileInfoEx> &batch);
+void fsDirStreamClose(FsDirStream* stream);
+void fsDirCacheInvalidate(const std::string path);
+void fsDirCacheClear();
+bool fsDirCacheUnverified(const std::string directory);
+bool fsSettingsSave();
+bool fsSettingsLoad();
+bool fsSessionSave(const FsSession &session);
+bool fsSessionLoad(FsSession &session);
+FsDirSizer* fsDirSizeOpen(const std::string directory);
+bool fsDirSizePoll(FsDirSizer* sizer);
+void fsDirSizeClose(FsDirSizer* sizer);
+bool fsDirSizeGet(const std::string path, FsDirSize &size);
+void fsDirSizeAdjust(const std::string path, s64 bytes, s32 files, s32 folders);
+void fsDirSizeInvalidate(const std::string path);
 
 #endif
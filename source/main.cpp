@@ -1,4 +1,6 @@
+#include "bench.hpp"
 #include "fs.hpp"
+#include "prof.hpp"
 #include "ui.hpp"
 
 #include <citrus/core.hpp>
@@ -6,6 +8,8 @@
 #include <citrus/gput.hpp>
 #include <citrus/hid.hpp>
 
+#include <algorithm>
+#include <array>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -15,7 +19,8 @@ using namespace ctr;
 typedef enum {
     M_BROWSER,
     M_HEXVIEWER,
-    M_TEXTVIEWER
+    M_TEXTVIEWER,
+    M_BENCHMARK
 } Mode;
 
 typedef enum  {
@@ -24,16 +29,22 @@ typedef enum  {
     A_COPY,
     A_MOVE,
     A_CREATE_DIR,
-    A_CREATE_DUMMY
+    A_CREATE_DUMMY,
+    A_HASH
 } Action;
 
 int main(int argc, char **argv) {
     if(!core::init(argc)) {
         return 0;
     }
+    fsInit();
+    fsSettingsLoad();
     
     const std::string title = "CTRX SD Explorer v0.9.7";
     const u64 tapDelay = 240;
+    const u32 hvSearchMax = 0x10000;
+    const u32 hvDiffMax = 0x10000;
+    const u64 dummySizeMax = 0xFFFFFFFF; // FAT32 file size limit
 
     bool launcher = core::launcher();
     bool exit = false;
@@ -43,30 +54,51 @@ int main(int argc, char **argv) {
     u64 inputRHoldTime = 0;
     u64 inputXHoldTime = 0;
     u64 inputYHoldTime = 0;
+    u64 inputSelectHoldTime = 0;
     
     std::string currentDir = "";
     SelectableElement currentFile = { "", "" };
-    std::set<SelectableElement*>* markedElements = NULL;
+    UiMarks* markedElements = NULL;
     std::vector<SelectableElement> clipboard;
-    u64 freeSpace = fsGetFreeSpace();
+    u64 freeSpace = (u64) -1; // unknown until the first refresh comes in
+    fsFreeSpaceRefresh();
     
-    u32 dummySize = (u32) -1;
+    // the last session puts the browser back where it was, the listings it kept show up right away
+    FsSession session = { "", "", 0, (u64) -1 };
+    if(fsSessionLoad(session)) currentFile.id = session.path;
+    
+    u64 dummySize = (u64) -1;
     int dummyContent = 0x00;
     
     bool hvSelectMode = false;
-    u32 hvStoredOffset = (u32) -1;
-    u32 hvLastFoundOffset = (u32) -1;
+    u64 hvStoredOffset = (u64) -1;
+    u64 hvLastFoundOffset = (u64) -1;
+    u32 hvHexDigits = 8;
     std::string hvLastSearchStr = "?";
     std::vector<u8> hvLastSearchHex(1, 0);
     std::vector<u8> hvLastSearch(1, 0);
+    std::vector<u64> hvSearchResults;
+    u32 hvSearchIndex = 0;
     std::vector<u8> hvClipboard;
+    FsPatch* hvPatch = NULL;
+    std::string hvDiffPath; // the file the viewed one is compared against, empty if not comparing
+    std::vector<FsDiffRange> hvDiffRanges;
+    u32 hvDiffIndex = 0;
+    bool hvDiffJump = false; // go to the current range on the next loop
+    
+    // everything the top screen shows, it is only rebuilt and drawn after one of these changed
+    std::array<u64, 20> topKey = {};
+    std::string topDir;
+    SelectableElement topFile = { "", "" };
+    std::string topInstructions;
+    u32 topRedrawFrames = 0;
     
     auto processAction = [&](Action action, bool &updateList, bool &resetCursor) {
         const std::string alphabet = " ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz(){}[]'`^,~!@#$%&0123456789=+-_.";
 
         switch(action) {
             case A_DELETE: {
-                if((*markedElements).empty()) {
+                if((*markedElements).count == 0) {
                     if(currentFile.name.compare("..") != 0) {
                         std::string confirmMsg = "Delete \"" + uiTruncateString(currentFile.name, 24, -8) + "\"?" + "\n";
                         if(uiPrompt(gpu::SCREEN_TOP, confirmMsg, true)) {
@@ -75,33 +107,32 @@ int main(int argc, char **argv) {
                                 uiErrorPrompt(gpu::SCREEN_TOP, "Deleting", currentFile.name, true, false);
                             }
                         }
-                        freeSpace = fsGetFreeSpace();
+                        fsFreeSpaceRefresh();
                         updateList = true;
                         resetCursor = false;
                     }
                 } else {
                     u32 successCount = 0;
+                    std::vector<SelectableElement> marked = uiMarkedElements(*markedElements);
                     std::stringstream object;
-                    if((*markedElements).size() == 1) {
-                        object << "\"" << uiTruncateString((**((*markedElements).begin())).name, 24, -8) << "\"";
-                    } else object << (*markedElements).size() << " paths";
+                    if(marked.size() == 1) {
+                        object << "\"" << uiTruncateString(marked.front().name, 24, -8) << "\"";
+                    } else object << marked.size() << " paths";
                     std::string confirmMsg = "Delete " + object.str() + "?" + "\n";
                     if(uiPrompt(gpu::SCREEN_TOP, confirmMsg, true)) {                        
-                        for(std::set<SelectableElement*>::iterator it = (*markedElements).begin(); it != (*markedElements).end(); it++) {
-                            if(!fsPathDelete((**it).id)) {
-                                std::set<SelectableElement*>::iterator next = it;
-                                next++;
+                        for(std::vector<SelectableElement>::iterator it = marked.begin(); it != marked.end(); it++) {
+                            if(!fsPathDelete((*it).id)) {
                                 if (errno == ENOENT) errno = EACCES; // errno fix for write protected files
-                                if (!uiErrorPrompt(gpu::SCREEN_TOP, "Deleting", (**it).name, true, next != (*markedElements).end())) break;
+                                if (!uiErrorPrompt(gpu::SCREEN_TOP, "Deleting", (*it).name, true, it + 1 != marked.end())) break;
                             } else successCount++;
                         }
-                        if((successCount < (*markedElements).size()) && ((*markedElements).size() > 1)) {
+                        if((successCount < marked.size()) && (marked.size() > 1)) {
                             std::stringstream errorMsg;
-                            errorMsg << "Deleted" << successCount << " of " << (*markedElements).size() << " paths!" << "\n";
+                            errorMsg << "Deleted" << successCount << " of " << marked.size() << " paths!" << "\n";
                             uiPrompt(gpu::SCREEN_TOP, errorMsg.str(), false);
                         }
-                        freeSpace = fsGetFreeSpace();
-                        (*markedElements).clear();
+                        fsFreeSpaceRefresh();
+                        uiMarksClear(*markedElements);
                         updateList = true;
                         resetCursor = false;
                     }
@@ -137,9 +168,9 @@ int main(int argc, char **argv) {
                         bool overwrite = false;
                         bool overwrite_remember = false;
                         bool overwrite_remember_ask = (clipboard.size() > 1);
+                        std::vector<FsTransferItem> queue;
                         for(std::vector<SelectableElement>::iterator it = clipboard.begin(); it != clipboard.end(); it++) {
                             const std::string dest = (currentDir.compare("/") == 0) ? "/" + (*it).name : currentDir + "/" + (*it).name;
-                            bool fail = false;
                             if(fsExists(dest)) {
                                 if(!overwrite_remember) {
                                     std::string existMsg = "Destination exists: " + uiTruncateString((*it).name, 28, -8) + "\n" + "Overwrite existing file(s)?" + "\n";
@@ -152,22 +183,20 @@ int main(int argc, char **argv) {
                                 }
                                 if(!overwrite) continue;
                             }
-                            fail = (action == A_COPY) ?
-                                !fsPathCopy((*it).id, dest, overwrite, true) :
-                                !fsPathMove((*it).id, dest, overwrite);
-                            if(fail) {
-                                std::string operationStr = (action == A_COPY) ? "Copying" : "Moving";
-                                if(!uiErrorPrompt(gpu::SCREEN_TOP, operationStr, (*it).name, true, it + 1 != clipboard.end())) 
-                                    break;
-                            } else successCount++;
+                            queue.push_back({(*it).id, dest, overwrite});
                         }
+                        successCount = fsTransferRun(queue, action == A_MOVE, true,
+                            [&](const FsTransferItem &item, bool hasNext) {
+                                std::string operationStr = (action == A_COPY) ? "Copying" : "Moving";
+                                return uiErrorPrompt(gpu::SCREEN_TOP, operationStr, fsGetFileName(item.path), true, hasNext);
+                            });
                         if((successCount < clipboard.size()) && (clipboard.size() > 1)) {
                             std::stringstream errorMsg;
                             errorMsg << ((action == A_COPY) ? "Copied " : "Moved ");
                             errorMsg << successCount << " of " << clipboard.size() << " paths!" << "\n";
                             uiPrompt(gpu::SCREEN_TOP, errorMsg.str(), false);
                         }
-                        freeSpace = fsGetFreeSpace();
+                        fsFreeSpaceRefresh();
                         if(action == A_MOVE) clipboard.clear();
                         updateList = true;
                         resetCursor = false;
@@ -204,13 +233,41 @@ int main(int argc, char **argv) {
                     if(!fsCreateDummyFile(currentDir + "/" + name, dummySize, dummyContent, overwrite, true)) {
                         uiErrorPrompt(gpu::SCREEN_TOP, "Generating", name, true, false);
                     } 
-                    freeSpace = fsGetFreeSpace();
+                    fsFreeSpaceRefresh();
                     updateList = true;
                     resetCursor = false;
                 }
                 break;
             }
                 
+            case A_HASH: {
+                if(currentFile.name.compare("..") == 0) break;
+                FsHash hash;
+                u64 start = core::time();
+                if(fsIsDirectory(currentFile.id)) {
+                    errno = EISDIR;
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Hashing", currentFile.name, true, false);
+                } else if(!fsFileHash(currentFile.id, FS_HASH_CRC32 | FS_HASH_MD5 | FS_HASH_SHA256, &hash, true)) {
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Hashing", currentFile.name, true, false);
+                } else {
+                    u64 millis = core::time() - start;
+                    u64 size = fsGetFileSize(currentFile.id);
+                    std::stringstream hashMsg;
+                    hashMsg << "\"" << uiTruncateString(currentFile.name, 28, -8) << "\"" << "\n" << "\n";
+                    hashMsg << std::hex << std::uppercase << std::setfill('0');
+                    hashMsg << "CRC32    " << std::setw(8) << hash.crc32 << "\n";
+                    hashMsg << "MD5      ";
+                    for(u32 i = 0; i < 16; i++) hashMsg << std::setw(2) << (u32) hash.md5[i];
+                    hashMsg << "\n" << "SHA-256  ";
+                    for(u32 i = 0; i < 32; i++) hashMsg << ((i == 16) ? "\n         " : "") << std::setw(2) << (u32) hash.sha256[i];
+                    hashMsg << std::dec << "\n" << "\n";
+                    hashMsg << uiFormatBytes(size) << " in " << (millis / 1000) << "." << std::setw(2) << ((millis % 1000) / 10) << "s";
+                    hashMsg << " (" << uiFormatBytes((size * 1000) / ((millis > 0) ? millis : 1)) << "/s)" << "\n";
+                    uiPrompt(gpu::SCREEN_TOP, hashMsg.str(), false);
+                }
+                break;
+            }
+                
             default:
                 break;                
         }
@@ -218,8 +275,9 @@ int main(int argc, char **argv) {
     
     auto instructionBlockBrowser = [&]() {
         std::stringstream stream;
-        stream << "L - MARK files (use with " << (char) 0x018 << (char) 0x19 << (char) 0x1A << (char) 0x1B << ")" << "\n";
-        if(dummySize == (u32) -1) stream << "R - [t] CREATE folder / [h] file" << "\n";
+        if((*markedElements).count == 0) stream << "L - MARK files (use with " << (char) 0x018 << (char) 0x19 << (char) 0x1A << (char) 0x1B << ")" << "\n";
+        else stream << "L - MARK files (" << (*markedElements).count << " marked, " << uiFormatBytes((*markedElements).bytes) << ")" << "\n";
+        if(dummySize == (u64) -1) stream << "R - [t] CREATE folder / [h] file" << "\n";
         else {
             stream << "R - [r] GENERATE " << ((dummySize == 0) ? "zero byte" : uiFormatBytes(dummySize)) << " dummy file";
             if(dummySize > 0) {
@@ -229,10 +287,15 @@ int main(int argc, char **argv) {
             stream << "\n";
         }
         stream << "X - [t] DELETE / [h] RENAME selected" << "\n";
-        if(clipboard.empty()) stream << "Y - COPY/MOVE selected " <<  (((*markedElements).size() > 1) ? "files" : "file") << "\n";
+        if(clipboard.empty()) stream << "Y - COPY/MOVE selected " <<  (((*markedElements).count > 1) ? "files" : "file") << "\n";
         else stream << "Y - [t] COPY / [h] MOVE to this folder" << "\n";
-        stream << "A - VIEW file in [t] hex / [h] text" << "\n";
-        if(clipboard.size()) stream << "SELECT - Clear Clipboard" << "\n";
+        if(fsHasExtension(currentFile.name, "zip")) stream << "A - OPEN archive, or VIEW if it is none" << "\n";
+        else stream << "A - VIEW file in [t] hex / [h] text" << "\n";
+        if(clipboard.size()) stream << "SELECT - [t] Clear Clipboard / [h] Benchmark" << "\n";
+        else stream << "SELECT - [t] Checksums / [h] Benchmark" << "\n";
+        stream << "L+Y - Verify copies: " << (fsGetCopyVerify() ? "on" : "off") << "\n";
+        stream << "L+X - Resize journal: " << (fsGetResizeJournal() ? "on" : "off") << "\n";
+        if(fsHasSpeedup()) stream << "L+SELECT - N3DS speedup: " << (fsGetSpeedup() ? "always" : "auto") << "\n";
         
         return stream.str();
     };
@@ -241,14 +304,29 @@ int main(int argc, char **argv) {
         std::stringstream stream;
         stream << std::setfill('0');
         stream << "L - [h] (" << (char) 0x18 << (char) 0x19 << (char) 0x1A << (char) 0x1B << ") fast scroll" << "\n";
-        if(hvStoredOffset != (u32) -1) {
+        if(hvStoredOffset != (u64) -1) {
             stream << "R - GO TO begin / " << std::hex << std::uppercase << std::setw(8) << hvStoredOffset <<
              std::nouppercase << " / end" << "\n";
         } else stream << "R - GO TO begin / end" << "\n";
         stream << "X - GO TO ... ([t] hex / [h] dec)" << "\n";
-        if (hvLastFoundOffset == (u32) -1) stream << "Y - SEARCH ... ([t] hex / [h] string)" << "\n";
-        else stream << "Y - SEARCH [t] next / [h] new" << "\n";
+        if(!hvDiffPath.empty()) {
+            stream << "Y - DIFF [t] next / [h] end compare" << "\n";
+            stream << "L+Y - DIFF previous" << std::dec << " (" << hvDiffIndex + 1 << "/" << hvDiffRanges.size();
+            stream << ((hvDiffRanges.size() >= hvDiffMax) ? "+)" : ")") << "\n";
+            stream << "  vs \"" << uiTruncateString(fsGetFileName(hvDiffPath), 26, -8) << "\"" << "\n";
+        } else if (hvLastFoundOffset == (u64) -1) stream << "Y - SEARCH ... ([t] hex / [h] string)" << "\n";
+        else {
+            stream << "Y - SEARCH [t] next / [h] new" << "\n";
+            stream << "L+Y - SEARCH previous";
+            if(!hvSearchResults.empty()) {
+                stream << std::dec << " (" << hvSearchIndex + 1 << "/" << hvSearchResults.size();
+                stream << ((hvSearchResults.size() >= hvSearchMax) ? "+)" : ")");
+            }
+            stream << "\n";
+        }
         stream << "A - Enter EDIT mode" << "\n";
+        if((hvPatch != NULL) && fsPatchEdits(hvPatch))
+            stream << "SELECT - Undo last edit" << std::dec << " (" << fsPatchEdits(hvPatch) << " unsaved)" << "\n";
         
         return stream.str();
     };
@@ -271,11 +349,41 @@ int main(int argc, char **argv) {
         std::stringstream stream;
         stream << "L/R - PAGE up / PAGE down" << "\n";
         stream << "X - Enable / disable wordwrap" << "\n";
+        stream << "Y - Go to line" << "\n";
+        stream << "SELECT - Go to percentage" << "\n";
         
         return stream.str();
     };
     
     auto onLoopDisplay = [&]() {
+        // free space and file stats come in from the background, the details show the size last
+        fsFreeSpacePoll(freeSpace);
+        std::string statPath;
+        FsStat stat;
+        while(fsStatPoll(statPath, stat)) {
+            if((statPath == currentFile.id) && stat.exists && !stat.isDirectory && !currentFile.details.empty())
+                currentFile.details.back() = uiFormatBytes(stat.size);
+        }
+        bool browsing = (mode == M_BROWSER) && (markedElements != NULL); // the marks only exist inside the browser
+        std::array<u64, 20> key = {{ (u64) mode, (u64) hvSelectMode, dummySize, (u64) dummyContent, clipboard.size(),
+            browsing ? (*markedElements).count : 0, browsing ? (*markedElements).bytes : 0, (u64) fsGetSpeedup(), (u64) fsGetCopyVerify(), hvStoredOffset, hvLastFoundOffset,
+            hvSearchIndex, hvSearchResults.size(), hvDiffIndex, hvDiffRanges.size(), (hvPatch != NULL) ? fsPatchEdits(hvPatch) : 0, hvClipboard.size(),
+            freeSpace, uiScreenGeneration(), PROF_GENERATION() }};
+        if((key != topKey) || (currentDir != topDir) || (currentFile.id != topFile.id) || (currentFile.details != topFile.details)) {
+            topKey = key;
+            topDir = currentDir;
+            topFile = currentFile;
+            topInstructions = title + "\n";
+            if(mode == M_BROWSER) topInstructions += instructionBlockBrowser();
+            else if(mode == M_HEXVIEWER) topInstructions += (hvSelectMode) ? instructionBlockHexEditor() : instructionBlockHexViewer();
+            else if(mode == M_TEXTVIEWER) topInstructions += instructionBlockTextViewer();
+            if(launcher) topInstructions += "START - Exit to launcher\n";
+            topRedrawFrames = 2; // one for each buffer
+        }
+        if(topRedrawFrames == 0) return;
+        topRedrawFrames--;
+        
+        PROF_SCOPE(PROF_DRAW);
         gpu::setViewport(gpu::SCREEN_TOP, 0, 0, gpu::TOP_WIDTH, gpu::TOP_HEIGHT);
         gput::setOrtho(0, gpu::TOP_WIDTH, 0, gpu::TOP_HEIGHT, -1, 1);        
         gpu::clear();
@@ -296,7 +404,7 @@ int main(int argc, char **argv) {
         uiDrawRectangle(0, (screenHeight - 1) - 12, screenWidth, 12);
         str = uiTruncateString(currentDir, 36, 0); // current directory
         gput::drawString(str, 0, (screenHeight - 1) - 10, 8, 8, 0x00, 0x00, 0x00);
-        str = uiFormatBytes(freeSpace) + " free"; // free space
+        str = ((freeSpace != (u64) -1) ? uiFormatBytes(freeSpace) : "?") + " free"; // free space
         gput::drawString(str, (screenWidth - 1) - gput::getStringWidth(str, 8), (screenHeight - 1) - 10, 8, 8, 0x00, 0x00, 0x00);
         
         // CURRENT FILE DETAILS
@@ -335,13 +443,9 @@ int main(int argc, char **argv) {
         }
         
         // INSTRUCTIONS BLOCK
-        str = title + "\n";
-        if(mode == M_BROWSER) str += instructionBlockBrowser();
-        else if(mode == M_HEXVIEWER) str += (hvSelectMode) ? instructionBlockHexEditor() : instructionBlockHexViewer();
-        else if(mode == M_TEXTVIEWER) str += instructionBlockTextViewer();
-        if(launcher) str += "START - Exit to launcher\n";
-        gput::drawString(str, (screenWidth - 320) / 2, 4, 8, 8);
+        gput::drawString(topInstructions, (screenWidth - 320) / 2, 4, 8, 8);
         
+        PROF_OVERLAY();
         gpu::flushCommands();
         gpu::flushBuffer();
         
@@ -359,9 +463,44 @@ int main(int argc, char **argv) {
             return true;
         }
         
-        // SELECT - CLEAR CLIPBOARD
-        if(hid::pressed(hid::BUTTON_SELECT)) {
-            clipboard.clear();
+        // L+SELECT - TOGGLE NEW 3DS SPEEDUP
+        if(hid::held(hid::BUTTON_L) && hid::pressed(hid::BUTTON_SELECT)) {
+            if(fsHasSpeedup()) {
+                fsSetSpeedup(!fsGetSpeedup());
+                fsSettingsSave();
+            }
+            inputSelectHoldTime = (u64) -1;
+        }
+        
+        // L+Y - TOGGLE VERIFY AFTER COPY
+        if(hid::held(hid::BUTTON_L) && hid::pressed(hid::BUTTON_Y)) {
+            fsSetCopyVerify(!fsGetCopyVerify());
+            fsSettingsSave();
+            inputYHoldTime = (u64) -1;
+        }
+        
+        // L+X - TOGGLE JOURNAL FOR RESIZES
+        if(hid::held(hid::BUTTON_L) && hid::pressed(hid::BUTTON_X)) {
+            fsSetResizeJournal(!fsGetResizeJournal());
+            fsSettingsSave();
+            inputXHoldTime = (u64) -1;
+        }
+        
+        // SELECT - (TAP) CLEAR CLIPBOARD OR CHECKSUMS / (HOLD) RUN BENCHMARK
+        if(hid::held(hid::BUTTON_SELECT) && (inputSelectHoldTime != (u64) -1)) {
+            if(inputSelectHoldTime == 0) inputSelectHoldTime = core::time();
+            else if(core::time() - inputSelectHoldTime >= tapDelay) {
+                inputSelectHoldTime = 0;
+                mode = M_BENCHMARK;
+                return true;
+            }
+        }
+        if(hid::released(hid::BUTTON_SELECT) && (inputSelectHoldTime != 0)) {
+            if(inputSelectHoldTime != (u64) -1) {
+                if(clipboard.empty()) processAction(A_HASH, updateList, resetCursor);
+                else clipboard.clear();
+            }
+            inputSelectHoldTime = 0;
         }
         
         // R - (TAP) CREATE DIRECTORY / (HOLD) GENERATE DUMMY FILE
@@ -383,11 +522,11 @@ int main(int argc, char **argv) {
                                 dummyContent++;
                                 if(dummyContent > 0x100) dummyContent = 0x00;
                             }
-                            if(hid::held(hid::BUTTON_RIGHT) && (dummySize < 1 << 30)) {
-                                dummySize = (dummySize == 0) ? 1 : dummySize << 1;
+                            if(hid::held(hid::BUTTON_RIGHT) && (dummySize < dummySizeMax)) {
+                                dummySize = (dummySize == 0) ? 1 : (dummySize << 1 > dummySizeMax) ? dummySizeMax : dummySize << 1;
                             }
                             if(hid::held(hid::BUTTON_LEFT) && (dummySize > 0)) {
-                                dummySize = (dummySize == 1) ? 0 : dummySize >> 1;
+                                dummySize = (dummySize == 1) ? 0 : (dummySize == dummySizeMax) ? (dummySizeMax + 1) >> 1 : dummySize >> 1;
                             }
                             lastChangeTime = core::time();
                         }
@@ -398,7 +537,7 @@ int main(int argc, char **argv) {
                 }
                 processAction(A_CREATE_DUMMY, updateList, resetCursor);
                 inputRHoldTime = 0;
-                dummySize = (u32) -1;
+                dummySize = (u64) -1;
             }
         }
         if(hid::released(hid::BUTTON_R) && (inputRHoldTime != 0)) {
@@ -410,11 +549,10 @@ int main(int argc, char **argv) {
         
         // Y - (PRESS) FILL CLIPBOARD IF EMPTY / (TAP) COPY / (HOLD) MOVE
         if(clipboard.empty()) {
-            if(hid::pressed(hid::BUTTON_Y)) {
-                if(markedElements != NULL && !(*markedElements).empty()) {
-                    for(std::set<SelectableElement*>::iterator it = (*markedElements).begin(); it != (*markedElements).end(); it++)
-                        clipboard.push_back(*(*it));
-                    (*markedElements).clear();
+            if(hid::pressed(hid::BUTTON_Y) && !hid::held(hid::BUTTON_L)) {
+                if(markedElements != NULL && ((*markedElements).count > 0)) {
+                    clipboard = uiMarkedElements(*markedElements);
+                    uiMarksClear(*markedElements);
                 } else if(currentFile.name.compare("..") != 0) clipboard.push_back(currentFile);
                 inputYHoldTime = (u64) -1;
             }
@@ -446,7 +584,7 @@ int main(int argc, char **argv) {
         }
         if(hid::released(hid::BUTTON_X) && (inputXHoldTime != 0)) {
             if(inputXHoldTime != (u64) -1) {
-                if((currentFile.name.compare("..") != 0) || !(*markedElements).empty()) {
+                if((currentFile.name.compare("..") != 0) || ((*markedElements).count > 0)) {
                     processAction(A_DELETE, updateList, resetCursor);
                 }
             }
@@ -456,8 +594,84 @@ int main(int argc, char **argv) {
         return breakLoop;
     };
     
-    auto onLoopHexViewer = [&](u32 &offset, u32 &markedOffset, u32 &markedLength) {
+    auto hvSaveEdits = [&](const std::string question) {
+        // edits stay in the patch overlay until they get written here
+        if((hvPatch == NULL) || !fsPatchEdits(hvPatch)) return true;
+        std::stringstream confirmMsg;
+        confirmMsg << "There are " << fsPatchEdits(hvPatch) << " unsaved edit(s).\n" << question << "\n";
+        if(!uiPrompt(gpu::SCREEN_TOP, confirmMsg.str(), true)) return false;
+        bool result = fsPatchCommit(hvPatch, true);
+        if(!result) uiErrorPrompt(gpu::SCREEN_TOP, "Writing", currentFile.id, true, false);
+        currentFile.details.at(2) = uiFormatBytes(fsPatchSize(hvPatch));
+        fsFreeSpaceRefresh();
+        if(!result) fsStatRefresh(currentFile.id); // whatever made it to the card
+        return result;
+    };
+    
+    auto hvSearchNew = [&](u64 offset) -> u64 {
+        // find all matches in one pass, then jump to the first one at or after offset
+        // searches go through the patch, so unsaved edits are found where the viewer shows them
+        errno = 0;
+        hvSearchResults = fsDataSearchAll(currentFile.id, hvLastSearch, hvSearchMax, true, hvPatch);
+        if(errno == ECANCELED) hvSearchResults.clear();
+        if(hvSearchResults.empty()) return (u64) -1;
+        std::vector<u64>::iterator it = std::lower_bound(hvSearchResults.begin(), hvSearchResults.end(), offset);
+        if(it == hvSearchResults.end()) {
+            if(hvSearchResults.size() >= hvSearchMax) { // result list is cut short, search the rest the slow way
+                hvSearchResults.clear();
+                return fsDataSearch(currentFile.id, hvLastSearch, offset, true, false, hvPatch);
+            }
+            it = hvSearchResults.begin();
+        }
+        hvSearchIndex = it - hvSearchResults.begin();
+        return *it;
+    };
+    
+    auto hvSearchStep = [&](bool reverse) -> u64 {
+        // next / previous match from the cached results if possible
+        if(!hvSearchResults.empty()) {
+            if(!reverse && (hvSearchIndex + 1 < hvSearchResults.size())) return hvSearchResults.at(++hvSearchIndex);
+            else if(reverse && (hvSearchIndex > 0)) return hvSearchResults.at(--hvSearchIndex);
+            else if(hvSearchResults.size() < hvSearchMax) { // wrap around
+                hvSearchIndex = (reverse) ? hvSearchResults.size() - 1 : 0;
+                return hvSearchResults.at(hvSearchIndex);
+            }
+            hvSearchResults.clear(); // leaving the cached range
+        }
+        if(reverse) return fsDataSearch(currentFile.id, hvLastSearch, hvLastFoundOffset + fsPatchSize(hvPatch) - 1, true, true, hvPatch); // one back, modulo size
+        else return fsDataSearch(currentFile.id, hvLastSearch, hvLastFoundOffset + 1, true, false, hvPatch);
+    };
+    
+    auto hvCompareStart = [&]() {
+        // two marked files, or two files in the clipboard while nothing is marked
+        // false if there is nothing to compare or the user declined, hvDiffPath is set once the viewer should open
+        std::vector<SelectableElement> pair;
+        if((*markedElements).count == 2) pair = uiMarkedElements(*markedElements);
+        else if(((*markedElements).count == 0) && (clipboard.size() == 2)) pair = clipboard;
+        if((pair.size() != 2) || fsIsDirectory(pair.at(0).id) || fsIsDirectory(pair.at(1).id)) return false;
+        
+        std::string confirmMsg = "Compare \"" + uiTruncateString(pair.at(0).name, 24, -8) + "\"\nwith \"" +
+            uiTruncateString(pair.at(1).name, 24, -8) + "\"?\n";
+        if(!uiPrompt(gpu::SCREEN_TOP, confirmMsg, true)) return false;
+        if(!fsDataCompare(pair.at(0).id, pair.at(1).id, hvDiffRanges, hvDiffMax, true)) {
+            if(errno != ECANCELED) uiErrorPrompt(gpu::SCREEN_TOP, "Comparing", pair.at(0).name, true, false);
+            hvDiffRanges.clear();
+            return true;
+        }
+        if(hvDiffRanges.empty()) {
+            uiPrompt(gpu::SCREEN_TOP, "Files are identical.\n", false);
+            return true;
+        }
+        currentFile = pair.at(0);
+        hvDiffPath = pair.at(1).id;
+        hvDiffIndex = 0;
+        hvDiffJump = true;
+        return true;
+    };
+    
+    auto onLoopHexViewer = [&](u64 &offset, u64 &markedOffset, u32 &markedLength) {
         bool breakLoop = false;
+        bool diffing = !hvDiffPath.empty();
         
         onLoopDisplay();
         
@@ -470,8 +684,8 @@ int main(int argc, char **argv) {
         if(!hvSelectMode) {
             // R - GO TO FILE BEGIN/END/STORED
             if(hid::pressed(hid::BUTTON_R)) {
-                if(hvStoredOffset == (u32) -1) offset = (offset) ? 0 : (u32) -1;
-                else offset = (offset) ? ((offset != hvStoredOffset) ? 0 : (u32) -1) : hvStoredOffset;
+                if(hvStoredOffset == (u64) -1) offset = (offset) ? 0 : (u64) -1;
+                else offset = (offset) ? ((offset != hvStoredOffset) ? 0 : (u64) -1) : hvStoredOffset;
             }
 
             // X - GO TO OFFSET
@@ -479,38 +693,66 @@ int main(int argc, char **argv) {
                 if(inputXHoldTime == 0) inputXHoldTime = core::time();
                 else if(core::time() - inputXHoldTime >= tapDelay) {
                     std::string confirmMsg = "Enter new decimal offset below:\n";
-                    u32 offsetNew = uiNumberInput(gpu::SCREEN_TOP, offset, confirmMsg, false);
-                    if(offsetNew != (u32) -1) hvStoredOffset = offset = offsetNew;
+                    u64 offsetNew = uiNumberInput(gpu::SCREEN_TOP, offset, confirmMsg, false);
+                    if(offsetNew != (u64) -1) hvStoredOffset = offset = offsetNew;
                     inputXHoldTime = 0;
                 }
             }
             if(hid::released(hid::BUTTON_X) && (inputXHoldTime != 0)) {
                 if(inputXHoldTime != (u64) -1) {
                     std::string confirmMsg = "Enter new hexadecimal offset below:\n";
-                    u32 offsetNew = uiNumberInput(gpu::SCREEN_TOP, offset, confirmMsg, true);
-                    if(offsetNew != (u32) -1) hvStoredOffset = offset = offsetNew;
+                    u64 offsetNew = uiNumberInput(gpu::SCREEN_TOP, offset, confirmMsg, true, hvHexDigits);
+                    if(offsetNew != (u64) -1) hvStoredOffset = offset = offsetNew;
                 }
                 inputXHoldTime = 0;
             }
             
+            // Y - DIFF NEXT / PREVIOUS / END COMPARE
+            if(diffing && hid::held(hid::BUTTON_Y) && (inputYHoldTime != (u64) -1)) {
+                if(inputYHoldTime == 0) inputYHoldTime = core::time();
+                else if(core::time() - inputYHoldTime >= tapDelay) {
+                    markedOffset = markedLength = 0;
+                    hvDiffPath.clear();
+                    hvDiffRanges.clear();
+                    hvDiffIndex = 0;
+                    inputYHoldTime = (u64) -1;
+                }
+            }
+            if(diffing && hid::released(hid::BUTTON_Y) && (inputYHoldTime != 0)) {
+                if(inputYHoldTime != (u64) -1) {
+                    if(!hid::held(hid::BUTTON_L)) hvDiffIndex = (hvDiffIndex + 1 < hvDiffRanges.size()) ? hvDiffIndex + 1 : 0;
+                    else hvDiffIndex = (hvDiffIndex > 0) ? hvDiffIndex - 1 : hvDiffRanges.size() - 1;
+                    hvDiffJump = true;
+                }
+                inputYHoldTime = 0;
+            }
+            if(diffing && hvDiffJump) {
+                // long ranges are only marked at their start, the view follows the mark
+                const FsDiffRange &range = hvDiffRanges.at(hvDiffIndex);
+                offset = markedOffset = range.offset;
+                markedLength = (range.length < 0x80) ? (u32) range.length : 0x80;
+                hvDiffJump = false;
+            }
+            
             // Y - SEARCH STRING / DATA
-            if(hid::held(hid::BUTTON_Y) && (inputYHoldTime != (u64) -1)) {
+            if(!diffing && hid::held(hid::BUTTON_Y) && (inputYHoldTime != (u64) -1)) {
                 if(inputYHoldTime == 0) inputYHoldTime = core::time();
                 else if(core::time() - inputYHoldTime >= tapDelay) {
-                    if (hvLastFoundOffset != (u32) -1) {
+                    if (hvLastFoundOffset != (u64) -1) {
                         markedOffset = markedLength = 0;
-                        hvLastFoundOffset = (u32) -1;
+                        hvLastFoundOffset = (u64) -1;
+                        hvSearchResults.clear();
                         inputYHoldTime = (u64) -1;
                     } else {
                         const std::string alphabet = "?ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz(){}[]<>/\\|*:=+-_.'\"`^,~!@#$%& 0123456789";
                         std::string confirmMsg = "Enter search string below:\n";
                         std::string searchStr = uiStringInput(gpu::SCREEN_TOP, hvLastSearchStr, alphabet, confirmMsg, 1, true);
                         if(!searchStr.empty()) {
-                            u32 offsetNew;
+                            u64 offsetNew;
                             hvLastSearchStr = searchStr;
                             hvLastSearch = std::vector<u8>(hvLastSearchStr.begin(), hvLastSearchStr.end());
-                            offsetNew = fsDataSearch(currentFile.id, hvLastSearch, offset, true);
-                            if(offsetNew != (u32) -1) {
+                            offsetNew = hvSearchNew(offset);
+                            if(offsetNew != (u64) -1) {
                                 markedOffset = hvLastFoundOffset = offsetNew;
                                 markedLength = hvLastSearch.size();
                             } else uiErrorPrompt(gpu::SCREEN_TOP, "Searching", "Not found: " + searchStr, false, false);
@@ -519,30 +761,36 @@ int main(int argc, char **argv) {
                     }
                 }
             }
-            if(hid::released(hid::BUTTON_Y) && (inputYHoldTime != 0)) {
+            if(!diffing && hid::released(hid::BUTTON_Y) && (inputYHoldTime != 0)) {
                 if(inputYHoldTime != (u64) -1) {
-                    u32 offsetNew = (u32) -1;
-                    if(hvLastFoundOffset == (u32) -1) {
+                    u64 offsetNew = (u64) -1;
+                    if(hvLastFoundOffset == (u64) -1) {
                         std::string confirmMsg = "Enter search value below:\n";
                         std::vector<u8> searchTerm = uiDataInput(gpu::SCREEN_TOP, hvLastSearchHex, confirmMsg);
                         if(!searchTerm.empty()) {
                             hvLastSearchHex = hvLastSearch = searchTerm;
-                            offsetNew = fsDataSearch(currentFile.id, hvLastSearch, offset, true);
-                            if(offsetNew == (u32) -1) {
+                            offsetNew = hvSearchNew(offset);
+                            if(offsetNew == (u64) -1) {
                                 std::stringstream searchText;
                                 for(std::vector<u8>::iterator it = searchTerm.begin(); it != searchTerm.end(); it++)
                                     searchText << std::setfill('0') << std::uppercase << std::hex << std::setw(2) << (u32) (*it);
                                 uiErrorPrompt(gpu::SCREEN_TOP, "Searching", "Not found: " + searchText.str(), false, false);
                             }
                         }
-                    } else offsetNew = fsDataSearch(currentFile.id, hvLastSearch, hvLastFoundOffset + 1, true);
-                    if(offsetNew != (u32) -1) {
+                    } else offsetNew = hvSearchStep(hid::held(hid::BUTTON_L));
+                    if(offsetNew != (u64) -1) {
                         markedOffset = hvLastFoundOffset = offsetNew;
                         markedLength = hvLastSearch.size();
                     }
                 }
                 inputYHoldTime = 0;
             }
+            
+            // SELECT - UNDO LAST EDIT
+            if(hid::pressed(hid::BUTTON_SELECT) && fsPatchUndo(hvPatch)) {
+                currentFile.details.at(2) = uiFormatBytes(fsPatchSize(hvPatch));
+                hvSearchResults.clear();
+            }
         } else {
             // SELECT - CLEAR PASTE DATA
             if(hid::pressed(hid::BUTTON_SELECT)) {
@@ -553,7 +801,7 @@ int main(int argc, char **argv) {
         return breakLoop;
     };
     
-    auto onLoopTextViewer = [&]() {
+    auto onLoopTextViewer = [&](u64 &seekLine, u64 &seekOffset) {
         bool breakLoop = false;
         
         onLoopDisplay();
@@ -564,33 +812,50 @@ int main(int argc, char **argv) {
             return true;
         }
         
+        // Y - GO TO LINE
+        if(hid::pressed(hid::BUTTON_Y)) {
+            std::string confirmMsg = "Enter line number below:\n";
+            u64 lineNew = uiNumberInput(gpu::SCREEN_TOP, 1, confirmMsg, false);
+            if((lineNew != (u64) -1) && (lineNew > 0)) seekLine = lineNew - 1;
+        }
+        
+        // SELECT - GO TO PERCENTAGE
+        if(hid::pressed(hid::BUTTON_SELECT)) {
+            std::string confirmMsg = "Enter position in percent below:\n";
+            u64 percent = uiNumberInput(gpu::SCREEN_TOP, 0, confirmMsg, false);
+            if(percent != (u64) -1) {
+                u64 fileSize = fsGetFileSize(currentFile.id);
+                seekOffset = (percent >= 100) ? fileSize : (fileSize / 100) * percent + ((fileSize % 100) * percent) / 100;
+            }
+        }
+        
         return breakLoop;
     };
     
-    auto onSelectHexViewer = [&](u32 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &forceRefresh) {
+    auto onSelectHexViewer = [&](u64 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &forceRefresh) {
         bool breakLoop = false;
         
         if(selectButton == hid::BUTTON_A) { // A - EDIT DATA
             std::string confirmMsg = "Enter new hex value(s) below:\n";
-            std::vector<u8> input = fsDataGet(currentFile.id, selectedOffset, selectedLength);
+            std::vector<u8> input = fsPatchGet(hvPatch, selectedOffset, selectedLength);
             if(input.size() != selectedLength) {
                 uiErrorPrompt(gpu::SCREEN_TOP, "Reading", currentFile.id, true, false);
             } else {
                 input = uiDataInput(gpu::SCREEN_TOP, input, confirmMsg, true);
                 if(!input.empty() && (input.size() != selectedLength) &&
                     !uiPrompt(gpu::SCREEN_TOP, "Warning: This will change file size.\n", true));
-                else if(!input.empty() && !fsDataReplace(currentFile.id, input, selectedOffset, selectedLength))
-                    uiErrorPrompt(gpu::SCREEN_TOP, "Writing", currentFile.id, true, false);
+                else if(!input.empty() && !fsPatchReplace(hvPatch, selectedOffset, selectedLength, input))
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Editing", currentFile.id, true, false);
                 else forceRefresh = true;
             }
         } else if(selectButton == hid::BUTTON_X) { // X - DELETE DATA
             if(uiPrompt(gpu::SCREEN_TOP, "Warning: This will remove data\nand change file size.\n", true)) {
-                if(!fsFileResize(currentFile.id, selectedOffset, selectedLength, 0, true))
-                    uiErrorPrompt(gpu::SCREEN_TOP, "Resizing", currentFile.id, true, false);
+                if(!fsPatchReplace(hvPatch, selectedOffset, selectedLength, std::vector<u8>()))
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Editing", currentFile.id, true, false);
                 else forceRefresh = true;
             }
         } else if((selectButton == hid::BUTTON_Y) && hvClipboard.empty()) { // Y - COPY DATA
-            hvClipboard = fsDataGet(currentFile.id, selectedOffset, selectedLength);
+            hvClipboard = fsPatchGet(hvPatch, selectedOffset, selectedLength);
             if(hvClipboard.size() != selectedLength)
                 uiErrorPrompt(gpu::SCREEN_TOP, "Reading", currentFile.id, true, false);
         } else if((selectButton == hid::BUTTON_Y) && !hvClipboard.empty()) { // Y - PASTE DATA
@@ -598,13 +863,15 @@ int main(int argc, char **argv) {
             std::vector<u8> input = uiDataInput(gpu::SCREEN_TOP, hvClipboard, confirmMsg, true);
             if(!input.empty() && (input.size() != selectedLength) &&
                 !uiPrompt(gpu::SCREEN_TOP, "Warning: This will change file size.\n", true));
-            else if(!input.empty() && !fsDataReplace(currentFile.id, input, selectedOffset, selectedLength))
-                uiErrorPrompt(gpu::SCREEN_TOP, "Writing", currentFile.id, true, false);
+            else if(!input.empty() && !fsPatchReplace(hvPatch, selectedOffset, selectedLength, input))
+                uiErrorPrompt(gpu::SCREEN_TOP, "Editing", currentFile.id, true, false);
             else forceRefresh = true;
         }
         
-        if(forceRefresh)
-            currentFile.details.at(2) = uiFormatBytes((u64) fsGetFileSize(currentFile.id)); 
+        if(forceRefresh) {
+            currentFile.details.at(2) = uiFormatBytes(fsPatchSize(hvPatch));
+            hvSearchResults.clear(); // file changed, cached matches are stale
+        }
         
         return breakLoop;
     };
@@ -612,39 +879,81 @@ int main(int argc, char **argv) {
     while(core::running()) {
         uiInit();
         if(mode == M_HEXVIEWER) {
-            hvStoredOffset = (u32) -1;
+            if(fsFileResizePending(currentFile.id) &&
+                uiPrompt(gpu::SCREEN_TOP, "Found an interrupted resize of\n\"" + uiTruncateString(currentFile.name, 28, -8) + "\".\nResume it now?\n", true) &&
+                !fsFileResizeResume(currentFile.id, true))
+                uiErrorPrompt(gpu::SCREEN_TOP, "Resizing", currentFile.name, true, false);
+            hvStoredOffset = (u64) -1;
+            hvSearchResults.clear();
+            u64 hvFileSize = fsGetFileSize(currentFile.id);
+            u64 hvStart = 0;
+            if(currentFile.id == session.hexPath) { // back to where this file was left, also after a restart
+                if(session.hexOffset < hvFileSize) hvStart = session.hexOffset;
+                if(session.hexStoredOffset < hvFileSize) hvStoredOffset = session.hexStoredOffset;
+            }
+            session.hexPath = currentFile.id;
+            session.hexOffset = hvStart;
+            for(hvHexDigits = 8; (hvHexDigits < 16) && (hvFileSize >> (4 * hvHexDigits)); hvHexDigits++);
             currentFile.details.insert(currentFile.details.begin(), "@FFFFFFFF (-1)");
-            if(!uiHexViewer(currentFile.id, 0,
-                [&](u32 &offset, u32 &markedOffset, u32 &markedLength, bool selectMode) { // onLoop
+            hvPatch = fsPatchOpen(currentFile.id);
+            if((hvPatch == NULL) || !uiHexViewer(currentFile.id, hvStart,
+                [&](u64 &offset, u64 &markedOffset, u32 &markedLength, bool selectMode) { // onLoop
                     if(hvSelectMode != selectMode) hvSelectMode = selectMode;
                     return onLoopHexViewer(offset, markedOffset, markedLength);
                 },
-                [&](u32 offset) { // onUpdate
+                [&](u64 offset) { // onUpdate
                     std::stringstream ssOffset;
                     ssOffset << "@" << std::setfill('0') << std::uppercase;
                     ssOffset << std::hex << std::setw(8) << offset << " (" << std::dec << offset << ")";
                     currentFile.details.at(0) = ssOffset.str();
+                    session.hexOffset = offset;
                     return false;
                 },
-                [&](u32 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &forceRefresh) { // onSelect
+                [&](u64 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &forceRefresh) { // onSelect
                     return onSelectHexViewer(selectedOffset, selectedLength, selectButton, forceRefresh);
-                })) {
+                }, hvPatch)) {
                 uiErrorPrompt(gpu::SCREEN_TOP, "Hexview", currentFile.name, true, false);
             }
+            hvSaveEdits("Write them to the file now?");
+            session.hexStoredOffset = hvStoredOffset;
+            fsPatchClose(hvPatch);
+            hvPatch = NULL;
+            hvDiffPath.clear();
+            hvDiffRanges.clear();
             mode = M_BROWSER;
         } else if(mode == M_TEXTVIEWER) {
+            currentFile.details.insert(currentFile.details.begin(), "line ?");
             currentFile.details.insert(currentFile.details.begin(), "@FFFFFFFF+F (-1+-1)");
             if(!uiTextViewer(currentFile.id, onLoopTextViewer,
-                [&](u32 offset, u32 plus) { // onUpdate
+                [&](u64 offset, u32 plus, u64 line) { // onUpdate
                     std::stringstream ssOffset;
                     ssOffset << "@" << std::setfill('0') << std::uppercase;
                     ssOffset << std::hex << std::setw(8) << offset << "+" << plus;
                     ssOffset << " (" << std::dec << offset << "+" << plus << ")";
                     currentFile.details.at(0) = ssOffset.str();
+                    std::stringstream ssLine;
+                    ssLine << "line ";
+                    if(line != (u64) -1) ssLine << (line + 1);
+                    else ssLine << "?";
+                    currentFile.details.at(1) = ssLine.str();
                     return false;
                 }))
                 uiErrorPrompt(gpu::SCREEN_TOP, "Textview", currentFile.name, true, false);
             mode = M_BROWSER;
+        } else if(mode == M_BENCHMARK) {
+            std::string confirmMsg = "Run the fs benchmark?\nEnter test file size in MiB below:\n";
+            u64 sizeMiB = uiNumberInput(gpu::SCREEN_TOP, 16, confirmMsg, false);
+            if((sizeMiB != (u64) -1) && (sizeMiB > 0)) {
+                std::vector<BenchResult> results;
+                if(!benchRun(sizeMiB * 1024 * 1024, results)) {
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Benchmark", "sdmc:/3ds/CTRXplorer/bench", true, false);
+                } else if(uiPrompt(gpu::SCREEN_TOP, benchSummary(results) + "\nSave results to " + fsGetFileName(benchCsvPath()) + "?\n", true) &&
+                    !benchSaveCsv(results)) {
+                    uiErrorPrompt(gpu::SCREEN_TOP, "Saving", benchCsvPath(), true, false);
+                }
+            }
+            fsFreeSpaceRefresh();
+            mode = M_BROWSER;
         } else {
             uiFileBrowser( "sdmc:/", currentFile.id,
                 [&](bool &updateList, bool &resetCursor) { // onLoop function
@@ -656,7 +965,7 @@ int main(int argc, char **argv) {
                 [&](std::string* currDir) { // onUpdateDir function
                     currentDir = *currDir;
                 },
-                [&](std::set<SelectableElement*>* marked) { // onUpdateMarked function
+                [&](UiMarks* marked) { // onUpdateMarked function
                     markedElements = marked;
                 },
                 [&](std::string selectedPath, bool &updateList) { // onSelect function
@@ -665,6 +974,13 @@ int main(int argc, char **argv) {
                         hid::held(hid::BUTTON_A) && core::time() - inputAHoldTime < tapDelay;
                         hid::poll()) gpu::swapBuffers(true);
                     mode = (core::time() - inputAHoldTime >= tapDelay) ? M_TEXTVIEWER : M_HEXVIEWER;
+                    if((mode == M_HEXVIEWER) && hvCompareStart()) {
+                        if(hvDiffPath.empty()) { // identical, failed or cancelled
+                            mode = M_BROWSER;
+                            return false;
+                        }
+                        uiMarksClear(*markedElements);
+                    }
                     return true;
                 });
         }
@@ -674,6 +990,9 @@ int main(int argc, char **argv) {
         }
     }
 
+    session.path = (currentFile.name.compare("..") != 0) ? currentFile.id : currentDir + "/..";
+    fsSessionSave(session);
+    fsCleanup();
     core::exit();
     uiCleanup();
     
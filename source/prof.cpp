@@ -0,0 +1,135 @@
+#include "prof.hpp"
+
+#ifdef CTRX_PROFILE
+
+#include "ui.hpp"
+
+#include <citrus/gpu.hpp>
+#include <citrus/gput.hpp>
+
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include <3ds.h>
+
+using namespace ctr;
+
+#define PROF_TICKS_MS (SYSCLOCK_ARM11 / 1000)
+#define PROF_WINDOW (500 * PROF_TICKS_MS)
+
+typedef struct {
+    u64 start[PROF_COUNT];
+    u32 depth[PROF_COUNT]; // nested scopes only count once
+    u64 ticks[PROF_COUNT]; // in the current window
+    u64 windowStart;
+    u64 frameStart;
+    u64 frameTicks;
+    u32 frames;
+    u64 bytesPrev;
+    u32 allocsPrev;
+    u32 generation; // published windows, the overlay is redrawn when it changes
+} ProfState;
+
+typedef struct {
+    double frameMs;
+    u32 share[PROF_COUNT]; // percent of the window
+    double bytesPerSec;
+    u32 allocsPerSec;
+} ProfStats;
+
+ProfState profState = {};
+ProfStats profStats = {};
+volatile u64 profBytes = 0; // updated from the pipe threads
+volatile u32 profAllocs = 0;
+
+void profPublish(u64 now) {
+    if(profState.windowStart == 0) profState.windowStart = now;
+    u64 window = now - profState.windowStart;
+    if(window < PROF_WINDOW) return;
+
+    for(u32 c = 0; c < PROF_COUNT; c++) {
+        if(profState.depth[c] > 0) { // split scopes that are still open, e.g. during a copy
+            profState.ticks[c] += now - profState.start[c];
+            profState.start[c] = now;
+        }
+        u64 share = (profState.ticks[c] * 100) / window;
+        profStats.share[c] = (share > 100) ? 100 : (u32) share;
+        profState.ticks[c] = 0;
+    }
+    profStats.frameMs = (profState.frames > 0) ? ((double) profState.frameTicks / profState.frames) / PROF_TICKS_MS : 0.0;
+
+    u64 bytes = __atomic_load_n(&profBytes, __ATOMIC_RELAXED);
+    u32 allocs = __atomic_load_n(&profAllocs, __ATOMIC_RELAXED);
+    profStats.bytesPerSec = ((double) (bytes - profState.bytesPrev) * PROF_TICKS_MS * 1000) / window;
+    profStats.allocsPerSec = (u32) (((u64) (allocs - profState.allocsPrev) * PROF_TICKS_MS * 1000) / window);
+    profState.bytesPrev = bytes;
+    profState.allocsPrev = allocs;
+
+    profState.frameTicks = 0;
+    profState.frames = 0;
+    profState.windowStart = now;
+    profState.generation++;
+}
+
+void profBegin(ProfCategory category) {
+    if(threadGetCurrent() != NULL) return; // only the main thread is timed
+    if(profState.depth[category]++ == 0) profState.start[category] = svcGetSystemTick();
+}
+
+void profEnd(ProfCategory category) {
+    if((threadGetCurrent() != NULL) || (profState.depth[category] == 0)) return;
+    if(--profState.depth[category] == 0) profState.ticks[category] += svcGetSystemTick() - profState.start[category];
+}
+
+void profFrame() {
+    u64 now = svcGetSystemTick();
+    if(profState.frameStart != 0) {
+        profState.frameTicks += now - profState.frameStart;
+        profState.frames++;
+    }
+    profState.frameStart = now;
+    profPublish(now);
+}
+
+u32 profGeneration() {
+    return profState.generation;
+}
+
+void profAddBytes(u64 bytes) {
+    __atomic_add_fetch(&profBytes, bytes, __ATOMIC_RELAXED);
+}
+
+void profAddAlloc() {
+    __atomic_add_fetch(&profAllocs, 1, __ATOMIC_RELAXED);
+}
+
+void profDrawOverlay() {
+    // expects the top screen viewport to be set up, draws over the bottom line
+    profPublish(svcGetSystemTick());
+
+    std::stringstream stream;
+    stream << std::fixed << std::setprecision(1);
+    stream << profStats.frameMs << "ms";
+    stream << " io " << profStats.share[PROF_IO] << "%";
+    stream << " draw " << profStats.share[PROF_DRAW] << "%";
+    stream << " " << uiFormatBytes((u64) profStats.bytesPerSec) << "/s";
+    stream << " " << profStats.allocsPerSec << " alloc/s";
+    std::string str = stream.str();
+
+    uiDrawRectangle(0, 0, gpu::TOP_WIDTH, 10, 0x00, 0x00, 0x00, 0xC0);
+    gput::drawString(str, gpu::TOP_WIDTH - 1 - gput::getStringWidth(str, 8), 1, 8, 8, 0xFF, 0xFF, 0x00);
+}
+
+// counts every allocation made through new, the fs buffers are counted in fsBufferAlloc
+void* operator new(size_t size) {
+    profAddAlloc();
+    return malloc((size > 0) ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __CTRX_PROF_HPP__
+#define __CTRX_PROF_HPP__
+
+#include <citrus/types.hpp>
+
+// timers, counters and the top screen overlay only exist when building with
+// -DCTRX_PROFILE in BUILD_FLAGS, otherwise the PROF_* macros are empty statements
+
+typedef enum {
+    PROF_IO,
+    PROF_DRAW,
+    PROF_COUNT
+} ProfCategory;
+
+#ifdef CTRX_PROFILE
+
+void profBegin(ProfCategory category);
+void profEnd(ProfCategory category);
+void profFrame();
+void profAddBytes(u64 bytes);
+void profAddAlloc();
+void profDrawOverlay();
+u32 profGeneration();
+
+struct ProfScope {
+    ProfCategory category;
+    ProfScope(ProfCategory category) : category(category) { profBegin(category); }
+    ~ProfScope() { profEnd(category); }
+};
+
+#define PROF_CONCAT_(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT_(a, b)
+#define PROF_SCOPE(category) ProfScope PROF_CONCAT(profScope, __LINE__)(category)
+#define PROF_BEGIN(category) profBegin(category)
+#define PROF_END(category) profEnd(category)
+#define PROF_FRAME() profFrame()
+#define PROF_BYTES(bytes) profAddBytes(bytes)
+#define PROF_ALLOC() profAddAlloc()
+#define PROF_OVERLAY() profDrawOverlay()
+#define PROF_GENERATION() profGeneration()
+
+#else
+
+#define PROF_SCOPE(category)
+#define PROF_BEGIN(category) do {} while(0)
+#define PROF_END(category) do {} while(0)
+#define PROF_FRAME() do {} while(0)
+#define PROF_BYTES(bytes) do {} while(0)
+#define PROF_ALLOC() do {} while(0)
+#define PROF_OVERLAY() do {} while(0)
+#define PROF_GENERATION() 0
+
+#endif
+
+#endif
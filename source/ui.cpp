@@ -1,5 +1,6 @@
 #include "ui.hpp"
 #include "fs.hpp"
+#include "prof.hpp"
 
 #include <3ds.h>
 
@@ -15,19 +16,55 @@
 #include <iomanip>
 #include <sstream>
 #include <stack>
+#include <unordered_set>
 
 using namespace ctr;
 
 // #define CTRX_EXTRA_SAFE // additional safety checks, not needed by the responsible programmer
 
+#define UI_ENTRY_DIRECTORY (1 << 0)
+#define UI_ENTRY_PARENT (1 << 1)
+
+typedef struct {
+    u32 nameOffset;
+    u32 nameLength;
+    u64 size;
+    u32 flags;
+} UiListEntry;
+
+typedef struct {
+    std::string prefix; // prepended to the name to build the id
+    std::string pool; // NUL separated names
+    std::vector<UiListEntry> entries;
+    std::vector<u32> remap; // set after a merge, new index of each old entry
+    std::string previousPool; // contents before the last reload, until the marks were carried over
+    std::vector<UiListEntry> previous;
+    bool refresh; // details changed, e.g. folder sizes came in
+} UiList;
+
 struct uiAlphabetize {
-    inline bool operator()(SelectableElement a, SelectableElement b) {
-        return strcasecmp(a.name.c_str(), b.name.c_str()) < 0;
+    const std::string* pool;
+    inline bool operator()(const UiListEntry &a, const UiListEntry &b) const {
+        return strcasecmp(pool->c_str() + a.nameOffset, pool->c_str() + b.nameOffset) < 0;
+    }
+};
+
+struct uiAlphabetizeFoldersFiles { // same order as fsAlphabetizeFoldersFiles
+    const std::string* pool;
+    inline bool operator()(const UiListEntry &a, const UiListEntry &b) const {
+        if((a.flags & UI_ENTRY_DIRECTORY) == (b.flags & UI_ENTRY_DIRECTORY))
+            return strcasecmp(pool->c_str() + a.nameOffset, pool->c_str() + b.nameOffset) < 0;
+        else return (a.flags & UI_ENTRY_DIRECTORY) != 0;
     }
 };
 
 u32 selectorTexture;
 u32 selectorVbo;
+u32 screenGeneration = 0; // bumped when a message, progress or keyboard covers the screens
+
+u32 uiScreenGeneration() {
+    return screenGeneration;
+}
 
 void uiInit() {
     gpu::createTexture(&selectorTexture);
@@ -68,7 +105,7 @@ void uiDrawRectangle(int x, int y, u32 width, u32 height, u8 red, u8 green, u8 b
     gput::drawString(std::string(1, 0xDB), x, y, width, height, red, green, blue, alpha);
 }
 
-void uiDrawPositionBar(u32 pos, u32 nShown, u32 total, bool use_bottom) {
+void uiDrawPositionBar(u64 pos, u32 nShown, u64 total, bool use_bottom) {
     const u32 barMinHeight = 32;
     const u32 barWidth = 2;
     const u8 gr = 0x4F;
@@ -81,15 +118,15 @@ void uiDrawPositionBar(u32 pos, u32 nShown, u32 total, bool use_bottom) {
     gpu::getViewportHeight(&screenHeight);
     
     if(!use_bottom) {
-        u32 barHeight = (nShown * screenHeight) / total;
+        u32 barHeight = ((u64) nShown * screenHeight) / total;
         if (barHeight < barMinHeight) barHeight = barMinHeight;
-        u32 barPos = (screenHeight - barHeight) - (((u64) pos * (screenHeight - barHeight)) / (total - nShown));
+        u32 barPos = (screenHeight - barHeight) - ((pos * (screenHeight - barHeight)) / (total - nShown));
         
         uiDrawRectangle(screenWidth - barWidth, barPos, barWidth, barHeight, gr, gr, gr);
     } else {
-        u32 barHeight = (nShown * screenWidth) / total;
+        u32 barHeight = ((u64) nShown * screenWidth) / total;
         if (barHeight < barMinHeight) barHeight = barMinHeight;
-        u32 barPos = ((u64) pos * (screenWidth - barHeight)) / (total - nShown);
+        u32 barPos = (pos * (screenWidth - barHeight)) / (total - nShown);
         
         uiDrawRectangle(barPos, 0, barHeight, barWidth, gr, gr, gr);
     }
@@ -122,17 +159,142 @@ std::string uiFormatBytes(u64 bytes) {
     return byteStr.str();
 }
 
-bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement> elements, std::function<bool(std::vector<SelectableElement> &currElements, bool &elementsDirty, bool &resetCursorIfDirty)> onLoop, std::function<void(SelectableElement* select)> onUpdateCursor, std::function<void(std::set<SelectableElement*>* marked)> onUpdateMarked, std::function<bool(SelectableElement* selected)> onSelect, bool useTopScreen, bool alphabetize) {
+void uiListAppend(UiList &list, const std::string name, u64 size, u32 flags) {
+    list.entries.push_back({(u32) list.pool.size(), (u32) name.size(), size, flags});
+    list.pool.append(name);
+    list.pool.push_back('\0');
+}
+
+std::string uiListName(const UiList &list, u32 index) {
+    const UiListEntry &entry = list.entries[index];
+    return std::string(list.pool, entry.nameOffset, entry.nameLength);
+}
+
+int uiListFind(const UiList &list, const std::string id) {
+    if((id.size() <= list.prefix.size()) || (id.compare(0, list.prefix.size(), list.prefix) != 0)) return -1;
+    for(u32 i = 0; i < list.entries.size(); i++)
+        if((id.size() == list.prefix.size() + list.entries[i].nameLength) &&
+            (id.compare(list.prefix.size(), std::string::npos, list.pool.c_str() + list.entries[i].nameOffset) == 0)) return (int) i;
+    return -1;
+}
+
+void uiListMerge(UiList &list, const std::vector<FileInfoEx> &batch) {
+    // batch is sorted by fsAlphabetizeFoldersFiles, the parent entry stays on top
+    if(batch.empty()) return;
+    u32 first = (!list.entries.empty() && (list.entries[0].flags & UI_ENTRY_PARENT)) ? 1 : 0;
+    u32 oldCount = list.entries.size();
+    for(std::vector<FileInfoEx>::const_iterator it = batch.begin(); it != batch.end(); it++)
+        uiListAppend(list, (*it).name, (*it).size, (*it).isDirectory ? UI_ENTRY_DIRECTORY : 0);
+    
+    uiAlphabetizeFoldersFiles less = {&list.pool};
+    std::vector<UiListEntry> merged;
+    merged.reserve(list.entries.size());
+    list.remap.resize(oldCount);
+    u32 i = 0;
+    u32 j = oldCount;
+    for(; i < first; i++) {
+        list.remap[i] = merged.size();
+        merged.push_back(list.entries[i]);
+    }
+    while((i < oldCount) || (j < list.entries.size())) {
+        if((i < oldCount) && ((j >= list.entries.size()) || !less(list.entries[j], list.entries[i]))) {
+            list.remap[i] = merged.size();
+            merged.push_back(list.entries[i++]);
+        } else merged.push_back(list.entries[j++]);
+    }
+    list.entries.swap(merged);
+}
+
+bool uiListMatches(const UiList &list, const std::vector<FileInfoEx> &contents) {
+    // same names, types and sizes, in any order
+    std::vector<std::string> shown;
+    std::vector<std::string> listed;
+    for(u32 i = 0; i < list.entries.size(); i++) {
+        if(list.entries[i].flags & UI_ENTRY_PARENT) continue;
+        std::stringstream entry;
+        entry << uiListName(list, i) << '\0' << ((list.entries[i].flags & UI_ENTRY_DIRECTORY) ? 0 : list.entries[i].size) << '\0' << ((list.entries[i].flags & UI_ENTRY_DIRECTORY) != 0);
+        shown.push_back(entry.str());
+    }
+    for(std::vector<FileInfoEx>::const_iterator it = contents.begin(); it != contents.end(); it++) {
+        std::stringstream entry;
+        entry << (*it).name << '\0' << ((*it).isDirectory ? 0 : (*it).size) << '\0' << (*it).isDirectory;
+        listed.push_back(entry.str());
+    }
+    if(shown.size() != listed.size()) return false;
+    std::sort(shown.begin(), shown.end());
+    std::sort(listed.begin(), listed.end());
+    return shown == listed;
+}
+
+SelectableElement uiListElement(const UiList &list, u32 index) {
+    // details are formatted on demand, only for the cursor and marked entries
+    const UiListEntry &entry = list.entries[index];
+    const std::string name = uiListName(list, index);
+    std::vector<std::string> info = {};
+    if(entry.flags & UI_ENTRY_PARENT) {
+        return {name, name, info};
+    } else if(entry.flags & UI_ENTRY_DIRECTORY) {
+        info.push_back("folder");
+        FsDirSize size;
+        if(fsDirSizeGet(list.prefix + name, size)) {
+            std::stringstream count;
+            count << size.files << " files, " << size.folders << " folders";
+            info.push_back(uiFormatBytes(size.size));
+            info.push_back(count.str());
+        }
+    } else {
+        const std::string ext = uiTruncateString(fsGetExtension(name), 8, 3);
+        info.push_back((ext.size() > 0) ? (ext + " file") : "file");
+        info.push_back(uiFormatBytes(entry.size));
+    }
+    return {list.prefix + name, name, info};
+}
+
+bool uiMarksTest(const UiMarks &marks, u32 index) {
+    return ((index >> 5) < marks.bits.size()) && ((marks.bits[index >> 5] >> (index & 31)) & 1);
+}
+
+std::vector<SelectableElement> uiMarkedElements(const UiMarks &marks) {
+    // in list order, empty words are skipped
+    std::vector<SelectableElement> marked;
+    marked.reserve(marks.count);
+    for(u32 w = 0; w < marks.bits.size(); w++) {
+        for(u32 word = marks.bits[w]; word != 0; word &= word - 1)
+            marked.push_back(marks.element((w << 5) + __builtin_ctz(word)));
+    }
+    return marked;
+}
+
+void uiMarksClear(UiMarks &marks) {
+    marks.bits.assign(marks.bits.size(), 0);
+    marks.count = 0;
+    marks.bytes = 0;
+}
+
+bool uiSelectMultiple(const std::string startId, UiList &list, std::function<bool(UiList &currList, bool &elementsDirty, bool &resetCursorIfDirty)> onLoop, std::function<void(SelectableElement* select)> onUpdateCursor, std::function<void(UiMarks* marks)> onUpdateMarked, std::function<bool(SelectableElement* selected)> onSelect, bool useTopScreen, bool alphabetize) {
+    std::vector<UiListEntry> &elements = list.entries;
     if(elements.empty()) return false;
     
     int cursor = 0;
     int scroll = 0;
     
+    if(alphabetize) {
+        std::sort(elements.begin(), elements.end(), uiAlphabetize{&list.pool});
+    }
+    
+    // the start entry may not be listed yet if the list is still streaming in
+    std::string pendingId;
+    int pendingIndex = 0;
+    bool cursorMoved = false;
     if(!startId.empty()) {
-        for(cursor = elements.size() - 1; cursor > 0; cursor--)
-            if(startId.compare(elements.at((u32) cursor).id) == 0) break;
+        cursor = uiListFind(list, startId);
+        if(cursor < 0) {
+            pendingId = startId;
+            cursor = 0;
+        }
         scroll = (cursor < 20) ? 0 : cursor - 19;
     }
+    list.remap.clear();
 
     u32 selectionScroll = 0;
     u64 selectionScrollEndTime = 0;
@@ -140,21 +302,63 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
     u64 lastScrollTime = 0;
     
     bool lastMarkedStatus = false;
+    int modifierMark = -1; // entry the last L press flipped, until L turns out to be a modifier or is used to mark
 
     bool elementsDirty = false;
     bool resetCursorIfDirty = true;
     
-    if(alphabetize) {
-        std::sort(elements.begin(), elements.end(), uiAlphabetize());
-    }
+    // what the bottom screen shows, compared every frame
+    int drawnCursor = -1;
+    int drawnScroll = -1;
+    u32 drawnSelectionScroll = 0;
+    u32 drawnMarked = 0;
+    size_t drawnSize = 0;
+    u32 drawnGeneration = uiScreenGeneration();
+    u32 redrawFrames = 0;
+    
+    SelectableElement selectedElement = uiListElement(list, (u32) cursor);
+    SelectableElement* selected = &selectedElement;
     
-    SelectableElement* selected = &elements.at((u32) cursor);
-    std::set<SelectableElement*> markedElements;
+    // one mark bit per list index, entries are only materialized when the marks are read
+    UiMarks marks = { std::vector<u32>((elements.size() + 31) / 32, 0), 0, 0,
+        [&](u32 index) { return uiListElement(list, index); } };
+    // names of the marked entries while a refreshed list streams back in, dropped once found
+    std::unordered_set<std::string> pendingMarks;
+    
+    auto isMarked = [&](u32 index) -> bool {
+        return (marks.bits[index >> 5] >> (index & 31)) & 1;
+    };
+    auto setMarked = [&](u32 index, bool mark) {
+        if((elements[index].flags & UI_ENTRY_PARENT) || (isMarked(index) == mark)) return;
+        marks.bits[index >> 5] ^= (u32) 1 << (index & 31);
+        if(mark) {
+            marks.count++;
+            marks.bytes += elements[index].size;
+        } else {
+            marks.count--;
+            marks.bytes -= elements[index].size;
+        }
+    };
+    auto restoreMarks = [&](bool merged) {
+        // after a merge only the entries that just came in are looked up, the others were checked before
+        if(pendingMarks.empty()) return;
+        std::vector<bool> checked(merged ? elements.size() : 0, false);
+        for(u32 i = 0; merged && (i < list.remap.size()); i++)
+            checked[list.remap[i]] = true;
+        for(u32 i = 0; !pendingMarks.empty() && (i < elements.size()); i++) {
+            if((merged && checked[i]) || isMarked(i)) continue;
+            std::unordered_set<std::string>::iterator it = pendingMarks.find(uiListName(list, i));
+            if(it == pendingMarks.end()) continue;
+            setMarked(i, true);
+            pendingMarks.erase(it);
+        }
+    };
     
     if(onUpdateCursor != NULL) onUpdateCursor(selected);
-    if(onUpdateMarked != NULL) onUpdateMarked(&markedElements);
+    if(onUpdateMarked != NULL) onUpdateMarked(&marks);
 
     while(core::running()) {
+        PROF_FRAME();
         hid::poll();
         
         if(hid::pressed(hid::BUTTON_A)) {
@@ -164,12 +368,23 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
         }
         
         if(hid::pressed(hid::BUTTON_L)) {
-            std::pair <std::set<SelectableElement*>::iterator,bool> inserted = markedElements.insert(selected);
-            if(!inserted.second) markedElements.erase(inserted.first);
-            lastMarkedStatus = inserted.second;
+            cursorMoved = true;
+            pendingId.clear();
+            pendingMarks.clear();
+            lastMarkedStatus = !isMarked((u32) cursor);
+            setMarked((u32) cursor, lastMarkedStatus);
+            modifierMark = cursor;
             selectionScroll = 0;
             selectionScrollEndTime = core::time() - 3000;
-            if(onUpdateMarked != NULL) onUpdateMarked(&markedElements);
+            if(onUpdateMarked != NULL) onUpdateMarked(&marks);
+        }
+        
+        // L+SELECT, L+X and L+Y are settings combos, the entry keeps the mark it had
+        if(!hid::held(hid::BUTTON_L)) modifierMark = -1;
+        else if((modifierMark >= 0) && (hid::pressed(hid::BUTTON_SELECT) || hid::pressed(hid::BUTTON_X) || hid::pressed(hid::BUTTON_Y))) {
+            setMarked((u32) modifierMark, !lastMarkedStatus);
+            modifierMark = -1;
+            if(onUpdateMarked != NULL) onUpdateMarked(&marks);
         }
 
         if(hid::held(hid::BUTTON_DOWN) || hid::held(hid::BUTTON_UP) || hid::held(hid::BUTTON_LEFT) || hid::held(hid::BUTTON_RIGHT)) {
@@ -221,22 +436,28 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
                     }
                 }
                 
-                if(onUpdateCursor != NULL) onUpdateCursor(selected = &elements.at((u32) cursor));
+                if(cursor != lastCursor) {
+                    cursorMoved = true;
+                    modifierMark = -1;
+                    pendingId.clear();
+                    selectedElement = uiListElement(list, (u32) cursor);
+                    if(onUpdateCursor != NULL) onUpdateCursor(selected);
+                }
                 
                 if(hid::held(hid::BUTTON_L)) {
                     if(hid::held(hid::BUTTON_LEFT)) {
-                        markedElements.clear();
+                        uiMarksClear(marks);
                         lastMarkedStatus = false;
                     } else if(hid::held(hid::BUTTON_RIGHT)) {
-                        std::set<SelectableElement*>::iterator hint = markedElements.begin();
-                        for(std::vector<SelectableElement>::iterator it = elements.begin(); it != elements.end(); it++)
-                            hint = markedElements.insert(hint, &(*it));
+                        for(u32 i = 0; i < elements.size(); i++)
+                            setMarked(i, true);
                         lastMarkedStatus = true;
                     } else if(cursor != lastCursor) {
-                        std::pair <std::set<SelectableElement*>::iterator,bool> inserted = markedElements.insert(selected);
-                        if(!lastMarkedStatus) markedElements.erase(inserted.first);
+                        setMarked((u32) cursor, lastMarkedStatus);
                     }                    
-                    if(onUpdateMarked != NULL) onUpdateMarked(&markedElements);
+                    modifierMark = -1;
+                    pendingMarks.clear();
+                    if(onUpdateMarked != NULL) onUpdateMarked(&marks);
                 }
 
                 selectionScroll = 0;
@@ -248,52 +469,74 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
             lastScrollTime = 0;
         }
 
-        gpu::setViewport(gpu::SCREEN_BOTTOM, 0, 0, gpu::BOTTOM_WIDTH, gpu::BOTTOM_HEIGHT);
-        gput::setOrtho(0, gpu::BOTTOM_WIDTH, 0, gpu::BOTTOM_HEIGHT, -1, 1);
-        gpu::clear();
-
-        uiDrawPositionBar(scroll, 20, elements.size());
-        
-        u32 screenWidth;
-        u32 screenHeight;
-        gpu::getViewportWidth(&screenWidth);
-        gpu::getViewportHeight(&screenHeight);
-        for(std::vector<SelectableElement>::iterator it = elements.begin() + scroll; it != elements.begin() + scroll + 20 && it != elements.end(); it++) {
-            std::string name = (*it).name;
-            if (markedElements.find(&(*it)) != markedElements.end()) name.insert(0, 1, 0x10);
-            int index = it - elements.begin();
-            u8 cl = 0xFF;
-            int offset = 0;
-            float itemHeight = gput::getStringHeight(name, 8) + 4;
-            if(index == cursor) {
-                cl = 0x00;
-                uiDrawRectangle(0, (screenHeight - 1) - ((index - scroll + 1) * itemHeight), screenWidth, itemHeight);
-                u32 width = (u32) gput::getStringWidth(name, 8);
-                if(width > screenWidth) {
-                    if(selectionScrollEndTime == 0) {
-                        if(selectionScroll + screenWidth >= width) {
-                            selectionScrollEndTime = core::time();
-                        } else {
-                            selectionScroll++;
-                        }
-                    } else if(core::time() - selectionScrollEndTime >= 4000) {
-                        selectionScroll = 0;
-                        selectionScrollEndTime = 0;
-                    }
+        // the marquee of a selected name that does not fit advances once per frame
+        std::string cursorName = uiListName(list, (u32) cursor);
+        if(isMarked((u32) cursor)) cursorName.insert(0, 1, 0x10);
+        u32 cursorWidth = (u32) gput::getStringWidth(cursorName, 8);
+        if(cursorWidth > gpu::BOTTOM_WIDTH) {
+            if(selectionScrollEndTime == 0) {
+                if(selectionScroll + gpu::BOTTOM_WIDTH >= cursorWidth) {
+                    selectionScrollEndTime = core::time();
+                } else {
+                    selectionScroll++;
                 }
-                offset = -selectionScroll;
+            } else if(core::time() - selectionScrollEndTime >= 4000) {
+                selectionScroll = 0;
+                selectionScrollEndTime = 0;
             }
-            gput::drawString(name, offset, (screenHeight - 1) - ((index - scroll + 1) * itemHeight) + 2, 8, 8, cl, cl, cl);
         }
+        
+        // nothing is drawn while the shown state is unchanged, a change is drawn twice to fill both buffers
+        if((cursor != drawnCursor) || (scroll != drawnScroll) || (selectionScroll != drawnSelectionScroll) ||
+            (marks.count != drawnMarked) || (elements.size() != drawnSize) || (uiScreenGeneration() != drawnGeneration)) {
+            drawnCursor = cursor;
+            drawnScroll = scroll;
+            drawnSelectionScroll = selectionScroll;
+            drawnMarked = marks.count;
+            drawnSize = elements.size();
+            drawnGeneration = uiScreenGeneration();
+            redrawFrames = 2;
+        }
+        bool redraw = (redrawFrames > 0);
+        
+        if(redraw) {
+            PROF_BEGIN(PROF_DRAW);
+            redrawFrames--;
+            gpu::setViewport(gpu::SCREEN_BOTTOM, 0, 0, gpu::BOTTOM_WIDTH, gpu::BOTTOM_HEIGHT);
+            gput::setOrtho(0, gpu::BOTTOM_WIDTH, 0, gpu::BOTTOM_HEIGHT, -1, 1);
+            gpu::clear();
 
-        gpu::flushCommands();
-        gpu::flushBuffer();
+            uiDrawPositionBar(scroll, 20, elements.size());
+            
+            u32 screenWidth;
+            u32 screenHeight;
+            gpu::getViewportWidth(&screenWidth);
+            gpu::getViewportHeight(&screenHeight);
+            for(int index = scroll; (index < scroll + 20) && (index < (int) elements.size()); index++) {
+                std::string name = (index == cursor) ? cursorName : uiListName(list, (u32) index);
+                if ((index != cursor) && isMarked((u32) index)) name.insert(0, 1, 0x10);
+                u8 cl = 0xFF;
+                int offset = 0;
+                float itemHeight = gput::getStringHeight(name, 8) + 4;
+                if(index == cursor) {
+                    cl = 0x00;
+                    uiDrawRectangle(0, (screenHeight - 1) - ((index - scroll + 1) * itemHeight), screenWidth, itemHeight);
+                    offset = -selectionScroll;
+                }
+                gput::drawString(name, offset, (screenHeight - 1) - ((index - scroll + 1) * itemHeight) + 2, 8, 8, cl, cl, cl);
+            }
+
+            gpu::flushCommands();
+            gpu::flushBuffer();
+            PROF_END(PROF_DRAW);
+        }
         
-        if(useTopScreen) {
+        if(useTopScreen && redraw) {
             gpu::setViewport(gpu::SCREEN_TOP, 0, 0, gpu::TOP_WIDTH, gpu::TOP_HEIGHT);
             gput::setOrtho(0, gpu::TOP_WIDTH, 0, gpu::TOP_HEIGHT, -1, 1);
             gpu::clear();
 
+            u32 screenHeight;
             gpu::getViewportHeight(&screenHeight);
             if((*selected).details.size() != 0) {
                 std::stringstream details;
@@ -304,11 +547,31 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
             }
         }
 
-        bool result = onLoop != NULL && onLoop(elements, elementsDirty, resetCursorIfDirty);
+        bool result = onLoop != NULL && onLoop(list, elementsDirty, resetCursorIfDirty);
         if(elementsDirty) {
+            modifierMark = -1;
+            pendingId.clear();
+            pendingMarks.clear();
+            if(!resetCursorIfDirty) { // same folder, marks are found again by name
+                for(u32 i = 0; (marks.count > 0) && (i < list.previous.size()); i++) {
+                    if(uiMarksTest(marks, i))
+                        pendingMarks.insert(std::string(list.previousPool, list.previous[i].nameOffset, list.previous[i].nameLength));
+                }
+            }
+            list.previousPool.clear();
+            list.previous.clear();
             if(resetCursorIfDirty) {
                 cursor = 0;
                 scroll = 0;
+            } else {
+                pendingId = selectedElement.id;
+                pendingIndex = cursor;
+            }
+            int found = pendingId.empty() ? -1 : uiListFind(list, pendingId);
+            if(found >= 0) {
+                cursor = found;
+                scroll = (cursor < 20) ? 0 : cursor - 19;
+                pendingId.clear();
             } else if(cursor >= (int) elements.size()) {
                 cursor = elements.size() - 1;
                 if(cursor < 0) {
@@ -324,16 +587,61 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
             selectionScroll = 0;
             selectionScrollEndTime = 0;
             if(alphabetize) {
-                std::sort(elements.begin(), elements.end(), uiAlphabetize());
+                std::sort(elements.begin(), elements.end(), uiAlphabetize{&list.pool});
             }
             elementsDirty = false;
             resetCursorIfDirty = true;
+            cursorMoved = false;
+            redrawFrames = 2;
+            list.remap.clear();
+            
+            marks.bits.assign((elements.size() + 31) / 32, 0);
+            marks.count = 0;
+            marks.bytes = 0;
+            restoreMarks(false);
+            if(onUpdateMarked != NULL) onUpdateMarked(&marks);
+            if(elements.empty()) break;
+            selectedElement = uiListElement(list, (u32) cursor);
+            if (onUpdateCursor != NULL) onUpdateCursor(selected);
+        } else if(!list.remap.empty()) { // entries were merged in, follow the cursor and marked entries
+            if(modifierMark >= 0) modifierMark = list.remap[modifierMark];
+            if(cursorMoved) {
+                int moved = (int) list.remap[cursor] - cursor;
+                cursor += moved;
+                scroll += moved;
+            } else if(!pendingId.empty()) {
+                int found = uiListFind(list, pendingId);
+                if(found >= 0) {
+                    cursor = found;
+                    pendingId.clear();
+                } else if(pendingIndex < (int) elements.size()) cursor = pendingIndex;
+                else cursor = elements.size() - 1;
+                scroll = (cursor < 20) ? 0 : cursor - 19;
+            }
+            if(scroll > (int) elements.size() - 20) scroll = elements.size() - 20;
+            if(scroll < 0) scroll = 0;
+            
+            std::vector<u32> oldBits((elements.size() + 31) / 32, 0);
+            oldBits.swap(marks.bits);
+            if(marks.count > 0) {
+                for(u32 i = 0; i < list.remap.size(); i++) {
+                    if((oldBits[i >> 5] >> (i & 31)) & 1) marks.bits[list.remap[i] >> 5] |= (u32) 1 << (list.remap[i] & 31);
+                }
+            }
+            restoreMarks(true);
+            if(onUpdateMarked != NULL) onUpdateMarked(&marks);
+            list.remap.clear();
+            redrawFrames = 2;
             
-            if (onUpdateCursor != NULL) onUpdateCursor((selected = &elements.at((u32) cursor)));
-            markedElements.clear();
+            selectedElement = uiListElement(list, (u32) cursor);
+            if (onUpdateCursor != NULL) onUpdateCursor(selected);
+        } else if(list.refresh) {
+            list.refresh = false;
+            selectedElement = uiListElement(list, (u32) cursor);
+            if (onUpdateCursor != NULL) onUpdateCursor(selected);
         }
         
-        if(useTopScreen) {
+        if(useTopScreen && redraw) {
             gpu::flushCommands();
             gpu::flushBuffer();
         }
@@ -348,27 +656,46 @@ bool uiSelectMultiple(const std::string startId, std::vector<SelectableElement>
     return false;
 }
 
-void uiGetDirContentsSorted(std::vector<SelectableElement> &elements, const std::string directory, bool isRoot) {
-    elements.clear();
-    if (!isRoot) elements.push_back({"..", ".."});
-    
-    std::vector<FileInfoEx> contents = fsGetDirectoryContentsEx(directory);
-    for(std::vector<FileInfoEx>::iterator it = contents.begin(); it != contents.end(); it++) {
-        const std::string name = (*it).name;
-        const std::string path = (*it).path;
-        std::vector<std::string> info = {};
-        if((*it).isDirectory) {
-            info.push_back("folder");
-        } else {
-            const std::string ext = uiTruncateString(fsGetExtension(name), 8, 3);
-            info.push_back((ext.size() > 0) ? (ext + " file") : "file");
-            info.push_back(uiFormatBytes((u64) fsGetFileSize(path)));
-        }
-        elements.push_back({path, name, info});
+FsDirStream* uiGetDirContentsSorted(UiList &list, const std::string directory, bool isRoot) {
+    // starts a streaming listing, returns once the first entries are in or the listing is done
+    bool hasSlash = directory.size() != 0 && directory[directory.size() - 1] == '/';
+    list.prefix = hasSlash ? directory : directory + "/";
+    list.previousPool.swap(list.pool);
+    list.previous.swap(list.entries);
+    list.pool.clear();
+    list.entries.clear();
+    list.remap.clear();
+    list.refresh = false;
+    if (!isRoot) uiListAppend(list, "..", 0, UI_ENTRY_PARENT);
+    
+    FsDirStream* stream = fsDirStreamOpen(directory);
+    std::vector<FileInfoEx> batch;
+    for(bool finished = false; !finished && core::running(); svcSleepThread(1000000)) {
+        finished = fsDirStreamPoll(stream, batch);
+        uiListMerge(list, batch);
+        if(finished) {
+            fsDirStreamClose(stream);
+            stream = NULL;
+        } else if(!batch.empty()) break;
+    }
+    list.remap.clear();
+    return stream;
+}
+
+bool uiPollDirContents(UiList &list, FsDirStream* &stream) {
+    // merges what the listing thread found since the last call, true once the listing is done
+    if(stream == NULL) return true;
+    std::vector<FileInfoEx> batch;
+    bool finished = fsDirStreamPoll(stream, batch);
+    uiListMerge(list, batch);
+    if(finished) {
+        fsDirStreamClose(stream);
+        stream = NULL;
     }
+    return finished;
 }
 
-bool uiFileBrowser(const std::string rootDirectory, const std::string startPath, std::function<bool(bool &updateList, bool &resetCursorOnUpdate)> onLoop, std::function<void(SelectableElement* entry)> onUpdateEntry, std::function<void(std::string* currDir)> onUpdateDir, std::function<void(std::set<SelectableElement*>* marked)> onUpdateMarked, std::function<bool(std::string selectedPath, bool &updateList)> onSelect, bool useTopScreen) {
+bool uiFileBrowser(const std::string rootDirectory, const std::string startPath, std::function<bool(bool &updateList, bool &resetCursorOnUpdate)> onLoop, std::function<void(SelectableElement* entry)> onUpdateEntry, std::function<void(std::string* currDir)> onUpdateDir, std::function<void(UiMarks* marks)> onUpdateMarked, std::function<bool(std::string selectedPath, bool &updateList)> onSelect, bool useTopScreen) {
     std::stack<std::string> directoryStack;
     std::string currDirectory = rootDirectory;
 
@@ -379,21 +706,25 @@ bool uiFileBrowser(const std::string rootDirectory, const std::string startPath,
             currDirectory = startPath.substr(0, dirSize);
             dirSize = startPath.find_first_of('/', dirSize + 1);
         }
-        if(!fsIsDirectory(currDirectory)) {
+        if(!fsIsDirectory(currDirectory) && !fsIsArchive(currDirectory)) {
             while(!directoryStack.empty()) directoryStack.pop();
             currDirectory = rootDirectory;
         }
     }
     
-    std::vector<SelectableElement> elements;
-    uiGetDirContentsSorted(elements, currDirectory, directoryStack.empty());
+    UiList list;
+    FsDirStream* stream = uiGetDirContentsSorted(list, currDirectory, directoryStack.empty());
+    FsDirSizer* sizer = NULL; // started once the listing is complete
+    bool sized = false;
+    FsDirStream* check = NULL; // lists a folder again that was shown from the session snapshot
+    std::vector<FileInfoEx> checked;
     if (onUpdateDir) onUpdateDir(&currDirectory);
     
     bool updateContents = false;
     bool resetCursor = true;
     SelectableElement* selected;
-    bool result = uiSelectMultiple(startPath, elements,
-        [&](std::vector<SelectableElement> &currElements, bool &elementsDirty, bool &resetCursorIfDirty) {
+    bool result = uiSelectMultiple(startPath, list,
+        [&](UiList &currList, bool &elementsDirty, bool &resetCursorIfDirty) {
             if(onLoop != NULL && onLoop(updateContents, resetCursor)) {
                 return true;
             }
@@ -406,12 +737,37 @@ bool uiFileBrowser(const std::string rootDirectory, const std::string startPath,
 
             if(updateContents) {
                 if (onUpdateDir) onUpdateDir(&currDirectory);
-                uiGetDirContentsSorted(currElements, currDirectory, directoryStack.empty());
+                fsDirStreamClose(stream);
+                fsDirSizeClose(sizer);
+                fsDirStreamClose(check);
+                sizer = NULL;
+                sized = false;
+                check = NULL;
+                checked.clear();
+                stream = uiGetDirContentsSorted(currList, currDirectory, directoryStack.empty());
                 elementsDirty = true;
                 resetCursorIfDirty = resetCursor;
                 updateContents = false;
                 resetCursor = true;
-            }
+            } else if(stream != NULL) uiPollDirContents(currList, stream);
+            else if(check != NULL) {
+                std::vector<FileInfoEx> batch;
+                bool finished = fsDirStreamPoll(check, batch);
+                checked.insert(checked.end(), batch.begin(), batch.end());
+                if(finished) { // the fresh listing is cached now, a reload only costs the redraw
+                    fsDirStreamClose(check);
+                    check = NULL;
+                    if(!uiListMatches(currList, checked)) {
+                        updateContents = true;
+                        resetCursor = false;
+                    }
+                    checked.clear();
+                }
+            } else if(!sized && fsDirCacheUnverified(currDirectory)) check = fsDirStreamOpen(currDirectory);
+            else if(!sized) {
+                sizer = fsDirSizeOpen(currDirectory);
+                sized = true;
+            } else if(fsDirSizePoll(sizer)) currList.refresh = true;
 
             return false;
         },
@@ -419,14 +775,8 @@ bool uiFileBrowser(const std::string rootDirectory, const std::string startPath,
             selected = entry;
             onUpdateEntry(entry);
         },
-        [&](std::set<SelectableElement*>* marked) {
-            if(!(*marked).empty()) {
-                SelectableElement* firstMarked = *((*marked).begin());
-                if((*firstMarked).name.compare("..") == 0) {
-                    (*marked).erase(firstMarked);                
-                }
-            }
-            onUpdateMarked(marked);
+        [&](UiMarks* marks) {
+            onUpdateMarked(marks);
         }, 
         [&](SelectableElement* selected) {
             if((*selected).name.compare("..") == 0) {
@@ -436,7 +786,10 @@ bool uiFileBrowser(const std::string rootDirectory, const std::string startPath,
                     updateContents = true;
                 }
                 return false;
-            } else if(fsIsDirectory((*selected).id)) {
+            }
+            int index = uiListFind(list, (*selected).id); // the listing knows the type, no need to ask the card
+            bool isDirectory = (index >= 0) ? ((list.entries[index].flags & UI_ENTRY_DIRECTORY) != 0) : fsIsDirectory((*selected).id);
+            if(isDirectory || fsIsArchive((*selected).id)) { // archives are browsed like folders, broken ones open as files
                 directoryStack.push(currDirectory);
                 currDirectory = (*selected).id;
                 updateContents = true;
@@ -454,10 +807,13 @@ bool uiFileBrowser(const std::string rootDirectory, const std::string startPath,
         },
         useTopScreen, false);
 
+    fsDirStreamClose(stream);
+    fsDirSizeClose(sizer);
+    fsDirStreamClose(check);
     return result;
 }
 
-bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offset, u32 &markedOffset, u32 &markedLength, bool selectMode)> onLoop, std::function<bool(u32 offset)> onUpdate, std::function<bool(u32 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &updateData)> onSelect) {
+bool uiHexViewer(const std::string path, u64 start, std::function<bool(u64 &offset, u64 &markedOffset, u32 &markedLength, bool selectMode)> onLoop, std::function<bool(u64 offset)> onUpdate, std::function<bool(u64 selectedOffset, u32 selectedLength, hid::Button selectButton, bool &updateData)> onSelect, FsPatch* patch) {
     const u32 cpad = 2;
     
     const u32 rows = gpu::BOTTOM_HEIGHT / (8 + (2*cpad));
@@ -465,26 +821,37 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
     const u32 nShown = rows * cols;
     
     const u32 fastMult = 16;
+    const u32 prefetchSize = 256 * 1024; // read-ahead window, a few thousand rows each way
     
     bool result;
     
-    u32 fileSize = fsGetFileSize(path);
+    u64 fileSize = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
     u64 lastScrollTime = 0;
+    u32 revision = (patch != NULL) ? fsPatchRevision(patch) : 0;
     
-    u32 currOffset = start;
-    u32 maxOffset = (fileSize <= nShown) ? 0 :
+    u64 currOffset = start;
+    u64 maxOffset = (fileSize <= nShown) ? 0 :
         ((fileSize % cols) ? fileSize + (cols - (fileSize % cols)) - nShown : fileSize - nShown);
     
     bool selectMode = false;
     hid::Button selectButton = hid::BUTTON_NONE;
-    u32 selectOffset = 0;
-    u32 markedOffset = 0;
+    u64 selectOffset = 0;
+    u64 markedOffset = 0;
     u32 markedLength = 0;
-    u32 markedOffsetPrev = 0;
+    u64 markedOffsetPrev = 0;
     u32 markedLengthPrev = 0;
     
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char indexBuffer[8];
+    char hexBuffer[cols*3];
+    char asciiBuffer[cols];
+    std::string indexString;
+    std::string hexString;
+    std::string asciiString;
+    
     auto redrawHexView = [&](u8* data) {
         static u8* localData = NULL;
+        PROF_SCOPE(PROF_DRAW);
         
         const u8 gr = 0x9F;
         const u8 mr = 0x4F;
@@ -497,35 +864,39 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
         
         uiDrawPositionBar(currOffset, nShown, fileSize);
         
-        for(u32 pos = 0; pos < nShown; ) {
+        // one string each for index, hex and ascii of a row, one rectangle each per marked run
+        const u32 hexLeft = 64 + (((gpu::BOTTOM_WIDTH - 64 - (cols*8)) - ((cols*3 - 1)*8)) / 2);
+        const u32 asciiLeft = gpu::BOTTOM_WIDTH - (cols*8);
+        const u64 markedEnd = markedOffset + markedLength;
+        for(u32 pos = 0; pos < nShown; pos += cols) {
             u32 vDrawPos = gpu::BOTTOM_HEIGHT - (((u32) (pos / cols) + 1) * (8 + (2*cpad))) + cpad;
+            u64 rowOffset = currOffset + pos;
             
-            std::stringstream ssIndex;
-            ssIndex << std::hex << std::uppercase << std::setfill('0') << std::setw(8) << (currOffset + pos);
-            gput::drawString(ssIndex.str(), 0, vDrawPos, 8, 8, gr, gr, gr);
+            u32 index = (u32) rowOffset; // low 32 bit only, full offset is on the top screen
+            for(u32 i = 0; i < 8; i++) indexBuffer[i] = hexDigits[(index >> (28 - (4*i))) & 0xF];
+            gput::drawString(indexString.assign(indexBuffer, 8), 0, vDrawPos, 8, 8, gr, gr, gr);
             
-            if(currOffset + pos < fileSize) {
-                std::stringstream ssAscii;
-                std::stringstream ssHex;
-                ssHex << std::hex << std::uppercase << std::setfill('0');
-                do {
-                    if(currOffset + pos < fileSize) {
-                        u32 hDrawPos = 64 + (32 - (cols * cpad)) + ((pos % cols) * 2 * (8 + cpad)) + cpad;
-                        u8 symbol = localData[pos];
-                        if ((currOffset + pos >= markedOffset) && (currOffset + pos < markedOffset + markedLength)) {
-                            uiDrawRectangle(hDrawPos - 1, vDrawPos - 1, 2 + (2*8), 2 + 1 + 8, mr, mr, mr);
-                            uiDrawRectangle(gpu::BOTTOM_WIDTH - ((cols-(pos%cols))*8) - 1, vDrawPos - 1,
-                                2 + 8, 2 + 1 + 8, mr, mr, mr);
-                        }
-                        ssHex << std::setw(2) << (u32) symbol;
-                        gput::drawString(ssHex.str(), hDrawPos, vDrawPos, 8, 8);
-                        ssHex.str("");
-                        ssAscii << (((symbol != 0x00) && (symbol != 0x0A) && (symbol != 0x0D)) ? (char) symbol : (char) ' ');
-                    }
-                    pos++;
-                } while(pos % cols);
-                gput::drawString(ssAscii.str(), gpu::BOTTOM_WIDTH - (cols*8), vDrawPos, 8, 8, gr, gr, gr);
-            } else pos += cols;
+            if(rowOffset >= fileSize) continue;
+            u32 rowLength = (fileSize - rowOffset < cols) ? (u32) (fileSize - rowOffset) : cols;
+            
+            u64 runStart = (markedOffset > rowOffset) ? markedOffset : rowOffset;
+            u64 runEnd = (markedEnd < rowOffset + rowLength) ? markedEnd : rowOffset + rowLength;
+            if(runStart < runEnd) {
+                u32 first = (u32) (runStart - rowOffset);
+                u32 count = (u32) (runEnd - runStart);
+                uiDrawRectangle(hexLeft + (first*3*8) - 1, vDrawPos - 1, 2 + (((count*3) - 1)*8), 2 + 1 + 8, mr, mr, mr);
+                uiDrawRectangle(asciiLeft + (first*8) - 1, vDrawPos - 1, 2 + (count*8), 2 + 1 + 8, mr, mr, mr);
+            }
+            
+            for(u32 i = 0; i < rowLength; i++) {
+                u8 symbol = localData[pos + i];
+                hexBuffer[(i*3) + 0] = hexDigits[symbol >> 4];
+                hexBuffer[(i*3) + 1] = hexDigits[symbol & 0xF];
+                hexBuffer[(i*3) + 2] = ' ';
+                asciiBuffer[i] = ((symbol != 0x00) && (symbol != 0x0A) && (symbol != 0x0D)) ? (char) symbol : (char) ' ';
+            }
+            gput::drawString(hexString.assign(hexBuffer, (rowLength*3) - 1), hexLeft, vDrawPos, 8, 8);
+            gput::drawString(asciiString.assign(asciiBuffer, rowLength), asciiLeft, vDrawPos, 8, 8, gr, gr, gr);
         }
         
         gpu::flushCommands();
@@ -538,7 +909,8 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
     };
     
     result = fsDataProvider(path, start, nShown,
-        [&](u32 &offset, bool &forceRefresh) { // onLoop
+        [&](u64 &offset, bool &forceRefresh) { // onLoop
+            PROF_FRAME();
             hid::poll();
             
             if(!selectMode) { // standard hexviewer mode
@@ -561,7 +933,7 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
                     }
                 } else if(hid::held(hid::BUTTON_UP) || hid::held(hid::BUTTON_LEFT)) {
                     if(lastScrollTime == 0 || core::time() - lastScrollTime >= 120) {
-                        u32 sub = (hid::held(hid::BUTTON_L)) ?
+                        u64 sub = (hid::held(hid::BUTTON_L)) ?
                             (hid::held(hid::BUTTON_LEFT) ? fastMult * fastMult * nShown : fastMult * nShown) :
                             (hid::held(hid::BUTTON_LEFT) ? nShown : cols);
                         offset = (offset > sub) ? offset - sub : 0;
@@ -608,7 +980,7 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
                                 markedOffset--;
                             selectOffset = markedOffset;
                         } else{
-                            u32 selectionEnd = (markedOffset < selectOffset) ?
+                            u64 selectionEnd = (markedOffset < selectOffset) ?
                                 markedOffset : markedOffset + markedLength - 1;
                             if(hid::held(hid::BUTTON_DOWN))
                                 selectionEnd += cols;
@@ -644,8 +1016,12 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
                 if(markedOffset >= fileSize) markedOffset = fileSize - 1;
             }
             
+            if((patch != NULL) && (fsPatchRevision(patch) != revision)) { // edited or undone elsewhere
+                revision = fsPatchRevision(patch);
+                forceRefresh = true;
+            }
             if(forceRefresh) {
-                fileSize = fsGetFileSize(path);
+                fileSize = (patch != NULL) ? fsPatchSize(patch) : fsGetFileSize(path);
                 maxOffset = (fileSize <= nShown) ? 0 :
                     ((fileSize % cols) ? fileSize + (cols - (fileSize % cols)) - nShown : fileSize - nShown);
                 if(offset > maxOffset) offset = maxOffset;
@@ -687,102 +1063,199 @@ bool uiHexViewer(const std::string path, u32 start, std::function<bool(u32 &offs
             if(redrawHexView(data) || (onUpdate && onUpdate(currOffset)))
                 return true;
             return false;
-        });
+        }, prefetchSize, patch);
     
     return result;
 }
 
-bool uiTextViewer(const std::string path, std::function<bool(void)> onLoop, std::function<bool(u32 offset, u32 plus)> onUpdate) {
+bool uiTextViewer(const std::string path, std::function<bool(u64 &seekLine, u64 &seekOffset)> onLoop, std::function<bool(u64 offset, u32 plus, u64 line)> onUpdate) {
     const u32 nLinesDisp = gpu::BOTTOM_HEIGHT / 8;
     const u32 nCharsDisp = gpu::BOTTOM_WIDTH / 8;
     const u32 lineLenMax = 1 * 1024; // careful, this is a sensitive value
     const u32 bufsizeMax = 16 * nLinesDisp * lineLenMax; // see above
     const u32 safeSize = 2 * lineLenMax * nLinesDisp;
+    const u32 mapKeep = 4 * nLinesDisp; // wrapped lines kept above / below the visible ones
     
     u64 lastScrollTime = 0;
     
-    u32 fileSize = fsDataSearch(path, std::vector<u8>(1, '\0'), 0, true);
-    if(fileSize == (u32) -1) fileSize = fsGetFileSize(path);
+    u64 fileSize = fsGetFileSize(path); // shrinks to the first '\0' once that turns up
     u32 bufsize = (fileSize < bufsizeMax) ? fileSize : bufsizeMax;
     
-    std::vector<u32> bufferMap;
+    FsLineIndex lines;
+    FsLineIndexer* indexer = fsLineIndexOpen(path, lines);
+    
+    std::vector<u32> lineMap; // starts of consecutive wrapped lines, the last entry ends the last line
+    bool mapAtEnd = false;
     char* localData = NULL;
     
-    u32 offsetBuff = (u32) -1;
-    u32 offsetDisp = 0;
-    u32 offsetDispPrev = (u32) -1;
+    u64 offsetBuff = (u64) -1;
+    u64 offsetDisp = 0;
+    u64 offsetDispPrev = (u64) -1;
+    u64 seekTarget = (u64) -1;
+    u64 lineDisp = (u64) -1;
+    u64 lineDispPrev = (u64) -1;
     u32 charIndex = 0;
     u32 charIndexPrev = (u32) -1;
     u32 lineIndex = 0;
-    u32 lineIndexMax = 0;
     u32 lineLenCurr = lineLenMax;
     
-    // MAP LINE OFFSETS IN BUFFER
-    auto buildBufferMap = [&](void) {
-        bufferMap.clear();
-        // build line offset list
-        u32 end = (offsetBuff + bufsize > fileSize) ? fileSize - offsetBuff : bufsize;
-        for (u32 start = 0; start < end;) {
-            u32 lf;
-            for (lf = start; (lf < end) && localData[lf] != '\n'; lf++);
-            while (lf - start > lineLenCurr) {
-                u32 space = (u32) -1;
-                for (u32 p = start + 1; (p < end) && p < start + lineLenCurr; p++)
-                    if(localData[p] == ' ') space = p;
-                if(space == (u32) -1) {
-                    // no appropriate space character found -> forced word wrap
-                    u32 forced = (start + lineLenCurr < end) ? start + lineLenCurr : end;
-                    start = forced;
-                } else start = space;
-                bufferMap.push_back(start);
-            }
-            if(lf < end) {
-                start = lf + 1;
-                bufferMap.push_back(start);
-            } else break;
+    auto dataEnd = [&](void) {
+        if(offsetBuff > fileSize) return (u32) 0;
+        return (u32) ((offsetBuff + bufsize > fileSize) ? fileSize - offsetBuff : bufsize);
+    };
+    
+    // START OF THE NEXT WRAPPED LINE
+    auto wrapNext = [&](u32 start, u32 end) {
+        u32 span = (end - start > lineLenCurr) ? lineLenCurr + 1 : end - start;
+        const char* lf = (const char*) memchr(localData + start, '\n', span);
+        if(lf != NULL) return (u32) (lf - localData) + 1;
+        if(end - start <= lineLenCurr) return end;
+        u32 space = (u32) -1;
+        for (u32 p = start + 1; p < start + lineLenCurr; p++)
+            if(localData[p] == ' ') space = p;
+        // no appropriate space character found -> forced word wrap
+        return (space == (u32) -1) ? start + lineLenCurr : space;
+    };
+    
+    // START OF THE TEXT LINE CONTAINING POS, NOT SEARCHING BEYOND LIMIT
+    auto lineStartAt = [&](u32 pos, u32 limit) {
+        while((pos > limit) && (localData[pos - 1] != '\n')) pos--;
+        return pos;
+    };
+    
+    // WRAP ONLY AROUND THE VISIBLE LINES, STARTING AT A TEXT LINE
+    auto mapReset = [&](u32 origin) {
+        lineMap.assign(1, origin);
+        mapAtEnd = false;
+        lineIndex = 0;
+    };
+    
+    auto mapForward = [&](u32 count) {
+        u32 end = dataEnd();
+        while(!mapAtEnd && (lineMap.size() <= lineIndex + count)) {
+            if(lineMap.back() >= end) mapAtEnd = true;
+            else lineMap.push_back(wrapNext(lineMap.back(), end));
         }
-        bufferMap.push_back(end);
-        lineIndexMax = (bufferMap.size() > nLinesDisp) ? bufferMap.size() - nLinesDisp : 0;
-        
-        // normalize lineIndex
-        for (lineIndex = lineIndexMax; (lineIndex > 0) &&
-            (offsetDisp - offsetBuff < bufferMap.at(lineIndex - 1)); lineIndex--);
+        if(lineIndex > mapKeep) {
+            lineMap.erase(lineMap.begin(), lineMap.begin() + (lineIndex - mapKeep));
+            lineIndex = mapKeep;
+        }
+        return lineMap.size() - 1 - lineIndex; // wrapped lines from lineIndex on
+    };
+    
+    auto mapBackward = [&](void) {
+        u32 origin = lineMap.front();
+        if(origin == 0) return false;
+        std::vector<u32> above;
+        u32 end = dataEnd();
+        for (u32 start = lineStartAt(origin - 1, 0); start < origin; start = wrapNext(start, end))
+            above.push_back(start);
+        lineMap.insert(lineMap.begin(), above.begin(), above.end());
+        lineIndex += above.size();
+        if(lineMap.size() > lineIndex + nLinesDisp + mapKeep + 1) {
+            lineMap.resize(lineIndex + nLinesDisp + mapKeep + 1);
+            mapAtEnd = false;
+        }
+        return true;
+    };
+    
+    // KEEP THE LAST PAGE FULL
+    auto mapSettle = [&](void) {
+        while((mapForward(nLinesDisp) < nLinesDisp) && ((lineIndex > 0) || mapBackward()))
+            lineIndex--;
+    };
+    
+    auto seekTo = [&](u64 target) {
+        if(target > fileSize) target = fileSize;
+        if((target >= offsetBuff) && (target - offsetBuff <= dataEnd())) {
+            u32 origin = target - offsetBuff;
+            u32 limit = (origin > lineLenMax) ? origin - lineLenMax : 0;
+            u32 start = lineStartAt(origin, limit);
+            mapReset(((start > limit) || (start == 0) || (localData[start - 1] == '\n')) ? start : origin);
+            mapSettle();
+        } else seekTarget = target; // the buffer reload below takes care of it
+    };
+    
+    // END OF TEXT, FROM THE BUFFER OR THE LINE INDEX
+    auto setTextEnd = [&](u64 end) {
+        if(end >= fileSize) return;
+        fileSize = end;
+        if((offsetBuff > fileSize) || (offsetBuff + lineMap.back() > fileSize))
+            seekTo((offsetDisp < fileSize) ? offsetDisp : fileSize);
+    };
+    
+    // LINE NUMBER FROM THE NEAREST CHECKPOINT
+    auto lineAt = [&](u64 pos) {
+        if(pos > lines.scanned) return (u64) -1;
+        FsLineMark mark = fsLineIndexFindOffset(lines, pos);
+        if(mark.offset < offsetBuff) { // a short read at most, see fsLineIndexAdvance
+            mark = fsLineIndexAdvance(path, mark, offsetBuff);
+            if(mark.offset != offsetBuff) return (u64) -1;
+        }
+        return mark.line + std::count(localData + (mark.offset - offsetBuff), localData + (pos - offsetBuff), '\n');
     };
     
     bool result = fsDataProvider(path, 0, bufsize,
-        [&](u32 &offset, bool &forceRefresh) { // onLoop
+        [&](u64 &offset, bool &forceRefresh) { // onLoop
+            PROF_FRAME();
             if(offsetBuff != offset) {
                 offsetBuff = offset;
-                buildBufferMap();
+                if(seekTarget != (u64) -1) {
+                    u64 target = seekTarget;
+                    seekTarget = (u64) -1;
+                    seekTo(target);
+                } else mapReset((offsetDisp > offsetBuff) ? offsetDisp - offsetBuff : 0);
+                const char* nul = (const char*) memchr(localData, '\0', dataEnd());
+                if(nul != NULL) setTextEnd(offsetBuff + (nul - localData));
             }
             
-            hid::poll();   
+            hid::poll();
+            bool indexed = lines.complete;
+            fsLineIndexPoll(indexer, lines);
+            setTextEnd(lines.firstNul);
             
             // ONLOOP FUNCTION
-            if(onLoop && onLoop()) return true;
+            u64 seekLine = (u64) -1;
+            u64 seekOffset = (u64) -1;
+            if(onLoop && onLoop(seekLine, seekOffset)) return true;
             
             // PROCESS INPUT
             if(hid::pressed(hid::BUTTON_B)) {
                 return true;
             } else if(hid::pressed(hid::BUTTON_X)) {
+                // rewrap from the start of the current text line only
+                u32 anchor = lineMap.at(lineIndex);
                 lineLenCurr = (lineLenCurr == lineLenMax) ? nCharsDisp : lineLenMax;
                 charIndex = 0;
-                buildBufferMap();
+                mapReset(lineStartAt(anchor, 0));
+                while((mapForward(2) >= 2) && (lineMap.at(lineIndex + 1) <= anchor))
+                    lineIndex++;
+            }
+            if(seekLine != (u64) -1) {
+                while(!fsLineIndexPoll(indexer, lines) && (seekLine >= lines.lineCount) && core::running()) {
+                    hid::poll();
+                    if(hid::pressed(hid::BUTTON_B)) break;
+                    u32 progress = (fileSize > 0) ? (u32) ((lines.scanned >= fileSize) ? 100 : lines.scanned / ((fileSize + 99) / 100)) : 100;
+                    uiDisplayProgress(gpu::SCREEN_TOP, "Indexing", uiTruncateString(path, 36, 0) + "\nPress B to cancel.", false, progress);
+                }
+                if(seekLine >= lines.lineCount) seekLine = (lines.lineCount > 0) ? lines.lineCount - 1 : 0;
+                u64 target = fsLineIndexSeek(path, lines, seekLine);
+                if(target != (u64) -1) seekOffset = target;
             }
+            if(seekOffset != (u64) -1) seekTo(seekOffset);
+            
             if(hid::held(hid::BUTTON_LEFT) || hid::held(hid::BUTTON_RIGHT) ||
                hid::held(hid::BUTTON_UP) || hid::held(hid::BUTTON_DOWN) ||
                hid::held(hid::BUTTON_L) || hid::held(hid::BUTTON_R)) {
                 if(lastScrollTime == 0 || core::time() - lastScrollTime >= 120) {
-                    if(hid::held(hid::BUTTON_DOWN) && (lineIndex < lineIndexMax)) {
-                        lineIndex++;
-                    } else if(hid::held(hid::BUTTON_UP) && (lineIndex > 0)) {
-                        lineIndex--;
-                    } else if(hid::held(hid::BUTTON_R)) {
-                        lineIndex = (lineIndex + nLinesDisp < lineIndexMax) ?
-                            lineIndex + nLinesDisp : lineIndexMax;
-                    } else if(hid::held(hid::BUTTON_L)) {
-                        lineIndex = (lineIndex > nLinesDisp) ?
-                            lineIndex - nLinesDisp : 0;
+                    if(hid::held(hid::BUTTON_DOWN) || hid::held(hid::BUTTON_R)) {
+                        for (u32 n = hid::held(hid::BUTTON_DOWN) ? 1 : nLinesDisp;
+                            n && (mapForward(nLinesDisp + 1) > nLinesDisp); n--)
+                            lineIndex++;
+                    } else if(hid::held(hid::BUTTON_UP) || hid::held(hid::BUTTON_L)) {
+                        for (u32 n = hid::held(hid::BUTTON_UP) ? 1 : nLinesDisp;
+                            n && ((lineIndex > 0) || mapBackward()); n--)
+                            lineIndex--;
                     } else if(hid::held(hid::BUTTON_RIGHT) && (charIndex + nCharsDisp < lineLenCurr)) {
                         charIndex++;
                     } else if(hid::held(hid::BUTTON_LEFT) && (charIndex)) {
@@ -796,12 +1269,13 @@ bool uiTextViewer(const std::string path, std::function<bool(void)> onLoop, std:
             
             // BUILD STRING TO DISPLAY ON SCREEN
             std::string dispString;
-            u32 dispStart = (lineIndex) ? bufferMap.at(lineIndex - 1) : 0;
+            mapForward(nLinesDisp);
+            u32 dispStart = lineMap.at(lineIndex);
             u32 lineStart = dispStart;
             offsetDisp = offsetBuff + dispStart;
             for (u32 l = 0; l < nLinesDisp; l++) {
-                if(lineIndex + l < bufferMap.size()) {
-                    u32 lineEnd = bufferMap.at(lineIndex + l);
+                if(lineIndex + l + 1 < lineMap.size()) {
+                    u32 lineEnd = lineMap.at(lineIndex + l + 1);
                     std::string lineString(localData + lineStart, lineEnd - lineStart);
                     for (u32 badchar = lineString.find_first_of("\n\r");
                          badchar != std::string::npos;
@@ -816,20 +1290,27 @@ bool uiTextViewer(const std::string path, std::function<bool(void)> onLoop, std:
             u32 dispEnd = lineStart;
             
             // BUFFER CHECK (RELOAD IF RUNNING OUT)
-            if(fileSize > bufsize) { // no need if the whole file fits into the buffer
+            if(seekTarget != (u64) -1) {
+                offset = (seekTarget > (bufsize / 2)) ? seekTarget - (bufsize / 2) : 0;
+                if(offset + bufsize > fileSize) offset = (fileSize > bufsize) ? fileSize - bufsize : 0;
+            } else if(fileSize > bufsize) { // no need if the whole file fits into the buffer
                 if((dispStart < safeSize) || (bufsize - dispStart < safeSize))
                     offset = (offsetDisp > (bufsize / 2)) ? offsetDisp - (bufsize / 2) : 0;
             }
             
             // ONUPDATE FUNCTION
-            if((offsetDisp != offsetDispPrev) || (charIndex != charIndexPrev)) {
-                if((onUpdate != NULL) && onUpdate(offsetDisp, charIndex))
+            if((offsetDisp != offsetDispPrev) || (!indexed && (lineDisp == (u64) -1)))
+                lineDisp = lineAt(offsetDisp);
+            if((offsetDisp != offsetDispPrev) || (charIndex != charIndexPrev) || (lineDisp != lineDispPrev)) {
+                if((onUpdate != NULL) && onUpdate(offsetDisp, charIndex, lineDisp))
                     return true;
                 offsetDispPrev = offsetDisp;
                 charIndexPrev = charIndex;
+                lineDispPrev = lineDisp;
             }
             
             // ON SCREEN DISPLAY
+            PROF_BEGIN(PROF_DRAW);
             gpu::setViewport(gpu::SCREEN_BOTTOM, 0, 0, gpu::BOTTOM_WIDTH, gpu::BOTTOM_HEIGHT);
             gput::setOrtho(0, gpu::BOTTOM_WIDTH, 0, gpu::BOTTOM_HEIGHT, -1, 1);
             gpu::clear();
@@ -840,6 +1321,7 @@ bool uiTextViewer(const std::string path, std::function<bool(void)> onLoop, std:
             
             gpu::flushCommands();
             gpu::flushBuffer();
+            PROF_END(PROF_DRAW);
             gpu::swapBuffers(true);
             
             return false;
@@ -847,8 +1329,9 @@ bool uiTextViewer(const std::string path, std::function<bool(void)> onLoop, std:
         [&](u8* data) { // onUpdate
             localData = (char*) data;
             return false;
-        });
+        }, (fileSize > bufsize) ? 4 * bufsize : 0);
     
+    fsLineIndexClose(indexer);
     return result;
 }
 
@@ -866,6 +1349,7 @@ void uiDisplayMessage(gpu::Screen screen, const std::string message) {
     gpu::flushCommands();
     gpu::flushBuffer();
     gpu::swapBuffers(true);
+    screenGeneration++;
 
     gpu::setViewport(gpu::SCREEN_TOP, 0, 0, gpu::TOP_WIDTH, gpu::TOP_HEIGHT);
     gput::setOrtho(0, gpu::TOP_WIDTH, 0, gpu::TOP_HEIGHT, -1, 1);
@@ -958,7 +1442,9 @@ std::string uiKeyboardInput(std::string preset, const std::string alphabet) {
         swkbdSetValidation(&swkbd, SWKBD_NOTEMPTY_NOTBLANK, SWKBD_FILTER_BACKSLASH, 0);
         swkbdSetFeatures(&swkbd, SWKBD_DARKEN_TOP_SCREEN);
         swkbdSetInitialText(&swkbd, resultStr.c_str());
-        if(swkbdInputText(&swkbd, textbuffer, sizeof(textbuffer)) == SWKBD_BUTTON_CONFIRM) {
+        SwkbdButton button = swkbdInputText(&swkbd, textbuffer, sizeof(textbuffer));
+        screenGeneration++;
+        if(button == SWKBD_BUTTON_CONFIRM) {
             resultStr = std::string(textbuffer);
             if(resultStr.find_first_not_of(alphabet, 0) != std::string::npos) {
                 uiPrompt(gpu::SCREEN_TOP, (std::string) "Input contains invalid characters." + "\n" + "Try again?" + "\n", true);
@@ -1137,16 +1623,16 @@ std::string uiStringInput(gpu::Screen screen, std::string preset, const std::str
     return resultStr;
 }
 
-u32 uiNumberInput(gpu::Screen screen, u32 preset, const std::string message, bool hex) {
+u64 uiNumberInput(gpu::Screen screen, u64 preset, const std::string message, bool hex, u32 hexDigits) {
     std::string resultStr;
-    u32 result;
+    u64 result;
     
     std::stringstream input;
     if(!hex) input << preset;
-    else input << std::setfill('0') << std::uppercase << std::hex << std::setw(8) << preset;
+    else input << std::setfill('0') << std::uppercase << std::hex << std::setw(hexDigits) << preset;
     
     resultStr = uiStringInput(screen, input.str(), (hex) ? "0123456789ABCDEF" : "0123456789", message, !hex);
-    if(resultStr.empty()) return (u32) -1;
+    if(resultStr.empty()) return (u64) -1;
     
     std::istringstream output(resultStr);
     if(!hex) output >> result;
@@ -1203,9 +1689,11 @@ void uiDisplayProgress(gpu::Screen screen, const std::string operation, const st
 
     gpu::clear();
     gput::drawString(str, (screenWidth - gput::getStringWidth(str, 8)) / 2, (screenHeight - gput::getStringHeight(str, 8)) / 2, 8, 8);
+    if(screen == gpu::SCREEN_TOP) PROF_OVERLAY();
     gpu::flushCommands();
     gpu::flushBuffer();
     gpu::swapBuffers(!quickSwap);
+    screenGeneration++;
 
     gpu::setViewport(gpu::SCREEN_TOP, 0, 0, gpu::TOP_WIDTH, gpu::TOP_HEIGHT);
     gput::setOrtho(0, gpu::TOP_WIDTH, 0, gpu::TOP_HEIGHT, -1, 1);
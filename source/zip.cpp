@@ -0,0 +1,584 @@
+#include "zip.hpp"
+#include "fs.hpp"
+
+#include <sys/errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#define ZIP_WINDOW 0x8000 // deflate distances reach back 32 KiB
+#define ZIP_FAST_BITS 9
+#define ZIP_INBUF (16 * 1024)
+#define ZIP_SPAN (1024 * 1024) // output between two restart points, at least
+#define ZIP_POINT_BYTES (1024 * 1024) // restart points per reader, the span grows with the member
+#define ZIP_POINTS (ZIP_POINT_BYTES / sizeof(ZipInflate))
+#define ZIP_OVERRUN 8 // bytes past the end of the data before it counts as broken
+#define ZIP_TAIL (0xFFFF + 22) // end of central directory record with the longest comment
+#define ZIP_DIRBUF (256 * 1024) // holds the longest central directory record
+#define ZIP_SIG_LOCAL 0x04034B50
+#define ZIP_SIG_CENTRAL 0x02014B50
+#define ZIP_SIG_END 0x06054B50
+#define ZIP_SIG_END64 0x06064B50
+#define ZIP_SIG_LOCATOR64 0x07064B50
+
+typedef enum {
+    ZIP_MODE_HEADER,
+    ZIP_MODE_STORED,
+    ZIP_MODE_CODES,
+    ZIP_MODE_DONE,
+    ZIP_MODE_ERROR
+} ZipMode;
+
+typedef struct {
+    u16 count[16]; // codes per length
+    u16 symbol[288]; // ordered by code
+    u16 fast[1 << ZIP_FAST_BITS]; // symbol | (length << 9) for the short codes, 0 for the longer ones
+} ZipHuffman;
+
+typedef struct {
+    u64 inPos; // compressed bytes taken into bits, only kept up to date in restart points
+    u64 outPos;
+    u32 bits;
+    u32 bitCount;
+    u32 overrun;
+    u32 mode;
+    bool last; // the current block is the final one
+    u32 left; // stored bytes or match bytes still to go
+    u32 distance; // of the match being copied
+    ZipHuffman lit;
+    ZipHuffman dist;
+    u8 window[ZIP_WINDOW];
+} ZipInflate;
+
+struct ZipReader {
+    ZipEntry entry;
+    u64 dataOffset;
+    ZipReadFunc read;
+    ZipInflate state; // everything a restart point needs, copied as a whole
+    std::vector<ZipInflate> points; // points[i] is at (i + 1) * span
+    u64 span;
+    bool seekable; // points are only kept once the reader had to go back, copies never pay for them
+    u64 crcPos; // output checked in order from the start
+    u32 crc32;
+    u8 input[ZIP_INBUF];
+    u64 inBase; // compressed offset of input[0]
+    u32 inFill;
+    u32 inHead;
+};
+
+const u16 zipLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const u8 zipLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const u16 zipDistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const u8 zipDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const u8 zipCodeOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+inline u16 zipGet16(const u8* data) {
+    return data[0] | (data[1] << 8);
+}
+
+inline u32 zipGet32(const u8* data) {
+    return zipGet16(data) | ((u32) zipGet16(data + 2) << 16);
+}
+
+inline u64 zipGet64(const u8* data) {
+    return zipGet32(data) | ((u64) zipGet32(data + 4) << 32);
+}
+
+bool zipCleanName(std::string &name, bool &isDirectory) {
+    // '\' from some Windows tools becomes '/', names that would leave the extraction folder are dropped
+    std::replace(name.begin(), name.end(), '\\', '/');
+    isDirectory = !name.empty() && (name[name.size() - 1] == '/');
+    while(!name.empty() && (name[name.size() - 1] == '/')) name.erase(name.size() - 1);
+    while(!name.empty() && (name[0] == '/')) name.erase(0, 1);
+    if(name.empty()) return false;
+    for(size_t start = 0; start <= name.size();) {
+        size_t end = name.find('/', start);
+        if(end == std::string::npos) end = name.size();
+        const std::string component = name.substr(start, end - start);
+        if(component.empty() || (component.compare(".") == 0) || (component.compare("..") == 0)) return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+bool zipReadDirectory(u64 archiveSize, ZipReadFunc read, std::vector<ZipEntry> &entries) {
+    // only the end of the archive and the central directory are read, sorted by name, folders that only
+    // show up in member paths get entries of their own, false with errno set if this is no readable archive
+    entries.clear();
+    u32 tailSize = (archiveSize < ZIP_TAIL) ? archiveSize : ZIP_TAIL;
+    if(tailSize < 22) {
+        errno = EILSEQ;
+        return false;
+    }
+    std::vector<u8> tail(tailSize);
+    if(read(archiveSize - tailSize, tail.data(), tailSize) != tailSize) {
+        errno = EIO;
+        return false;
+    }
+    s64 end = tailSize - 22;
+    for(; (end >= 0) && (zipGet32(&tail[end]) != ZIP_SIG_END); end--);
+    if(end < 0) {
+        errno = EILSEQ;
+        return false;
+    }
+    u64 count = zipGet16(&tail[end + 10]);
+    u64 dirSize = zipGet32(&tail[end + 12]);
+    u64 dirOffset = zipGet32(&tail[end + 16]);
+    if((end >= 20) && (zipGet32(&tail[end - 20]) == ZIP_SIG_LOCATOR64)) { // ZIP64, the real numbers are in another record
+        u8 record[56];
+        if((read(zipGet64(&tail[end - 20 + 8]), record, sizeof(record)) != sizeof(record)) || (zipGet32(record) != ZIP_SIG_END64)) {
+            errno = EILSEQ;
+            return false;
+        }
+        count = zipGet64(record + 32);
+        dirSize = zipGet64(record + 40);
+        dirOffset = zipGet64(record + 48);
+    }
+    if((dirOffset > archiveSize) || (dirSize > archiveSize - dirOffset) || (count > dirSize / 46)) {
+        errno = EILSEQ;
+        return false;
+    }
+
+    // records are parsed straight from a buffer that gets topped up, never the whole directory at once
+    std::vector<u8> buffer((dirSize < ZIP_DIRBUF) ? dirSize : ZIP_DIRBUF);
+    u64 bufferPos = dirOffset; // archive offset of buffer[0]
+    u32 fill = 0;
+    u32 head = 0;
+    auto ensure = [&](u32 need) {
+        if(fill - head >= need) return true;
+        memmove(buffer.data(), buffer.data() + head, fill - head);
+        bufferPos += head;
+        fill -= head;
+        head = 0;
+        u64 left = dirOffset + dirSize - (bufferPos + fill);
+        u32 size = (left < buffer.size() - fill) ? left : buffer.size() - fill;
+        if((size > 0) && (read(bufferPos + fill, buffer.data() + fill, size) != size)) return false;
+        fill += size;
+        return fill >= need;
+    };
+
+    std::map<std::string, ZipEntry> byName; // sorted, each implied folder only gets in once
+    for(u64 i = 0; i < count; i++) {
+        if(!ensure(46) || (zipGet32(&buffer[head]) != ZIP_SIG_CENTRAL)) {
+            errno = EILSEQ;
+            return false;
+        }
+        u32 nameLength = zipGet16(&buffer[head + 28]);
+        u32 extraLength = zipGet16(&buffer[head + 30]);
+        u32 recordSize = 46 + nameLength + extraLength + zipGet16(&buffer[head + 32]);
+        if(!ensure(recordSize)) {
+            errno = EILSEQ;
+            return false;
+        }
+        const u8* record = &buffer[head];
+        ZipEntry entry;
+        entry.flags = zipGet16(record + 8);
+        entry.method = zipGet16(record + 10);
+        entry.crc32 = zipGet32(record + 16);
+        entry.compressedSize = zipGet32(record + 20);
+        entry.size = zipGet32(record + 24);
+        entry.headerOffset = zipGet32(record + 42);
+        for(u32 pos = 0; pos + 4 <= extraLength;) { // ZIP64 extra field, only the values that did not fit are in it
+            const u8* field = record + 46 + nameLength + pos;
+            u32 fieldLength = zipGet16(field + 2);
+            if(pos + 4 + fieldLength > extraLength) break;
+            if(zipGet16(field) == 0x0001) {
+                const u8* value = field + 4;
+                const u8* valueEnd = value + fieldLength;
+                if((entry.size == 0xFFFFFFFF) && (value + 8 <= valueEnd)) entry.size = zipGet64(value), value += 8;
+                if((entry.compressedSize == 0xFFFFFFFF) && (value + 8 <= valueEnd)) entry.compressedSize = zipGet64(value), value += 8;
+                if((entry.headerOffset == 0xFFFFFFFF) && (value + 8 <= valueEnd)) entry.headerOffset = zipGet64(value);
+            }
+            pos += 4 + fieldLength;
+        }
+        entry.name = std::string((const char*) record + 46, nameLength);
+        head += recordSize;
+
+        if(!zipCleanName(entry.name, entry.isDirectory)) continue;
+        if(entry.isDirectory) entry.size = entry.compressedSize = 0;
+        const std::string name = entry.name;
+        if(!byName.insert(std::make_pair(name, entry)).second) continue;
+        for(size_t slash = name.rfind('/'); slash != std::string::npos; slash = name.rfind('/', slash - 1)) {
+            const ZipEntry folder = { name.substr(0, slash), 0, 0, 0, 0, 0, 0, true };
+            if(!byName.insert(std::make_pair(folder.name, folder)).second) break; // so are the folders above it
+        }
+    }
+
+    entries.reserve(byName.size());
+    for(std::map<std::string, ZipEntry>::iterator it = byName.begin(); it != byName.end(); it++)
+        entries.push_back(it->second);
+    return true;
+}
+
+bool zipHuffmanBuild(ZipHuffman* huffman, const u8* lengths, u32 nSymbols) {
+    // canonical codes from their lengths, false if the lengths ask for more codes than there are
+    u16 offsets[16];
+    u32 next[16];
+    memset(huffman->count, 0, sizeof(huffman->count));
+    memset(huffman->fast, 0, sizeof(huffman->fast));
+    for(u32 s = 0; s < nSymbols; s++) huffman->count[lengths[s]]++;
+    huffman->count[0] = 0;
+
+    s32 left = 1;
+    u32 code = 0;
+    u16 offset = 0;
+    for(u32 len = 1; len < 16; len++) {
+        left = (left << 1) - huffman->count[len];
+        if(left < 0) return false;
+        code = (code + huffman->count[len - 1]) << 1;
+        next[len] = code;
+        offsets[len] = offset;
+        offset += huffman->count[len];
+    }
+
+    for(u32 s = 0; s < nSymbols; s++) {
+        u32 len = lengths[s];
+        if(len == 0) continue;
+        huffman->symbol[offsets[len]++] = s;
+        u32 value = next[len]++;
+        if(len > ZIP_FAST_BITS) continue;
+        u32 reversed = 0; // deflate sends codes starting with their top bit
+        for(u32 b = 0; b < len; b++, value >>= 1) reversed = (reversed << 1) | (value & 1);
+        for(u32 i = reversed; i < (1 << ZIP_FAST_BITS); i += (1 << len))
+            huffman->fast[i] = s | (len << 9);
+    }
+    return true;
+}
+
+bool zipRefill(ZipReader* reader) {
+    // the next piece of compressed data, false once it is used up or on a read error
+    reader->inBase += reader->inFill;
+    reader->inHead = 0;
+    reader->inFill = 0;
+    if(reader->inBase >= reader->entry.compressedSize) return false;
+    u64 left = reader->entry.compressedSize - reader->inBase;
+    reader->inFill = reader->read(reader->dataOffset + reader->inBase, reader->input, (left < ZIP_INBUF) ? left : ZIP_INBUF);
+    return reader->inFill > 0;
+}
+
+bool zipFill(ZipReader* reader) {
+    // at least 25 bits in the buffer, past the end of the data it gets zeros
+    ZipInflate* state = &reader->state;
+    while(state->bitCount <= 24) {
+        if((reader->inHead == reader->inFill) && !zipRefill(reader)) {
+            if(reader->inBase < reader->entry.compressedSize) {
+                errno = EIO;
+                return false;
+            } else if(++state->overrun > ZIP_OVERRUN) {
+                errno = EILSEQ;
+                return false;
+            }
+            state->bitCount += 8;
+            continue;
+        }
+        state->bits |= (u32) reader->input[reader->inHead++] << state->bitCount;
+        state->bitCount += 8;
+    }
+    return true;
+}
+
+inline bool zipNeed(ZipReader* reader, u32 count) {
+    return (reader->state.bitCount >= count) || zipFill(reader);
+}
+
+inline u32 zipTake(ZipInflate* state, u32 count) {
+    u32 value = state->bits & ((1 << count) - 1);
+    state->bits >>= count;
+    state->bitCount -= count;
+    return value;
+}
+
+inline void zipPut(ZipInflate* state, u8* out, u32 &n, u8 byte) {
+    state->window[state->outPos & (ZIP_WINDOW - 1)] = byte;
+    state->outPos++;
+    if(out != NULL) out[n] = byte;
+    n++;
+}
+
+int zipDecode(ZipInflate* state, const ZipHuffman* huffman) {
+    // needs 15 bits in the buffer, -1 for a code that is not part of the table
+    u32 fast = huffman->fast[state->bits & ((1 << ZIP_FAST_BITS) - 1)];
+    if(fast != 0) {
+        zipTake(state, fast >> 9);
+        return fast & 0x1FF;
+    }
+    u32 bits = state->bits;
+    s32 code = 0;
+    s32 first = 0;
+    s32 index = 0;
+    for(u32 len = 1; len < 16; len++) {
+        code |= bits & 1;
+        bits >>= 1;
+        s32 count = huffman->count[len];
+        if(code - first < count) {
+            zipTake(state, len);
+            return huffman->symbol[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+bool zipInflateTables(ZipReader* reader) {
+    // the code lengths of a dynamic block, which are Huffman coded themselves
+    ZipInflate* state = &reader->state;
+    u8 lengths[286 + 30];
+    if(!zipNeed(reader, 14)) return false;
+    u32 nLit = zipTake(state, 5) + 257;
+    u32 nDist = zipTake(state, 5) + 1;
+    u32 nCode = zipTake(state, 4) + 4;
+    if((nLit > 286) || (nDist > 30)) return false;
+    memset(lengths, 0, 19);
+    for(u32 i = 0; i < nCode; i++) {
+        if(!zipNeed(reader, 3)) return false;
+        lengths[zipCodeOrder[i]] = zipTake(state, 3);
+    }
+    ZipHuffman* codes = &state->dist; // not needed before the end of the header
+    if(!zipHuffmanBuild(codes, lengths, 19)) return false;
+
+    for(u32 i = 0; i < nLit + nDist;) {
+        if(!zipNeed(reader, 15 + 7)) return false;
+        int symbol = zipDecode(state, codes);
+        if(symbol < 0) return false;
+        if(symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+        u8 len = 0;
+        u32 repeat;
+        if(symbol == 16) {
+            if(i == 0) return false;
+            len = lengths[i - 1];
+            repeat = 3 + zipTake(state, 2);
+        } else if(symbol == 17) repeat = 3 + zipTake(state, 3);
+        else repeat = 11 + zipTake(state, 7);
+        if(i + repeat > nLit + nDist) return false;
+        for(; repeat > 0; repeat--) lengths[i++] = len;
+    }
+    if(lengths[256] == 0) return false; // there has to be an end of block code
+    return zipHuffmanBuild(&state->lit, lengths, nLit) && zipHuffmanBuild(&state->dist, lengths + nLit, nDist);
+}
+
+bool zipInflateHeader(ZipReader* reader) {
+    ZipInflate* state = &reader->state;
+    if(state->last) {
+        state->mode = ZIP_MODE_DONE;
+        return true;
+    }
+    if(!zipNeed(reader, 3)) return false;
+    state->last = zipTake(state, 1) != 0;
+    u32 type = zipTake(state, 2);
+    if(type == 0) { // stored, starts at the next byte with its length and the inverted length
+        zipTake(state, state->bitCount & 7);
+        if(!zipNeed(reader, 16)) return false;
+        u32 len = zipTake(state, 16);
+        if(!zipNeed(reader, 16)) return false;
+        if(zipTake(state, 16) != (~len & 0xFFFF)) return false;
+        state->left = len;
+        state->mode = ZIP_MODE_STORED;
+    } else if(type == 1) { // fixed codes
+        u8 lengths[288];
+        memset(lengths, 8, 144);
+        memset(lengths + 144, 9, 112);
+        memset(lengths + 256, 7, 24);
+        memset(lengths + 280, 8, 8);
+        zipHuffmanBuild(&state->lit, lengths, 288);
+        memset(lengths, 5, 30);
+        zipHuffmanBuild(&state->dist, lengths, 30);
+        state->mode = ZIP_MODE_CODES;
+    } else if(type == 2) {
+        if(!zipInflateTables(reader)) return false;
+        state->mode = ZIP_MODE_CODES;
+    } else return false;
+    return true;
+}
+
+bool zipInflateStored(ZipReader* reader, u8* out, u32 &n, u32 size) {
+    ZipInflate* state = &reader->state;
+    while((state->left > 0) && (n < size)) {
+        u8 byte;
+        if(state->bitCount >= 8) byte = zipTake(state, 8); // whole bytes left over from the header
+        else if((reader->inHead < reader->inFill) || zipRefill(reader)) byte = reader->input[reader->inHead++];
+        else {
+            errno = (reader->inBase < reader->entry.compressedSize) ? EIO : EILSEQ;
+            return false;
+        }
+        zipPut(state, out, n, byte);
+        state->left--;
+    }
+    if(state->left == 0) state->mode = ZIP_MODE_HEADER;
+    return true;
+}
+
+bool zipInflateCodes(ZipReader* reader, u8* out, u32 &n, u32 size) {
+    ZipInflate* state = &reader->state;
+    while(n < size) {
+        if(state->left > 0) { // a match that did not fit into the last call
+            for(; (state->left > 0) && (n < size); state->left--)
+                zipPut(state, out, n, state->window[(state->outPos - state->distance) & (ZIP_WINDOW - 1)]);
+            continue;
+        }
+        if(!zipNeed(reader, 15)) return false;
+        int symbol = zipDecode(state, &state->lit);
+        if(symbol < 0) return false;
+        if(symbol < 256) {
+            zipPut(state, out, n, symbol);
+            continue;
+        } else if(symbol == 256) {
+            state->mode = ZIP_MODE_HEADER;
+            return true;
+        }
+        symbol -= 257;
+        if((symbol >= 29) || !zipNeed(reader, 5)) return false;
+        u32 length = zipLengthBase[symbol] + zipTake(state, zipLengthExtra[symbol]);
+        if(!zipNeed(reader, 15)) return false;
+        symbol = zipDecode(state, &state->dist);
+        if((symbol < 0) || (symbol >= 30) || !zipNeed(reader, 13)) return false;
+        u32 distance = zipDistBase[symbol] + zipTake(state, zipDistExtra[symbol]);
+        if(distance > state->outPos) return false;
+        state->left = length;
+        state->distance = distance;
+    }
+    return true;
+}
+
+u32 zipInflateRun(ZipReader* reader, u8* out, u32 size) {
+    // up to size bytes, out may be NULL to skip them, less at the end of the data or on an error
+    ZipInflate* state = &reader->state;
+    u32 n = 0;
+    while((n < size) && (state->mode != ZIP_MODE_DONE) && (state->mode != ZIP_MODE_ERROR)) {
+        bool ret = false;
+        errno = 0;
+        if(state->mode == ZIP_MODE_HEADER) ret = zipInflateHeader(reader);
+        else if(state->mode == ZIP_MODE_STORED) ret = zipInflateStored(reader, out, n, size);
+        else ret = zipInflateCodes(reader, out, n, size);
+        if(!ret) {
+            if(errno == 0) errno = EILSEQ;
+            state->mode = ZIP_MODE_ERROR;
+        }
+    }
+    return n;
+}
+
+void zipReset(ZipReader* reader) {
+    ZipInflate* state = &reader->state;
+    state->inPos = 0;
+    state->outPos = 0;
+    state->bits = 0;
+    state->bitCount = 0;
+    state->overrun = 0;
+    state->mode = ZIP_MODE_HEADER;
+    state->last = false;
+    state->left = 0;
+    state->distance = 0;
+    reader->inBase = 0;
+    reader->inFill = 0;
+    reader->inHead = 0;
+}
+
+void zipSeek(ZipReader* reader, u64 offset) {
+    // continues from the closest restart point at or before offset, unless the current position is closer
+    ZipInflate* state = &reader->state;
+    u64 index = offset / reader->span;
+    if(index > reader->points.size()) index = reader->points.size();
+    if((state->outPos <= offset) && (state->outPos >= index * reader->span)) return;
+    if(index == 0) zipReset(reader);
+    else {
+        reader->state = reader->points[index - 1];
+        reader->inBase = reader->state.inPos;
+        reader->inFill = 0;
+        reader->inHead = 0;
+    }
+}
+
+u32 zipInflateStep(ZipReader* reader, u8* out, u64 size) {
+    // stops at the next restart point to keep it, if the reader keeps them
+    ZipInflate* state = &reader->state;
+    if(reader->seekable) {
+        u64 next = (state->outPos / reader->span + 1) * reader->span;
+        if(size > next - state->outPos) size = next - state->outPos;
+    }
+    u32 n = zipInflateRun(reader, out, (size < ZIP_SPAN) ? size : ZIP_SPAN);
+    if(reader->seekable && (reader->points.size() < ZIP_POINTS) && (state->outPos == (reader->points.size() + 1) * reader->span)) {
+        state->inPos = reader->inBase + reader->inHead;
+        reader->points.push_back(*state);
+    }
+    return n;
+}
+
+ZipReader* zipOpen(const ZipEntry &entry, ZipReadFunc read) {
+    // NULL with errno set for folders, encrypted members and anything that is neither stored nor deflated
+    u8 header[30];
+    if(entry.isDirectory) {
+        errno = EISDIR;
+        return NULL;
+    } else if((entry.flags & 0x0001) || ((entry.method != 0) && (entry.method != 8))) {
+        errno = ENOTSUP;
+        return NULL;
+    } else if(read(entry.headerOffset, header, sizeof(header)) != sizeof(header)) {
+        errno = EIO;
+        return NULL;
+    } else if(zipGet32(header) != ZIP_SIG_LOCAL) {
+        errno = EILSEQ;
+        return NULL;
+    }
+
+    ZipReader* reader = new ZipReader;
+    reader->entry = entry;
+    reader->dataOffset = entry.headerOffset + sizeof(header) + zipGet16(header + 26) + zipGet16(header + 28);
+    reader->read = read;
+    reader->span = (entry.size / ZIP_POINTS > ZIP_SPAN) ? ((entry.size / ZIP_POINTS) + ZIP_SPAN - 1) & ~((u64) ZIP_SPAN - 1) : ZIP_SPAN;
+    reader->seekable = false;
+    reader->crcPos = 0;
+    reader->crc32 = 0;
+    if((entry.method == 0) && (entry.compressedSize < entry.size)) reader->entry.size = entry.compressedSize;
+    zipReset(reader);
+    fsCrc32Init();
+    return reader;
+}
+
+void zipSetSeekable(ZipReader* reader) {
+    // for readers that are known to go back, the first seek back does not inflate from the start
+    reader->seekable = true;
+}
+
+u32 zipRead(ZipReader* reader, u64 offset, void* buffer, u32 size) {
+    // any offset, going back restarts from the closest restart point; a member that was read in order
+    // up to its end fails its last read if the data does not match the CRC32 from the directory
+    const u64 total = reader->entry.size;
+    u8* out = (u8*) buffer;
+    u32 done = 0;
+    if(offset >= total) return 0;
+    if(size > total - offset) size = total - offset;
+
+    if(reader->entry.method == 0) done = reader->read(reader->dataOffset + offset, out, size);
+    else {
+        if(offset < reader->state.outPos) reader->seekable = true;
+        zipSeek(reader, offset);
+        while(reader->state.outPos < offset)
+            if(zipInflateStep(reader, NULL, offset - reader->state.outPos) == 0) return 0;
+        while(done < size) {
+            u32 n = zipInflateStep(reader, out + done, size - done);
+            if(n == 0) break;
+            done += n;
+        }
+    }
+
+    if((offset <= reader->crcPos) && (offset + done > reader->crcPos)) {
+        u32 skip = reader->crcPos - offset;
+        reader->crc32 = fsCrc32Update(reader->crc32, out + skip, done - skip);
+        reader->crcPos = offset + done;
+        if((reader->crcPos == total) && (reader->crc32 != reader->entry.crc32)) {
+            errno = EILSEQ;
+            return 0;
+        }
+    }
+    return done;
+}
+
+void zipClose(ZipReader* reader) {
+    delete reader;
+}
@@ -0,0 +1,34 @@
+#ifndef __CTRX_ZIP_HPP__
+#define __CTRX_ZIP_HPP__
+
+#include <citrus/types.hpp>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// read only access to ZIP archives: the central directory, and members streamed
+// out of stored or deflated data without ever holding a whole member in memory
+
+typedef std::function<u32(u64 offset, void* buffer, u32 size)> ZipReadFunc;
+
+typedef struct {
+    std::string name; // path inside the archive, '/' separated, no trailing slash
+    u64 size;
+    u64 compressedSize;
+    u64 headerOffset; // of the local header
+    u32 crc32;
+    u16 method;
+    u16 flags;
+    bool isDirectory;
+} ZipEntry;
+
+struct ZipReader;
+
+bool zipReadDirectory(u64 archiveSize, ZipReadFunc read, std::vector<ZipEntry> &entries);
+ZipReader* zipOpen(const ZipEntry &entry, ZipReadFunc read);
+void zipSetSeekable(ZipReader* reader);
+u32 zipRead(ZipReader* reader, u64 offset, void* buffer, u32 size);
+void zipClose(ZipReader* reader);
+
+#endif